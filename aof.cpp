@@ -0,0 +1,393 @@
+#pragma once
+#include "resp.cpp"
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <errno.h>
+#include <fcntl.h>
+#include <initializer_list>
+#include <mutex>
+#include <stdexcept>
+#include <string.h>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+// AOF 文件为 RESP 编码的写命令序列，重放即可恢复数据
+// 第一条记录为 SHARD <分片序号> <分片数>，用于启动时检查各分片的文件是否属于同一组
+enum class aof_fsync
+{
+    ALWAYS,   // 每轮事件循环写入后 fdatasync, 回复在此之后发送
+    EVERYSEC, // 每轮写入，后台线程每秒 fdatasync 一次
+    NO,       // 只写入，由操作系统决定何时落盘
+};
+
+inline void aof_bulk(std::string &out, char type, size_t n)
+{
+    char buf[24];
+    buf[0] = type;
+    auto end = std::to_chars(buf + 1, buf + sizeof(buf) - 2, n).ptr;
+    *end++ = '\r';
+    *end++ = '\n';
+    out.append(buf, end - buf);
+}
+
+inline void aof_encode(std::string &out, const resp_args &args)
+{
+    aof_bulk(out, '*', args.size());
+    for (size_t i = 0; i < args.size(); i++)
+    {
+        aof_bulk(out, '$', args[i].size());
+        out.append(args[i]).append("\r\n");
+    }
+}
+
+inline void aof_encode(std::string &out, std::initializer_list<std::string_view> args)
+{
+    aof_bulk(out, '*', args.size());
+    for (auto a : args)
+    {
+        aof_bulk(out, '$', a.size());
+        out.append(a).append("\r\n");
+    }
+}
+
+inline void aof_write_all(int fd, const char *p, size_t n)
+{
+    while (n > 0)
+    {
+        auto r = ::write(fd, p, n);
+        if (r < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            throw std::runtime_error(strerror(errno));
+        }
+        p += r;
+        n -= r;
+    }
+}
+
+// 运行中追加写命令的日志，只在所属的事件循环线程中使用(everysec 的同步线程除外)
+// 记录先追加到 buf, 每轮事件循环结束前由 flush 一次写入(group commit)，不为每条命令单独 write/fsync
+class aof_log
+{
+    std::string path;
+    aof_fsync policy;
+    int fd = -1;
+    std::string buf;         // 本轮事件循环追加的记录
+    std::string rewrite_buf; // 后台重写期间写入的记录，重写完成后补写到新文件末尾
+    bool rewriting = false;
+    uint64_t size = 0;      // 文件长度
+    uint64_t base_size = 0; // 启动或上次重写完成时的文件长度
+
+    // everysec: 同步线程持有 mu 执行 fdatasync, 替换 fd 时也需持有 mu
+    std::mutex mu;
+    std::condition_variable cv;
+    bool stop = false;
+    std::atomic<bool> unsynced{false};
+    std::thread syncer;
+
+    void sync_loop()
+    {
+        std::unique_lock lk(mu);
+        while (!stop)
+        {
+            cv.wait_for(lk, std::chrono::seconds(1));
+            if (unsynced.exchange(false, std::memory_order_relaxed))
+            {
+                fdatasync(fd);
+            }
+        }
+    }
+
+public:
+    // 文件长度超过上次重写后的2倍且不小于 rewrite_min_size 时自动重写
+    static constexpr uint64_t rewrite_min_size = 64 << 20;
+
+    aof_log(std::string p, aof_fsync f) : path(std::move(p)), policy(f)
+    {
+        fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0)
+        {
+            throw std::runtime_error(path + ": " + strerror(errno));
+        }
+        size = base_size = st.st_size;
+        if (policy == aof_fsync::EVERYSEC)
+        {
+            syncer = std::thread([this]
+                                 { sync_loop(); });
+        }
+    }
+    aof_log(const aof_log &) = delete;
+    aof_log &operator=(const aof_log &) = delete;
+    ~aof_log()
+    {
+        if (syncer.joinable())
+        {
+            {
+                std::lock_guard lk(mu);
+                stop = true;
+            }
+            cv.notify_one();
+            syncer.join();
+        }
+        close(fd);
+    }
+
+    void append(const resp_args &args)
+    {
+        aof_encode(buf, args);
+    }
+
+    void append(std::initializer_list<std::string_view> args)
+    {
+        aof_encode(buf, args);
+    }
+
+    // 本轮是否有尚未写入的记录
+    bool pending() const
+    {
+        return !buf.empty();
+    }
+
+    uint64_t file_size() const
+    {
+        return size;
+    }
+
+    bool should_rewrite() const
+    {
+        return !rewriting && size >= rewrite_min_size && size >= base_size * 2;
+    }
+
+    // 把本轮的记录一次写入文件，always 策略下返回前已落盘
+    void flush()
+    {
+        if (buf.empty())
+        {
+            return;
+        }
+        aof_write_all(fd, buf.data(), buf.size());
+        if (policy == aof_fsync::ALWAYS && fdatasync(fd) < 0)
+        {
+            throw std::runtime_error(path + ": " + strerror(errno));
+        }
+        if (policy == aof_fsync::EVERYSEC)
+        {
+            unsynced.store(true, std::memory_order_relaxed);
+        }
+        size += buf.size();
+        if (rewriting)
+        {
+            rewrite_buf.append(buf);
+        }
+        buf.clear();
+    }
+
+    // fork 之前调用，此前的记录已包含在子进程的数据中，此后的记录另存一份
+    void begin_rewrite()
+    {
+        flush();
+        rewriting = true;
+    }
+
+    void abort_rewrite()
+    {
+        rewriting = false;
+        std::string().swap(rewrite_buf);
+    }
+
+    // 子进程写完 tmp 后，补写重写期间的记录，落盘后替换原文件，之后的记录写入新文件
+    // 重写期间的记录在事件循环线程中一次写入，写入量与重写耗时内的写命令量成正比
+    void finish_rewrite(const std::string &tmp)
+    {
+        flush();
+        int nfd = open(tmp.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        struct stat st;
+        if (nfd < 0)
+        {
+            throw std::runtime_error(tmp + ": " + strerror(errno));
+        }
+        try
+        {
+            aof_write_all(nfd, rewrite_buf.data(), rewrite_buf.size());
+            if (fdatasync(nfd) < 0 || fstat(nfd, &st) < 0 || rename(tmp.c_str(), path.c_str()) < 0)
+            {
+                throw std::runtime_error(tmp + ": " + strerror(errno));
+            }
+        }
+        catch (...)
+        {
+            close(nfd);
+            throw;
+        }
+        int old;
+        {
+            std::lock_guard lk(mu);
+            old = fd;
+            fd = nfd;
+        }
+        close(old);
+        size = base_size = st.st_size;
+        abort_rewrite();
+    }
+};
+
+// 写出完整的 AOF 文件(重写或启动时创建)，每个字符串 key 一条 SET, 集合按批写为 HSET/RPUSH/ZADD, 有过期时间的再加一条 PEXPIREAT
+class aof_writer
+{
+    static constexpr size_t buf_size = 1 << 20;
+
+    int fd = -1;
+    std::string path;
+    std::string buf;
+
+public:
+    aof_writer(std::string p, uint32_t shard, uint32_t shards) : path(std::move(p))
+    {
+        fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+        {
+            throw std::runtime_error(path + ": " + strerror(errno));
+        }
+        buf.reserve(buf_size);
+        char a[12], b[12];
+        add({"SHARD", std::string_view(a, std::to_chars(a, a + sizeof(a), shard).ptr - a), std::string_view(b, std::to_chars(b, b + sizeof(b), shards).ptr - b)});
+    }
+    aof_writer(const aof_writer &) = delete;
+    aof_writer &operator=(const aof_writer &) = delete;
+    ~aof_writer()
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+            unlink(path.c_str());
+        }
+    }
+
+    void add(std::initializer_list<std::string_view> args)
+    {
+        aof_encode(buf, args);
+        if (buf.size() >= buf_size)
+        {
+            aof_write_all(fd, buf.data(), buf.size());
+            buf.clear();
+        }
+    }
+
+    void add(const resp_args &args)
+    {
+        aof_encode(buf, args);
+        if (buf.size() >= buf_size)
+        {
+            aof_write_all(fd, buf.data(), buf.size());
+            buf.clear();
+        }
+    }
+
+    void finish()
+    {
+        aof_write_all(fd, buf.data(), buf.size());
+        if (fsync(fd) < 0 || close(fd) < 0)
+        {
+            throw std::runtime_error(path + ": " + strerror(errno));
+        }
+        fd = -1;
+    }
+};
+
+// mmap 读取 AOF 文件并逐条回调，文件末尾不完整的命令(写入中途崩溃)被截掉，其余格式错误视为损坏
+class aof_reader
+{
+    std::string path;
+    const char *base = nullptr;
+    size_t size = 0;
+    size_t start = 0; // SHARD 记录之后的位置
+
+    [[noreturn]] void corrupted() const
+    {
+        throw std::runtime_error("corrupted append only file " + path);
+    }
+
+    static bool parse_u32(std::string_view v, uint32_t &n)
+    {
+        auto [end, ec] = std::from_chars(v.data(), v.data() + v.size(), n);
+        return ec == std::errc() && end == v.data() + v.size();
+    }
+
+public:
+    uint32_t shard = 0;
+    uint32_t shards = 1;
+
+    explicit aof_reader(std::string p) : path(std::move(p))
+    {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0)
+        {
+            throw std::runtime_error(path + ": " + strerror(errno));
+        }
+        size = st.st_size;
+        auto m = size > 0 ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+        close(fd);
+        if (m == MAP_FAILED)
+        {
+            throw std::runtime_error(path + ": " + strerror(errno));
+        }
+        base = (const char *)m;
+        madvise(m, size, MADV_SEQUENTIAL);
+        resp_parser parser;
+        if (size == 0 || parser.parse(base, size) != resp_parser::DONE)
+        {
+            munmap(m, size);
+            corrupted();
+        }
+        auto &args = parser.args();
+        if (args.size() != 3 || args[0] != "SHARD" || !parse_u32(args[1], shard) || !parse_u32(args[2], shards) || shard >= shards)
+        {
+            munmap(m, size);
+            corrupted();
+        }
+        start = parser.consumed();
+    }
+    aof_reader(const aof_reader &) = delete;
+    aof_reader &operator=(const aof_reader &) = delete;
+    ~aof_reader()
+    {
+        munmap((void *)base, size);
+    }
+
+    // fn(const resp_args &)，参数指向映射的文件，只在回调期间有效
+    template <typename F>
+    void load(F &&fn)
+    {
+        resp_parser parser(resp_parser::max_command); // 写入时已按命令大小上限检查过，上限可能已调高到超过 max_bulk
+        size_t pos = start;
+        while (pos < size)
+        {
+            auto r = parser.parse(base + pos, size - pos);
+            if (r == resp_parser::ERROR)
+            {
+                corrupted();
+            }
+            if (r == resp_parser::NEED_MORE)
+            {
+                if (truncate(path.c_str(), pos) < 0)
+                {
+                    throw std::runtime_error(path + ": " + strerror(errno));
+                }
+                return;
+            }
+            fn(parser.args());
+            pos += parser.consumed();
+        }
+    }
+};
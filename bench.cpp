@@ -0,0 +1,815 @@
+// RESP 压测工具，通过 loopback 驱动 main.cpp 的示例 server(或其他兼容 redis 协议的服务)
+// g++ -Wall -std=c++20 -O2 bench.cpp -o bench -lpthread
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <charconv>
+#include <cmath>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <random>
+#include <stdexcept>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <string_view>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "stats.cpp"
+
+// 对数-线性分桶的延迟直方图(与 HdrHistogram 相同的分桶方式)，单位纳秒
+// 每个2的幂区间再等分为 2^(sub_bits-1) 格，相对误差不超过 1/64，记录是 O(1) 的
+class latency_histogram
+{
+    static constexpr int sub_bits = 7;
+    static constexpr int half = 1 << (sub_bits - 1);
+    static constexpr int buckets = (64 - sub_bits + 2) * half;
+
+    std::vector<uint64_t> counts = std::vector<uint64_t>(buckets);
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    uint64_t max_value = 0;
+
+    static int index(uint64_t v)
+    {
+        int msb = 63 - __builtin_clzll(v | 1);
+        int shift = std::max(0, msb - sub_bits + 1);
+        return shift * half + (int)(v >> shift);
+    }
+
+    // 桶内的最大值，分位数按此报告，不会低估
+    static uint64_t highest(int i)
+    {
+        if (i < 2 * half)
+        {
+            return i;
+        }
+        int shift = i / half - 1;
+        uint64_t low = (uint64_t)(i - shift * half) << shift;
+        return low + ((uint64_t)1 << shift) - 1;
+    }
+
+public:
+    void record(uint64_t v)
+    {
+        counts[index(v)]++;
+        total++;
+        sum += v;
+        max_value = std::max(max_value, v);
+    }
+
+    void merge(const latency_histogram &o)
+    {
+        for (int i = 0; i < buckets; i++)
+        {
+            counts[i] += o.counts[i];
+        }
+        total += o.total;
+        sum += o.sum;
+        max_value = std::max(max_value, o.max_value);
+    }
+
+    uint64_t count() const
+    {
+        return total;
+    }
+
+    double mean() const
+    {
+        return total ? (double)sum / total : 0;
+    }
+
+    uint64_t max() const
+    {
+        return max_value;
+    }
+
+    // p 为 0~100
+    uint64_t percentile(double p) const
+    {
+        if (total == 0)
+        {
+            return 0;
+        }
+        uint64_t need = std::max<uint64_t>(1, (uint64_t)std::ceil(p / 100 * total)), seen = 0;
+        for (int i = 0; i < buckets; i++)
+        {
+            if ((seen += counts[i]) >= need)
+            {
+                return std::min(highest(i), max_value);
+            }
+        }
+        return max_value;
+    }
+};
+
+// key 的编号分布，zipf 使用预先计算的累积分布表，按均匀随机数二分查找
+class key_chooser
+{
+    uint64_t keys;
+    std::vector<double> cdf;
+
+public:
+    key_chooser(uint64_t n, bool zipf, double s) : keys(std::max<uint64_t>(n, 1))
+    {
+        if (!zipf)
+        {
+            return;
+        }
+        cdf.resize(keys);
+        double total = 0;
+        for (uint64_t i = 0; i < keys; i++)
+        {
+            total += 1.0 / std::pow((double)(i + 1), s);
+            cdf[i] = total;
+        }
+        for (auto &x : cdf)
+        {
+            x /= total;
+        }
+    }
+
+    template <typename R>
+    uint64_t next(R &rng) const
+    {
+        if (cdf.empty())
+        {
+            return rng() % keys;
+        }
+        double u = std::uniform_real_distribution<double>(0, 1)(rng);
+        return std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+    }
+};
+
+struct bench_options
+{
+    std::string host = "127.0.0.1";
+    int port = 6479;
+    int connections = 50;
+    int threads = 1;
+    int pipeline = 1;       // 闭环模式下每个连接同时在途的请求数
+    double rate = 0;        // 开环模式的总请求速率(每秒)，0 表示闭环
+    double duration = 10;   // 秒，requests 为0时按时间结束
+    uint64_t requests = 0;  // 总请求数，非0时按请求数结束
+    uint64_t keys = 100000; // key 的个数，key 为 key:<编号>
+    bool zipf = false;
+    double zipf_s = 0.99;
+    size_t value_size = 32;
+    int set_ratio = 1; // SET 与 GET 的比例
+    int get_ratio = 10;
+    bool populate = false; // 测试前写入全部 key
+    std::string save;      // 结果保存为基线
+    std::string compare;   // 与保存的基线比较
+};
+
+// 解析一个完整回复的长度，不完整时返回0；错误回复计入 errors
+static size_t reply_length(const char *p, size_t n, bool &error)
+{
+    if (n < 3)
+    {
+        return 0;
+    }
+    auto eol = (const char *)memchr(p, '\n', n);
+    if (!eol)
+    {
+        return 0;
+    }
+    size_t head = eol - p + 1;
+    int64_t len = 0;
+    switch (p[0])
+    {
+    case '+':
+    case ':':
+        return head;
+    case '-':
+        error = true;
+        return head;
+    case '$':
+        std::from_chars(p + 1, eol - 1, len);
+        if (len < 0)
+        {
+            return head;
+        }
+        return n >= head + len + 2 ? head + len + 2 : 0;
+    case '*':
+    {
+        std::from_chars(p + 1, eol - 1, len);
+        size_t off = head;
+        for (int64_t i = 0; i < len; i++)
+        {
+            auto k = reply_length(p + off, n - off, error);
+            if (k == 0)
+            {
+                return 0;
+            }
+            off += k;
+        }
+        return off;
+    }
+    default:
+        throw std::runtime_error("protocol error");
+    }
+}
+
+static void append_bulk(std::string &out, std::string_view v)
+{
+    char buf[24];
+    buf[0] = '$';
+    auto end = std::to_chars(buf + 1, buf + sizeof(buf) - 2, v.size()).ptr;
+    *end++ = '\r';
+    *end++ = '\n';
+    out.append(buf, end - buf).append(v).append("\r\n");
+}
+
+static int connect_to(const bench_options &opt)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(opt.port);
+    addr.sin_addr.s_addr = inet_addr(opt.host.c_str());
+    if (fd < 0 || connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        throw std::runtime_error(std::string("connect: ") + strerror(errno));
+    }
+    int v = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &v, sizeof(v));
+    return fd;
+}
+
+// 每个线程一个 epoll, 负责一部分连接
+// 闭环: 每个连接保持 pipeline 个请求在途，收到回复后立即补足，延迟从实际发送时刻计算
+// 开环: 每个连接按固定间隔生成请求，不等待回复，延迟从计划发送时刻计算，服务端变慢时排队时间计入延迟(避免 coordinated omission)
+class bench_worker
+{
+    struct conn
+    {
+        int fd = -1;
+        std::string in;
+        size_t in_off = 0;
+        std::string out;
+        size_t out_off = 0;
+        std::deque<uint64_t> sent; // 在途请求的发送(计划)时刻
+        uint64_t next_due = 0;     // 开环模式下一个请求的计划时刻
+        bool want_out = false;
+    };
+
+    const bench_options &opt;
+    const key_chooser &chooser;
+    std::atomic<uint64_t> &issued; // 所有线程已发出的请求数，按请求数结束时使用
+    std::vector<conn> conns;
+    std::mt19937_64 rng;
+    std::string value;
+    int epfd = -1;
+    int tfd = -1;
+    uint64_t interval = 0; // 开环模式每个连接的请求间隔(纳秒)
+    uint64_t stop = 0;
+
+public:
+    latency_histogram hist;
+    uint64_t completed = 0;
+    uint64_t errors = 0;
+
+    bench_worker(const bench_options &o, const key_chooser &k, std::atomic<uint64_t> &n, int nconns, uint64_t seed)
+        : opt(o), chooser(k), issued(n), conns(nconns), rng(seed), value(o.value_size, 'x')
+    {
+    }
+    bench_worker(const bench_worker &) = delete;
+    bench_worker &operator=(const bench_worker &) = delete;
+    ~bench_worker()
+    {
+        for (auto &c : conns)
+        {
+            close(c.fd);
+        }
+        close(epfd);
+        close(tfd);
+    }
+
+    void add_request(conn &c, uint64_t when)
+    {
+        char key[32];
+        int n = snprintf(key, sizeof(key), "key:%012llu", (unsigned long long)chooser.next(rng));
+        bool set = opt.get_ratio == 0 || (int)(rng() % (opt.set_ratio + opt.get_ratio)) < opt.set_ratio;
+        c.out.append(set ? "*3\r\n$3\r\nSET\r\n" : "*2\r\n$3\r\nGET\r\n");
+        append_bulk(c.out, {key, (size_t)n});
+        if (set)
+        {
+            append_bulk(c.out, value);
+        }
+        c.sent.push_back(when);
+    }
+
+    // 按请求数结束时，所有线程共享一个配额
+    bool take_quota()
+    {
+        return opt.requests == 0 || issued.fetch_add(1, std::memory_order_relaxed) < opt.requests;
+    }
+
+    void flush(conn &c)
+    {
+        while (c.out_off < c.out.size())
+        {
+            auto n = send(c.fd, c.out.data() + c.out_off, c.out.size() - c.out_off, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n < 0)
+            {
+                if (errno == EAGAIN || errno == EINTR)
+                {
+                    break;
+                }
+                throw std::runtime_error(std::string("send: ") + strerror(errno));
+            }
+            c.out_off += n;
+        }
+        if (c.out_off == c.out.size())
+        {
+            c.out.clear();
+            c.out_off = 0;
+        }
+        bool want = c.out_off < c.out.size() || !c.out.empty();
+        if (want != c.want_out)
+        {
+            epoll_event ev{};
+            ev.events = EPOLLIN | (want ? EPOLLOUT : 0);
+            ev.data.u32 = &c - conns.data();
+            epoll_ctl(epfd, EPOLL_CTL_MOD, c.fd, &ev);
+            c.want_out = want;
+        }
+    }
+
+    // 闭环模式补足在途请求
+    void refill(conn &c, uint64_t now)
+    {
+        while ((int)c.sent.size() < opt.pipeline && now < stop && take_quota())
+        {
+            add_request(c, now);
+        }
+        flush(c);
+    }
+
+    // 开环模式生成已到计划时刻的请求，返回下一个计划时刻
+    uint64_t generate(uint64_t now)
+    {
+        uint64_t next = UINT64_MAX;
+        for (auto &c : conns)
+        {
+            bool added = false;
+            while (c.next_due <= now && c.next_due < stop && take_quota())
+            {
+                add_request(c, c.next_due);
+                c.next_due += interval;
+                added = true;
+            }
+            if (added)
+            {
+                flush(c);
+            }
+            if (c.next_due < stop)
+            {
+                next = std::min(next, c.next_due);
+            }
+        }
+        return next;
+    }
+
+    void arm_timer(uint64_t when)
+    {
+        itimerspec its{};
+        if (when != UINT64_MAX)
+        {
+            when = std::max<uint64_t>(when, 1);
+            its.it_value.tv_sec = when / 1000000000;
+            its.it_value.tv_nsec = when % 1000000000;
+        }
+        timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, nullptr);
+    }
+
+    void on_readable(conn &c)
+    {
+        char buf[65536];
+        for (;;)
+        {
+            auto n = recv(c.fd, buf, sizeof(buf), MSG_DONTWAIT);
+            if (n == 0)
+            {
+                throw std::runtime_error("connection closed by server");
+            }
+            if (n < 0)
+            {
+                if (errno == EAGAIN || errno == EINTR)
+                {
+                    break;
+                }
+                throw std::runtime_error(std::string("recv: ") + strerror(errno));
+            }
+            c.in.append(buf, n);
+            if (n < (ssize_t)sizeof(buf))
+            {
+                break;
+            }
+        }
+        uint64_t now = clock_ns();
+        for (;;)
+        {
+            bool error = false;
+            auto k = reply_length(c.in.data() + c.in_off, c.in.size() - c.in_off, error);
+            if (k == 0)
+            {
+                break;
+            }
+            if (c.sent.empty())
+            {
+                throw std::runtime_error("unexpected reply");
+            }
+            c.in_off += k;
+            hist.record(now - c.sent.front());
+            completed++;
+            errors += error;
+            c.sent.pop_front();
+        }
+        if (c.in_off == c.in.size())
+        {
+            c.in.clear();
+            c.in_off = 0;
+        }
+        else if (c.in_off > (1 << 20))
+        {
+            c.in.erase(0, c.in_off);
+            c.in_off = 0;
+        }
+        if (opt.rate <= 0)
+        {
+            refill(c, now);
+        }
+    }
+
+    bool idle() const
+    {
+        for (auto &c : conns)
+        {
+            if (!c.sent.empty())
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // t0 为所有线程共同的开始时刻
+    void run(uint64_t t0, double per_conn_rate)
+    {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        for (auto &c : conns)
+        {
+            c.fd = connect_to(opt);
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.u32 = &c - conns.data();
+            epoll_ctl(epfd, EPOLL_CTL_ADD, c.fd, &ev);
+        }
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u32 = UINT32_MAX;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev);
+        while (clock_ns() < t0)
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        stop = opt.requests > 0 ? UINT64_MAX : t0 + (uint64_t)(opt.duration * 1e9);
+        if (opt.rate > 0)
+        {
+            interval = (uint64_t)(1e9 / per_conn_rate);
+            // 各连接的起点错开，避免同时发送
+            for (size_t i = 0; i < conns.size(); i++)
+            {
+                conns[i].next_due = t0 + interval * i / conns.size();
+            }
+            arm_timer(generate(clock_ns()));
+        }
+        else
+        {
+            for (auto &c : conns)
+            {
+                refill(c, clock_ns());
+            }
+        }
+        std::vector<epoll_event> events(conns.size() + 1);
+        for (;;)
+        {
+            uint64_t now = clock_ns();
+            bool done = opt.requests > 0 ? issued.load(std::memory_order_relaxed) >= opt.requests : now >= stop;
+            if (done && idle())
+            {
+                break;
+            }
+            int timeout = opt.requests == 0 && now < stop ? (int)((stop - now) / 1000000 + 1) : 100;
+            int n = epoll_wait(epfd, events.data(), events.size(), timeout);
+            for (int i = 0; i < n; i++)
+            {
+                if (events[i].data.u32 == UINT32_MAX)
+                {
+                    uint64_t v;
+                    if (read(tfd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+                    {
+                        throw std::runtime_error(strerror(errno));
+                    }
+                    arm_timer(generate(clock_ns()));
+                    continue;
+                }
+                auto &c = conns[events[i].data.u32];
+                if (events[i].events & EPOLLOUT)
+                {
+                    flush(c);
+                }
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                {
+                    on_readable(c);
+                }
+            }
+        }
+    }
+};
+
+// 测试前用 SET 写入全部 key, 每批 1000 条流水线发送
+static void populate(const bench_options &opt)
+{
+    int fd = connect_to(opt);
+    std::string value(opt.value_size, 'x');
+    char key[32];
+    for (uint64_t i = 0; i < opt.keys;)
+    {
+        std::string out;
+        uint64_t batch = 0;
+        for (; batch < 1000 && i < opt.keys; batch++, i++)
+        {
+            int n = snprintf(key, sizeof(key), "key:%012llu", (unsigned long long)i);
+            out.append("*3\r\n$3\r\nSET\r\n");
+            append_bulk(out, {key, (size_t)n});
+            append_bulk(out, value);
+        }
+        for (size_t off = 0; off < out.size();)
+        {
+            auto n = send(fd, out.data() + off, out.size() - off, MSG_NOSIGNAL);
+            if (n <= 0)
+            {
+                throw std::runtime_error(std::string("send: ") + strerror(errno));
+            }
+            off += n;
+        }
+        std::string in;
+        char buf[65536];
+        size_t off = 0;
+        while (batch > 0)
+        {
+            bool error = false;
+            auto k = reply_length(in.data() + off, in.size() - off, error);
+            if (k > 0)
+            {
+                off += k;
+                batch--;
+                continue;
+            }
+            auto n = recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0)
+            {
+                throw std::runtime_error("populate: connection closed");
+            }
+            in.append(buf, n);
+        }
+    }
+    close(fd);
+}
+
+// 基线文件每行一个 "指标 数值"
+static std::map<std::string, double> load_results(const std::string &path)
+{
+    std::map<std::string, double> r;
+    std::ifstream f(path);
+    if (!f)
+    {
+        throw std::runtime_error(path + ": " + strerror(errno));
+    }
+    std::string name;
+    double v;
+    while (f >> name >> v)
+    {
+        r[name] = v;
+    }
+    return r;
+}
+
+static void usage()
+{
+    printf("usage: bench [options]\n"
+           "  --host H --port P         server address (127.0.0.1:6479)\n"
+           "  -c N                      connections (50)\n"
+           "  --threads N               client threads (1)\n"
+           "  -P N                      requests in flight per connection, closed loop (1)\n"
+           "  --rate R                  open loop at R requests/s in total, 0 for closed loop (0)\n"
+           "  -d SEC | -n N             run for SEC seconds (10) or N requests\n"
+           "  --keys N                  key space size (100000)\n"
+           "  --dist uniform|zipf       key distribution (uniform)\n"
+           "  --zipf-s S                zipf exponent (0.99)\n"
+           "  --value-size N            SET value size in bytes (32)\n"
+           "  --ratio S:G               SET:GET ratio (1:10)\n"
+           "  --populate                SET every key before the run\n"
+           "  --save FILE               save results as a baseline\n"
+           "  --compare FILE            compare results with a saved baseline\n");
+}
+
+int main(int argc, char *argv[])
+{
+    bench_options opt;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        bool has = i + 1 < argc;
+        if (arg == "--host" && has)
+        {
+            opt.host = argv[++i];
+        }
+        else if (arg == "--port" && has)
+        {
+            opt.port = atoi(argv[++i]);
+        }
+        else if (arg == "-c" && has)
+        {
+            opt.connections = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--threads" && has)
+        {
+            opt.threads = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "-P" && has)
+        {
+            opt.pipeline = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--rate" && has)
+        {
+            opt.rate = atof(argv[++i]);
+        }
+        else if (arg == "-d" && has)
+        {
+            opt.duration = atof(argv[++i]);
+        }
+        else if (arg == "-n" && has)
+        {
+            opt.requests = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--keys" && has)
+        {
+            opt.keys = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--dist" && has)
+        {
+            opt.zipf = std::string(argv[++i]) == "zipf";
+        }
+        else if (arg == "--zipf-s" && has)
+        {
+            opt.zipf_s = atof(argv[++i]);
+        }
+        else if (arg == "--value-size" && has)
+        {
+            opt.value_size = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--ratio" && has)
+        {
+            if (sscanf(argv[++i], "%d:%d", &opt.set_ratio, &opt.get_ratio) != 2 || opt.set_ratio < 0 || opt.get_ratio < 0 || opt.set_ratio + opt.get_ratio == 0)
+            {
+                usage();
+                return 1;
+            }
+        }
+        else if (arg == "--populate")
+        {
+            opt.populate = true;
+        }
+        else if (arg == "--save" && has)
+        {
+            opt.save = argv[++i];
+        }
+        else if (arg == "--compare" && has)
+        {
+            opt.compare = argv[++i];
+        }
+        else
+        {
+            usage();
+            return arg == "-h" || arg == "--help" ? 0 : 1;
+        }
+    }
+    opt.threads = std::min(opt.threads, opt.connections);
+    if (opt.populate)
+    {
+        populate(opt);
+    }
+
+    key_chooser chooser(opt.keys, opt.zipf, opt.zipf_s);
+    std::atomic<uint64_t> issued{0};
+    std::vector<std::unique_ptr<bench_worker>> workers;
+    for (int i = 0; i < opt.threads; i++)
+    {
+        int n = opt.connections / opt.threads + (i < opt.connections % opt.threads);
+        workers.push_back(std::make_unique<bench_worker>(opt, chooser, issued, n, 0x9e3779b97f4a7c15ull * (i + 1)));
+    }
+    double per_conn_rate = opt.rate / opt.connections;
+    uint64_t t0 = clock_ns() + 100000000; // 留出建立连接的时间
+    std::vector<std::thread> threads;
+    std::vector<std::exception_ptr> failures(workers.size());
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+        threads.emplace_back([&, i]
+                             {
+            try
+            {
+                workers[i]->run(t0, per_conn_rate);
+            }
+            catch (...)
+            {
+                failures[i] = std::current_exception();
+            } });
+    }
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+    for (auto &e : failures)
+    {
+        if (e)
+        {
+            std::rethrow_exception(e);
+        }
+    }
+    double elapsed = (clock_ns() - t0) / 1e9;
+
+    latency_histogram hist;
+    uint64_t completed = 0, errors = 0;
+    for (auto &w : workers)
+    {
+        hist.merge(w->hist);
+        completed += w->completed;
+        errors += w->errors;
+    }
+    std::vector<std::pair<std::string, double>> results = {
+        {"throughput", completed / elapsed},
+        {"mean_us", hist.mean() / 1000},
+        {"p50_us", hist.percentile(50) / 1000.0},
+        {"p90_us", hist.percentile(90) / 1000.0},
+        {"p99_us", hist.percentile(99) / 1000.0},
+        {"p99.9_us", hist.percentile(99.9) / 1000.0},
+        {"p99.99_us", hist.percentile(99.99) / 1000.0},
+        {"max_us", hist.max() / 1000.0},
+    };
+    if (opt.rate > 0)
+    {
+        printf("open loop at %.0f req/s", opt.rate);
+    }
+    else
+    {
+        printf("closed loop, pipeline %d", opt.pipeline);
+    }
+    printf(", %d connections, %d threads, %s keys %llu, value %zu bytes, SET:GET %d:%d\n", opt.connections, opt.threads,
+           opt.zipf ? "zipf" : "uniform", (unsigned long long)opt.keys, opt.value_size, opt.set_ratio, opt.get_ratio);
+    printf("%llu requests, %llu errors in %.2f s\n", (unsigned long long)completed, (unsigned long long)errors, elapsed);
+    std::map<std::string, double> base;
+    if (!opt.compare.empty())
+    {
+        base = load_results(opt.compare);
+    }
+    for (auto &[name, v] : results)
+    {
+        printf("%-12s %12.3f", name.c_str(), v);
+        if (auto it = base.find(name); it != base.end() && it->second > 0)
+        {
+            printf("   baseline %12.3f  %+7.2f%%", it->second, (v / it->second - 1) * 100);
+        }
+        printf("\n");
+    }
+    if (!opt.save.empty())
+    {
+        std::ofstream f(opt.save);
+        f.precision(10);
+        for (auto &[name, v] : results)
+        {
+            f << name << " " << v << "\n";
+        }
+        if (!f)
+        {
+            throw std::runtime_error(opt.save + ": " + strerror(errno));
+        }
+    }
+    return 0;
+}
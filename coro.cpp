@@ -0,0 +1,681 @@
+#pragma once
+#include "poll.cpp"
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+
+// 协程帧的内存池，按64字节分级缓存释放的帧，连接的处理协程每次创建和结束不必调用 malloc/free
+// 每个 co_server 一个，运行期间设为本线程的 current; 没有 current 或帧超过 max_block 时使用 operator new
+// 每个块前有16字节的块头记录所属的池(帧仍按16字节对齐)，释放时交回分配它的池；帧只在所属事件循环线程中创建和销毁
+class frame_pool
+{
+    static constexpr size_t header = 16;
+    static constexpr size_t step = 64;
+    static constexpr size_t max_block = 4096;
+    static constexpr size_t max_free = 1024; // 每级最多缓存的空闲块，超过的归还
+    static constexpr size_t classes = max_block / step;
+
+    struct node
+    {
+        node *next;
+    };
+
+    node *free_list[classes] = {};
+    size_t free_count[classes] = {};
+
+    static size_t class_of(size_t n)
+    {
+        return (n + header - 1) / step;
+    }
+
+public:
+    inline static thread_local frame_pool *current = nullptr;
+
+    frame_pool() = default;
+    frame_pool(const frame_pool &) = delete;
+    frame_pool &operator=(const frame_pool &) = delete;
+    ~frame_pool()
+    {
+        for (auto p : free_list)
+        {
+            while (p)
+            {
+                auto next = p->next;
+                ::operator delete(p);
+                p = next;
+            }
+        }
+    }
+
+    static void *allocate(size_t n)
+    {
+        auto pool = n + header <= max_block ? current : nullptr;
+        void *p;
+        if (!pool)
+        {
+            p = ::operator new(n + header);
+        }
+        else if (auto k = class_of(n); pool->free_list[k])
+        {
+            p = pool->free_list[k];
+            pool->free_list[k] = pool->free_list[k]->next;
+            pool->free_count[k]--;
+        }
+        else
+        {
+            p = ::operator new((k + 1) * step);
+        }
+        *(frame_pool **)p = pool;
+        return (char *)p + header;
+    }
+
+    // n 与 allocate 时相同(协程帧的 operator delete 带大小)
+    static void deallocate(void *ptr, size_t n)
+    {
+        auto p = (char *)ptr - header;
+        auto pool = *(frame_pool **)p;
+        auto k = class_of(n);
+        if (!pool || pool->free_count[k] >= max_free)
+        {
+            ::operator delete(p);
+            return;
+        }
+        auto b = (node *)p;
+        b->next = pool->free_list[k];
+        pool->free_list[k] = b;
+        pool->free_count[k]++;
+    }
+};
+
+// co_task 的 promise 公共部分：帧从 frame_pool 分配，创建后先挂起，由 co_await 或 co_server::spawn 开始执行
+// 结束时恢复 co_await 它的协程(对称转移，不增加调用栈)；分离执行时没有等待者，结束后从 owner 中移除并销毁帧
+struct co_promise_base
+{
+    std::coroutine_handle<> continuation;
+    std::exception_ptr error;
+    std::unordered_set<void *> *owner = nullptr; // 分离执行时所在的集合，以帧地址记录
+
+    static void *operator new(size_t n)
+    {
+        return frame_pool::allocate(n);
+    }
+    static void operator delete(void *p, size_t n)
+    {
+        frame_pool::deallocate(p, n);
+    }
+
+    std::suspend_always initial_suspend() noexcept
+    {
+        return {};
+    }
+
+    struct final_awaiter
+    {
+        bool await_ready() noexcept
+        {
+            return false;
+        }
+        template <typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+        {
+            auto &p = h.promise();
+            if (p.continuation)
+            {
+                return p.continuation;
+            }
+            if (p.owner)
+            {
+                p.owner->erase(h.address());
+                h.destroy();
+            }
+            return std::noop_coroutine();
+        }
+        void await_resume() noexcept
+        {
+        }
+    };
+    final_awaiter final_suspend() noexcept
+    {
+        return {};
+    }
+
+    // 有等待者时异常在其 co_await 处重新抛出；分离执行时从恢复它的回调中传出，与回调中抛出异常一样传出事件循环
+    void unhandled_exception()
+    {
+        if (owner)
+        {
+            throw;
+        }
+        error = std::current_exception();
+    }
+};
+
+template <typename T>
+struct co_promise : co_promise_base
+{
+    std::optional<T> value;
+
+    template <typename U>
+    void return_value(U &&v)
+    {
+        value.emplace(std::forward<U>(v));
+    }
+    T result()
+    {
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+        return std::move(*value);
+    }
+};
+
+template <>
+struct co_promise<void> : co_promise_base
+{
+    void return_void()
+    {
+    }
+    void result()
+    {
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+    }
+};
+
+// 协程的返回类型，co_await 时开始执行并等待其结果；未被 co_await 或 spawn 的 co_task 析构时销毁帧
+template <typename T = void>
+class co_task
+{
+public:
+    struct promise_type : co_promise<T>
+    {
+        co_task get_return_object()
+        {
+            return co_task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+    };
+    using handle_type = std::coroutine_handle<promise_type>;
+
+    co_task(co_task &&o) noexcept : h(std::exchange(o.h, {}))
+    {
+    }
+    co_task &operator=(co_task &&o) noexcept
+    {
+        if (this != &o)
+        {
+            if (h)
+            {
+                h.destroy();
+            }
+            h = std::exchange(o.h, {});
+        }
+        return *this;
+    }
+    co_task(const co_task &) = delete;
+    co_task &operator=(const co_task &) = delete;
+    ~co_task()
+    {
+        if (h)
+        {
+            h.destroy();
+        }
+    }
+
+    auto operator co_await() noexcept
+    {
+        struct awaiter
+        {
+            handle_type h;
+            bool await_ready() noexcept
+            {
+                return false;
+            }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept
+            {
+                h.promise().continuation = caller;
+                return h;
+            }
+            T await_resume()
+            {
+                return h.promise().result();
+            }
+        };
+        return awaiter{h};
+    }
+
+    // 交出帧的所有权
+    handle_type release() noexcept
+    {
+        return std::exchange(h, {});
+    }
+
+private:
+    explicit co_task(handle_type h) : h(h)
+    {
+    }
+
+    handle_type h;
+};
+
+// 在 ms 毫秒后由事件循环的定时器恢复
+struct co_sleep
+{
+    poll_server &server;
+    int ms;
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+    void await_suspend(std::coroutine_handle<> h)
+    {
+        server.set_timeout(ms, [h](poll_server &)
+                           { h.resume(); });
+    }
+    void await_resume() const noexcept
+    {
+    }
+};
+
+class co_server;
+
+// 协程中的一个连接，由 co_server 在连接建立时创建，处理协程结束后销毁，只能在事件循环线程中使用
+// 读取在数据到达的 on_data 中直接恢复协程，返回的 string_view 指向 poll_server 的输入缓冲区，不复制，在下一次 co_await 之前有效；
+// 缓冲区中的数据已满足条件时 co_await 不挂起，一次 on_data 中的多个请求在同一次回调中依次处理
+// 协程在等待读取之外的事情(如 sleep)时到达的数据留在输入缓冲区并暂停读取，下次读取时恢复
+class co_connection
+{
+    friend class co_server;
+
+    // 读取的条件：delim 不为空时读到分隔符为止，否则 exact 时读 n 字节，不 exact 时读到 1~n 字节
+    struct read_request
+    {
+        std::string_view delim;
+        size_t n = 0;
+        bool exact = false;
+    };
+
+    co_server &owner;
+    poll_server &server;
+    int fd;
+    bool closed = false;
+    bool stalled = false; // 协程未等待读取时有未消费的数据，已暂停读取
+    bool held = false;    // sleep 期间 hold, 对端半关闭后仍可发送回复；下次等待读取时 release
+    // 本次 on_data 的数据，只在 on_data 中有效，之外为空
+    const char *input = nullptr;
+    size_t input_len = 0;
+    size_t consumed = 0;
+    size_t scanned = 0; // 从 consumed 起已查找过分隔符的字节数，下次 on_data 从此处继续查找
+    std::coroutine_handle<> reader; // 等待读取的协程
+    std::coroutine_handle<> writer; // 等待发送队列的协程
+    read_request request;
+    std::string_view result;
+    bool write_ok = false;
+
+    co_connection(co_server &owner, poll_server &server, int fd) : owner(owner), server(server), fd(fd)
+    {
+    }
+
+    // 按 request 从本次 on_data 的剩余数据中取出结果，数据不足时返回 false
+    // 读到分隔符时包括分隔符超过 n 字节(无论分隔符是否已到达)则关闭连接，结果为空
+    // 未消费的数据在下次 on_data 时仍从同一位置开始，分隔符只在新到达的数据(及可能跨越边界的 delim.size()-1 字节)中查找
+    bool try_read()
+    {
+        auto avail = input ? std::string_view(input + consumed, input_len - consumed) : std::string_view();
+        size_t take;
+        if (!request.delim.empty())
+        {
+            auto window = avail.substr(0, request.n + request.delim.size());
+            auto from = scanned >= request.delim.size() ? scanned - request.delim.size() + 1 : 0;
+            auto pos = window.find(request.delim, from);
+            if (pos == std::string_view::npos && avail.size() < request.n)
+            {
+                scanned = avail.size();
+                return false;
+            }
+            if (pos == std::string_view::npos || pos + request.delim.size() > request.n)
+            {
+                close();
+                result = {};
+                return true;
+            }
+            take = pos + request.delim.size();
+        }
+        else if (request.exact ? avail.size() < request.n : avail.empty())
+        {
+            return false;
+        }
+        else
+        {
+            take = std::min(avail.size(), request.n);
+        }
+        result = avail.substr(0, take);
+        consumed += take;
+        scanned = 0;
+        return true;
+    }
+
+    struct read_awaiter
+    {
+        co_connection &c;
+        read_request request;
+
+        bool await_ready()
+        {
+            c.request = request;
+            c.scanned = 0;
+            if (c.closed)
+            {
+                c.result = {};
+                return true;
+            }
+            return c.try_read();
+        }
+        // 对端半关闭时 release 可能同步关闭连接并在其中恢复本协程，release 之后不能再访问 c
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            c.reader = h;
+            if (c.stalled)
+            {
+                c.stalled = false;
+                c.server.resume(c.fd);
+            }
+            if (c.held)
+            {
+                c.held = false;
+                c.server.release(c.fd);
+            }
+        }
+        std::string_view await_resume() const noexcept
+        {
+            return c.result;
+        }
+    };
+
+    // 写入后发送队列不超过 write_limit 时不挂起；超过时等待队列中的数据(包括本次)发送完成
+    // 直接发送完成时(write 返回0)不再查询队列长度
+    struct write_awaiter
+    {
+        co_connection &c;
+        std::string_view data;
+
+        bool await_ready()
+        {
+            if (c.closed)
+            {
+                c.write_ok = false;
+                return true;
+            }
+            int r = c.server.write(c.fd, data.data(), (int)data.size());
+            c.write_ok = r >= 0;
+            return r <= 0 || c.server.queued(c.fd) <= c.write_limit();
+        }
+        bool await_suspend(std::coroutine_handle<> h)
+        {
+            c.writer = h;
+            auto &conn = c;
+            if (!c.server.when_sent(c.fd, [&conn](poll_server &, int, int)
+                                    {
+                if (auto w = std::exchange(conn.writer, {}))
+                {
+                    w.resume();
+                } }))
+            {
+                c.writer = nullptr;
+                return false;
+            }
+            return true;
+        }
+        bool await_resume() const noexcept
+        {
+            return c.write_ok;
+        }
+    };
+
+    struct sleep_awaiter : co_sleep
+    {
+        co_connection &c;
+
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            if (!c.closed && !c.held)
+            {
+                c.held = true;
+                c.server.hold(c.fd);
+            }
+            co_sleep::await_suspend(h);
+        }
+    };
+
+    size_t write_limit() const;
+
+public:
+    co_connection(const co_connection &) = delete;
+    co_connection &operator=(const co_connection &) = delete;
+
+    int id() const
+    {
+        return fd;
+    }
+    // 连接已关闭(对端关闭、出错或调用了 close)，之后读取返回空，写入返回 false
+    bool is_closed() const
+    {
+        return closed;
+    }
+
+    // 读到分隔符为止(包括分隔符)，连接关闭时返回空；一行(包括分隔符)超过 limit 字节时关闭连接并返回空
+    read_awaiter read_until(std::string_view delim, size_t limit = 64 << 10)
+    {
+        return {*this, {delim, limit, false}};
+    }
+    // 读取 n 字节(n>0)，连接关闭时返回空；较大的 n 会通过 expect 一次分配好输入缓冲区
+    read_awaiter read_exactly(size_t n)
+    {
+        return {*this, {{}, n, true}};
+    }
+    // 读取已到达的数据，1到 n 字节，连接关闭时返回空
+    read_awaiter read_some(size_t n = SIZE_MAX)
+    {
+        return {*this, {{}, n, false}};
+    }
+
+    // 写入 data, 数据只需在调用期间有效(与 poll_server::write 相同，不能直接发送完成时复制)；返回 false 表示连接已关闭
+    // 发送队列超过 co_server 的 write_limit 时挂起到本次数据发送完成，不会无限积压
+    write_awaiter write(std::string_view data)
+    {
+        return {*this, data};
+    }
+
+    // 挂起 ms 毫秒，期间对端半关闭不会关闭连接
+    sleep_awaiter sleep(int ms)
+    {
+        return {{server, ms}, *this};
+    }
+
+    // 立即关闭连接，发送队列中的数据丢弃；处理协程结束时若未关闭，发送完成后关闭
+    void close();
+};
+
+// 以协程处理连接的服务器：每个连接建立时以 co_connection 调用 handler, 协程结束后关闭连接
+// 协程从 poll_server 的回调中直接恢复(读取在 on_data 中，写入在发送完成回调中，sleep 在定时器中)，不经过额外的队列
+// 协程帧从本服务器的 frame_pool 分配；一个 co_server 在一个线程中运行，多线程时每个线程一个，与 poll_server 相同
+class co_server
+{
+    friend class co_connection;
+
+public:
+    using handler = std::function<co_task<>(co_connection &)>;
+
+    explicit co_server(handler h, poll_server::options o = {}) : handle(std::move(h)),
+                                                               write_limit(o.high_watermark ? o.high_watermark : SIZE_MAX),
+                                                               server([this](poll_server &, int)
+                                                                      { return stopping ? 0 : 1000; },
+                                                                      [this](poll_server &, int fd)
+                                                                      { on_open(fd); },
+                                                                      [this](poll_server &, int fd, const char *data, int len)
+                                                                      { return on_data(fd, data, len); },
+                                                                      o)
+    {
+    }
+    co_server(const co_server &) = delete;
+    co_server &operator=(const co_server &) = delete;
+    // 销毁尚未结束的协程(如 stop 时仍在等待的连接)
+    ~co_server()
+    {
+        auto list = std::move(tasks);
+        for (auto p : list)
+        {
+            std::coroutine_handle<>::from_address(p).destroy();
+        }
+    }
+
+    // 在当前线程运行事件循环，直到 stop; 返回值与 poll_server::start 相同
+    bool start(int port, const char *host = "")
+    {
+        auto prev = std::exchange(frame_pool::current, &pool);
+        bool ok = server.start(port, host);
+        frame_pool::current = prev;
+        return ok;
+    }
+
+    // 线程安全，事件循环在本轮结束后退出
+    void stop()
+    {
+        server.post([this](poll_server &)
+                    { stopping = true; });
+    }
+
+    // 分离执行一个不属于连接的协程(如定时任务)，只能在事件循环线程中(或 start 之前)调用
+    void spawn(co_task<> t)
+    {
+        auto h = t.release();
+        h.promise().owner = &tasks;
+        tasks.insert(h.address());
+        h.resume();
+    }
+
+    co_sleep sleep(int ms)
+    {
+        return {server, ms};
+    }
+
+    // 底层的事件循环，用于 post、定时器和统计
+    poll_server &loop()
+    {
+        return server;
+    }
+
+private:
+    handler handle;
+    size_t write_limit;
+    bool stopping = false;
+    frame_pool pool;
+    std::unordered_set<void *> tasks; // 分离执行中的协程的帧地址
+    std::unordered_map<int, co_connection *> connections; // 未关闭的连接，co_connection 在处理协程的帧中
+    poll_server server;
+    // 等待 read_exactly 的数据不少于此大小时通过 expect 预告，输入缓冲区一次分配到位
+    static constexpr size_t large_read = 32 << 10;
+
+    // 连接的处理协程，co_connection 随帧一起销毁
+    co_task<> session(int fd)
+    {
+        co_connection c(*this, server, fd);
+        connections.emplace(fd, &c);
+        co_await handle(c);
+        if (!c.closed)
+        {
+            c.closed = true;
+            connections.erase(fd);
+            if (c.held)
+            {
+                server.release(fd);
+            }
+            server.shutdown(fd);
+        }
+    }
+
+    void on_open(int fd)
+    {
+        if (fd >= 0)
+        {
+            spawn(session(fd));
+        }
+    }
+
+    // 依次以到达的数据恢复等待读取的协程，直到数据不足或协程转而等待其他事情；返回协程消费的字节数
+    int on_data(int fd, const char *data, int len)
+    {
+        auto it = connections.find(fd);
+        if (it == connections.end())
+        {
+            return len > 0 ? len : 0; // 处理协程已结束，等待发送完成后关闭
+        }
+        auto c = it->second;
+        if (len <= 0)
+        {
+            connections.erase(it);
+            c->closed = true;
+            c->held = false;
+            c->input = nullptr;
+            if (auto h = std::exchange(c->reader, {}))
+            {
+                c->result = {};
+                h.resume();
+            }
+            else if (auto h = std::exchange(c->writer, {}))
+            {
+                c->write_ok = false;
+                h.resume();
+            }
+            return 0;
+        }
+        c->input = data;
+        c->input_len = len;
+        c->consumed = 0;
+        while (c->reader && c->try_read())
+        {
+            std::exchange(c->reader, {}).resume();
+            it = connections.find(fd);
+            if (it == connections.end() || it->second != c)
+            {
+                return 0; // 协程中关闭了连接或处理协程已结束
+            }
+        }
+        c->input = nullptr;
+        if (!c->reader)
+        {
+            if (c->consumed < (size_t)len && !c->stalled)
+            {
+                c->stalled = true;
+                server.suspend(fd);
+            }
+        }
+        else if (c->request.delim.empty() && c->request.exact && c->request.n >= large_read)
+        {
+            server.expect(fd, c->request.n);
+        }
+        return c->consumed;
+    }
+};
+
+inline size_t co_connection::write_limit() const
+{
+    return owner.write_limit;
+}
+
+inline void co_connection::close()
+{
+    if (!closed)
+    {
+        closed = true;
+        owner.connections.erase(fd);
+        server.closefd(fd);
+    }
+}
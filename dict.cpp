@@ -0,0 +1,707 @@
+#pragma once
+#include <algorithm>
+#include <functional>
+#include <malloc.h>
+#include <new>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string_view>
+#include <sys/mman.h>
+#include <utility>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// 16字节的字符串，不超过15字节时保存在对象内，否则在堆上分配，容量取 malloc_usable_size
+// 最后一个字节为标记：对象内保存时为 15 - 长度，堆上保存时为 heap_tag，更大的标记值留给复用此布局的类型(如 db_value)
+class small_string
+{
+    static constexpr size_t inline_cap = 15;
+    static constexpr uint8_t heap_tag = 0x80;
+
+    union
+    {
+        char buf[16];
+        struct
+        {
+            char *ptr;
+            uint32_t len;
+            uint8_t pad[3];
+            uint8_t tag;
+        } heap;
+    };
+
+    bool on_heap() const
+    {
+        return (uint8_t)buf[15] == heap_tag;
+    }
+
+    void release()
+    {
+        if (on_heap())
+        {
+            free(heap.ptr);
+        }
+        buf[15] = inline_cap;
+    }
+
+public:
+    small_string()
+    {
+        buf[15] = inline_cap;
+    }
+    explicit small_string(std::string_view s) : small_string()
+    {
+        assign(s);
+    }
+    small_string(small_string &&o) noexcept
+    {
+        memcpy(buf, o.buf, sizeof(buf));
+        o.buf[15] = inline_cap;
+    }
+    small_string &operator=(small_string &&o) noexcept
+    {
+        if (this != &o)
+        {
+            release();
+            memcpy(buf, o.buf, sizeof(buf));
+            o.buf[15] = inline_cap;
+        }
+        return *this;
+    }
+    small_string(const small_string &) = delete;
+    small_string &operator=(const small_string &) = delete;
+    ~small_string()
+    {
+        release();
+    }
+
+    size_t size() const
+    {
+        return on_heap() ? heap.len : inline_cap - (uint8_t)buf[15];
+    }
+    const char *data() const
+    {
+        return on_heap() ? heap.ptr : buf;
+    }
+    std::string_view view() const
+    {
+        return {data(), size()};
+    }
+
+    // 已在堆上且容量足够时复用，新长度不到容量的1/4时重新分配，避免长期占用过多内存
+    void assign(std::string_view s)
+    {
+        size_t n = s.size();
+        if (n <= inline_cap)
+        {
+            char *old = on_heap() ? heap.ptr : nullptr;
+            memmove(buf, s.data(), n);
+            buf[15] = inline_cap - n;
+            free(old);
+            return;
+        }
+        if (on_heap())
+        {
+            size_t cap = malloc_usable_size(heap.ptr);
+            if (cap >= n && n >= cap / 4)
+            {
+                memmove(heap.ptr, s.data(), n);
+                heap.len = n;
+                return;
+            }
+        }
+        auto p = (char *)malloc(n);
+        if (!p)
+        {
+            throw std::bad_alloc();
+        }
+        memcpy(p, s.data(), n);
+        release();
+        heap.ptr = p;
+        heap.len = n;
+        heap.tag = heap_tag;
+    }
+};
+
+// 以字符串为 key 的开放寻址哈希表(Swiss table)，key 不超过15字节时保存在槽位内
+// 每个槽位有1字节控制字节：空(0)、已删除(1)或最高位为1加上哈希值的高7位；查找时以16个槽位为一组，用 SIMD 一次比较整组控制字节，只有高7位相同的槽位才比较 key
+// 扩容/缩容时分配新表，之后每次插入、删除迁移旧表的一组，也可调用 rehash 在空闲时迁移，不会在一次操作中搬移整个表；迁移期间查找同时检查新旧两个表
+// 插入、删除和 rehash 可能移动元素，返回的指针只在此之前有效
+template <typename V>
+class dict
+{
+    static constexpr size_t group = 16;
+    static constexpr uint8_t ctrl_empty = 0;
+    static constexpr uint8_t ctrl_deleted = 1;
+    // 不小于此大小的槽位数组单独 mmap, 迁移时把已迁移完的部分按此大小分段归还系统，迁移结束时不必一次释放整个旧表
+    static constexpr size_t map_chunk = 2 << 20;
+
+    struct entry
+    {
+        small_string key;
+        V value;
+    };
+
+    struct table
+    {
+        uint8_t *ctrl = nullptr;
+        entry *slots = nullptr;
+        size_t cap = 0;   // 槽位数，16的2的幂倍
+        size_t used = 0;  // 保存了元素的槽位
+        size_t tombs = 0;    // 已删除的槽位，查找时不能视为空
+        size_t unmapped = 0; // 槽位数组 mmap 时，开头已归还系统的字节数
+        bool mapped() const
+        {
+            return cap * sizeof(entry) >= map_chunk;
+        }
+    };
+
+    table ht[2];             // 迁移期间 ht[0] 为旧表，ht[1] 为新表
+    size_t rehash_group = 0; // 旧表下一个要迁移的组
+
+    // 多线程模式下分片也按 key 的哈希划分，再混合一次，避免同一分片的 key 集中在部分组
+    static uint64_t hash(std::string_view key)
+    {
+        uint64_t h = std::hash<std::string_view>{}(key);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ull;
+        h ^= h >> 33;
+        return h;
+    }
+
+    static uint8_t h2(uint64_t h)
+    {
+        return 0x80 | (h >> 57);
+    }
+
+    // 一组控制字节中等于 b 的位置
+    static uint32_t match(const uint8_t *g, uint8_t b)
+    {
+#if defined(__SSE2__)
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i *)g), _mm_set1_epi8(b)));
+#else
+        uint32_t m = 0;
+        for (size_t i = 0; i < group; i++)
+        {
+            m |= (uint32_t)(g[i] == b) << i;
+        }
+        return m;
+#endif
+    }
+
+    // 一组控制字节中保存了元素(最高位为1)的位置
+    static uint32_t match_full(const uint8_t *g)
+    {
+#if defined(__SSE2__)
+        return _mm_movemask_epi8(_mm_load_si128((const __m128i *)g));
+#else
+        uint32_t m = 0;
+        for (size_t i = 0; i < group; i++)
+        {
+            m |= (uint32_t)(g[i] >> 7) << i;
+        }
+        return m;
+#endif
+    }
+
+    // 包括已删除的槽位在内最多使用7/8，保证每条探测序列都能遇到空槽位而结束
+    static size_t max_load(size_t cap)
+    {
+        return cap - cap / 8;
+    }
+
+    // 按组做三角数探测，组数为2的幂时可遍历所有组
+    static ptrdiff_t find_in(const table &t, std::string_view key, uint64_t h)
+    {
+        if (t.used == 0)
+        {
+            return -1;
+        }
+        size_t mask = t.cap / group - 1;
+        size_t g = h & mask;
+        for (size_t step = 1;; step++)
+        {
+            auto ctrl = t.ctrl + g * group;
+            for (uint32_t m = match(ctrl, h2(h)); m; m &= m - 1)
+            {
+                size_t i = g * group + __builtin_ctz(m);
+                if (t.slots[i].key.view() == key)
+                {
+                    return i;
+                }
+            }
+            if (match(ctrl, ctrl_empty))
+            {
+                return -1;
+            }
+            g = (g + step) & mask;
+        }
+    }
+
+    // 占用探测序列中第一个空或已删除的槽位，调用方在其中构造元素
+    static size_t take_slot(table &t, uint64_t h)
+    {
+        size_t mask = t.cap / group - 1;
+        size_t g = h & mask;
+        for (size_t step = 1;; step++)
+        {
+            if (uint32_t m = ~match_full(t.ctrl + g * group) & 0xffff)
+            {
+                size_t i = g * group + __builtin_ctz(m);
+                if (t.ctrl[i] == ctrl_deleted)
+                {
+                    t.tombs--;
+                }
+                t.ctrl[i] = h2(h);
+                t.used++;
+                return i;
+            }
+            g = (g + step) & mask;
+        }
+    }
+
+    // 所在组还有空槽位时，经过此组的探测都会在此结束，可以直接标记为空，否则需标记为已删除
+    static void clear_slot(table &t, size_t i)
+    {
+        t.slots[i].~entry();
+        if (match(t.ctrl + i / group * group, ctrl_empty))
+        {
+            t.ctrl[i] = ctrl_empty;
+        }
+        else
+        {
+            t.ctrl[i] = ctrl_deleted;
+            t.tombs++;
+        }
+        t.used--;
+    }
+
+    // 空槽位的控制字节为0, 用 calloc 分配，大块内存由内核按页清零，不需要 memset 整个数组
+    // malloc 的对齐保证不小于16字节，可以按组对齐读取
+    static table alloc(size_t cap)
+    {
+        table t;
+        t.cap = cap;
+        t.ctrl = (uint8_t *)calloc(cap, 1);
+        if (t.mapped())
+        {
+            auto p = mmap(nullptr, cap * sizeof(entry), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            t.slots = p == MAP_FAILED ? nullptr : (entry *)p;
+        }
+        else
+        {
+            t.slots = (entry *)malloc(cap * sizeof(entry));
+        }
+        if (!t.ctrl || !t.slots)
+        {
+            free(t.ctrl);
+            if (!t.mapped())
+            {
+                free(t.slots);
+            }
+            throw std::bad_alloc();
+        }
+        return t;
+    }
+
+    static void destroy(table &t)
+    {
+        for (size_t i = 0; t.used > 0 && i < t.cap; i++)
+        {
+            if (t.ctrl[i] & 0x80)
+            {
+                t.slots[i].~entry();
+                t.used--;
+            }
+        }
+        free(t.ctrl);
+        if (t.mapped())
+        {
+            munmap((char *)t.slots + t.unmapped, t.cap * sizeof(entry) - t.unmapped);
+        }
+        else
+        {
+            free(t.slots);
+        }
+        t = table();
+    }
+
+    // 开始迁移到能以一半负载容纳 n 个元素的新表
+    void resize(size_t n)
+    {
+        size_t cap = group;
+        while (cap < n * 2)
+        {
+            cap *= 2;
+        }
+        auto t = alloc(cap);
+        if (ht[0].used == 0)
+        {
+            destroy(ht[0]);
+            ht[0] = t;
+            return;
+        }
+        ht[1] = t;
+        rehash_group = 0;
+    }
+
+    // 插入前保证目标表还有空间，迁移期间旧表剩余的元素也计入新表
+    // 迁移期间按新表剩余空间分摊旧表剩余的组：调用方已迁移1组，再迁移 剩余组数/剩余空间 组，
+    // 剩余组数与剩余空间之比不会增大，新表填满之前迁移总能完成(缩容后大量插入时也是)，不需要一次迁移整个旧表
+    void reserve_one()
+    {
+        if (ht[1].ctrl)
+        {
+            auto &from = ht[0], &to = ht[1];
+            size_t load = to.used + to.tombs + from.used;
+            size_t room = load < max_load(to.cap) ? max_load(to.cap) - load : 1;
+            if (size_t n = (from.cap / group - rehash_group) / room)
+            {
+                rehash(n);
+            }
+            if (ht[1].ctrl)
+            {
+                return;
+            }
+        }
+        if (ht[0].used + ht[0].tombs < max_load(ht[0].cap))
+        {
+            return;
+        }
+        resize(size() + 1);
+    }
+
+    V *find_hashed(std::string_view key, uint64_t h)
+    {
+        for (auto &t : ht)
+        {
+            auto i = find_in(t, key, h);
+            if (i >= 0)
+            {
+                return &t.slots[i].value;
+            }
+        }
+        return nullptr;
+    }
+
+    template <typename F>
+    static void visit(table &t, size_t g, F &fn)
+    {
+        size_t base = g * group;
+        for (uint32_t m = match_full(t.ctrl + base); m; m &= m - 1)
+        {
+            auto &e = t.slots[base + __builtin_ctz(m)];
+            fn(e.key.view(), e.value);
+        }
+    }
+
+public:
+    dict() = default;
+    dict(const dict &) = delete;
+    dict &operator=(const dict &) = delete;
+    ~dict()
+    {
+        destroy(ht[0]);
+        destroy(ht[1]);
+    }
+
+    size_t size() const
+    {
+        return ht[0].used + ht[1].used;
+    }
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    // 交换两个 dict 的全部内容(包括迁移状态)，O(1), 用于把整个表从键空间摘下
+    void swap(dict &o) noexcept
+    {
+        std::swap(ht, o.ht);
+        std::swap(rehash_group, o.rehash_group);
+    }
+
+    bool rehashing() const
+    {
+        return ht[1].ctrl != nullptr;
+    }
+
+    // 槽位及控制字节占用的内存，不包括 key/value 在堆上分配的部分
+    size_t table_bytes() const
+    {
+        return (ht[0].cap + ht[1].cap) * (sizeof(entry) + 1);
+    }
+
+    V *find(std::string_view key)
+    {
+        return find_hashed(key, hash(key));
+    }
+
+    // 所有 dict 使用同一哈希函数，同一 key 在不同 dict 中查找只需计算一次
+    static uint64_t key_hash(std::string_view key)
+    {
+        return hash(key);
+    }
+
+    // 批量查找时分阶段预取，使多个 key 的缓存缺失可以重叠：
+    // 先对后面第 2d 个 key 调用 prefetch 预取控制字节，再对第 d 个 key 调用 prefetch_slots 预取槽位，最后查找当前 key
+    void prefetch(uint64_t h) const
+    {
+        for (auto &t : ht)
+        {
+            if (t.used > 0)
+            {
+                __builtin_prefetch(t.ctrl + (h & (t.cap / group - 1)) * group);
+            }
+        }
+    }
+
+    // 预取初始组中控制字节与 h 匹配的槽位，控制字节应已由 prefetch 读入缓存
+    void prefetch_slots(uint64_t h) const
+    {
+        for (auto &t : ht)
+        {
+            if (t.used > 0)
+            {
+                size_t base = (h & (t.cap / group - 1)) * group;
+                for (uint32_t m = match(t.ctrl + base, h2(h)); m; m &= m - 1)
+                {
+                    __builtin_prefetch(&t.slots[base + __builtin_ctz(m)]);
+                }
+            }
+        }
+    }
+
+    // h 为 key_hash(key), 批量操作时与 prefetch 共用
+    V *find(std::string_view key, uint64_t h)
+    {
+        return find_hashed(key, h);
+    }
+
+    // 空表时预先分配能容纳 n 个元素的表，批量加载时不再扩容
+    void reserve(size_t n)
+    {
+        if (!empty() || rehashing())
+        {
+            return;
+        }
+        size_t cap = group;
+        while (max_load(cap) <= n)
+        {
+            cap *= 2;
+        }
+        if (cap > ht[0].cap)
+        {
+            destroy(ht[0]);
+            ht[0] = alloc(cap);
+        }
+    }
+
+    // 查找 key, 不存在时插入默认构造的值，返回值的指针及是否新插入
+    std::pair<V *, bool> insert(std::string_view key)
+    {
+        return insert(key, hash(key));
+    }
+
+    // h 为 key_hash(key)
+    std::pair<V *, bool> insert(std::string_view key, uint64_t h)
+    {
+        rehash();
+        if (auto v = find_hashed(key, h))
+        {
+            return {v, false};
+        }
+        reserve_one();
+        auto &t = ht[1].ctrl ? ht[1] : ht[0];
+        size_t i = take_slot(t, h);
+        new (&t.slots[i]) entry{small_string(key), V()};
+        return {&t.slots[i].value, true};
+    }
+
+    bool erase(std::string_view key)
+    {
+        rehash();
+        uint64_t h = hash(key);
+        for (auto &t : ht)
+        {
+            auto i = find_in(t, key, h);
+            if (i >= 0)
+            {
+                clear_slot(t, i);
+                if (!ht[1].ctrl && ht[0].cap > group && ht[0].used * 8 < ht[0].cap)
+                {
+                    resize(ht[0].used);
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // 迁移旧表的 n 组，返回是否仍在迁移
+    bool rehash(size_t n = 1)
+    {
+        if (!ht[1].ctrl)
+        {
+            return false;
+        }
+        auto &from = ht[0];
+        auto &to = ht[1];
+        size_t groups = from.cap / group;
+        for (; n > 0 && from.used > 0 && rehash_group < groups; n--, rehash_group++)
+        {
+            size_t base = rehash_group * group;
+            for (uint32_t m = match_full(from.ctrl + base); m; m &= m - 1)
+            {
+                size_t i = base + __builtin_ctz(m);
+                auto &e = from.slots[i];
+                size_t j = take_slot(to, hash(e.key.view()));
+                new (&to.slots[j]) entry(std::move(e));
+                e.~entry();
+                // 尚未迁移的 key 的探测序列可能经过此处，不能标记为空
+                from.ctrl[i] = ctrl_deleted;
+                from.tombs++;
+                from.used--;
+            }
+        }
+        if (from.mapped())
+        {
+            // 已迁移的组不会再访问其槽位
+            size_t done = rehash_group * group * sizeof(entry) / map_chunk * map_chunk;
+            if (done > from.unmapped)
+            {
+                munmap((char *)from.slots + from.unmapped, done - from.unmapped);
+                from.unmapped = done;
+            }
+        }
+        if (from.used == 0)
+        {
+            destroy(from);
+            from = to;
+            to = table();
+            rehash_group = 0;
+        }
+        return ht[1].ctrl != nullptr;
+    }
+
+    // 遍历所有元素，fn(key, value) 中不能插入或删除
+    template <typename F>
+    void for_each(F &&fn)
+    {
+        for (auto &t : ht)
+        {
+            for (size_t g = 0; g < t.cap / group; g++)
+            {
+                visit(t, g, fn);
+            }
+        }
+    }
+
+    // 遍历 cursor 对应的一组槽位，迁移期间同时遍历新表中的同一组，返回下一个 cursor，遍历完一遍后回到0
+    // fn(key, value) 中不能插入或删除；用于抽样，迁移期间元素可能被跳过或重复遍历
+    template <typename F>
+    size_t sample(size_t cursor, F &&fn)
+    {
+        size_t groups = 0;
+        for (auto &t : ht)
+        {
+            size_t n = t.cap / group;
+            if (cursor < n)
+            {
+                visit(t, cursor, fn);
+            }
+            groups = std::max(groups, n);
+        }
+        return cursor + 1 < groups ? cursor + 1 : 0;
+    }
+
+    // 增量遍历(SCAN)：每次遍历 cursor 对应的初始组的所有元素，返回下一个 cursor，遍历完一遍后返回0
+    // 从开始到结束一直存在的元素至少遍历一次，期间扩容、缩容和迁移也不会遗漏，但可能重复
+    // cursor 为组号的反向二进制递增(与 Redis 的 dictScan 相同)：表大小翻倍时组 g 的元素分到 g 和 g + 旧组数，
+    // 按高位先递增的顺序，已遍历的组在新表中对应的组仍排在 cursor 之前
+    // fn(key, value) 中不能插入或删除
+    template <typename F>
+    size_t scan(size_t cursor, F &&fn)
+    {
+        if (empty())
+        {
+            return 0;
+        }
+        auto *small = &ht[0], *large = &ht[1];
+        if (!large->ctrl || (small->ctrl && small->cap > large->cap))
+        {
+            std::swap(small, large);
+        }
+        if (!small->ctrl)
+        {
+            // 不在迁移，只有一个表
+            size_t mask = large->cap / group - 1;
+            visit_home(*large, cursor & mask, fn);
+            return next_cursor(cursor, mask);
+        }
+        size_t m0 = small->cap / group - 1, m1 = large->cap / group - 1;
+        visit_home(*small, cursor & m0, fn);
+        // 大表中低位与小表的组号相同的所有组
+        do
+        {
+            visit_home(*large, cursor & m1, fn);
+            cursor = next_cursor(cursor, m1);
+        } while (cursor & (m0 ^ m1));
+        return cursor;
+    }
+
+private:
+    // 保持 mask 以外的高位为1后反向加1, 只递增 mask 内的位
+    static size_t next_cursor(size_t cursor, size_t mask)
+    {
+        cursor |= ~mask;
+        cursor = reverse_bits(cursor);
+        cursor++;
+        return reverse_bits(cursor);
+    }
+
+    static size_t reverse_bits(size_t v)
+    {
+        size_t r = 0;
+        for (size_t i = 0; i < sizeof(v) * 8; i++, v >>= 1)
+        {
+            r = (r << 1) | (v & 1);
+        }
+        return r;
+    }
+
+    // 遍历初始组为 g 的所有元素：开放寻址下元素可能因冲突保存在探测序列后面的组中，
+    // 沿 g 的探测序列直到有空槽位的组(与查找的结束条件相同)，只遍历哈希值对应初始组为 g 的元素
+    template <typename F>
+    static void visit_home(table &t, size_t g, F &fn)
+    {
+        if (t.used == 0)
+        {
+            return;
+        }
+        size_t mask = t.cap / group - 1;
+        size_t i = g;
+        for (size_t step = 1;; step++)
+        {
+            size_t base = i * group;
+            for (uint32_t m = match_full(t.ctrl + base); m; m &= m - 1)
+            {
+                auto &e = t.slots[base + __builtin_ctz(m)];
+                if ((hash(e.key.view()) & mask) == g)
+                {
+                    fn(e.key.view(), e.value);
+                }
+            }
+            if (match(t.ctrl + base, ctrl_empty))
+            {
+                return;
+            }
+            i = (i + step) & mask;
+        }
+    }
+};
@@ -0,0 +1,83 @@
+#pragma once
+#include "mpsc.cpp"
+#include <atomic>
+#include <functional>
+#include <stdint.h>
+#include <thread>
+
+// 后台释放线程：删除较大的值(UNLINK)或清空整个 db(FLUSHALL ASYNC)时，事件循环只把对象从键空间摘下，释放交给此线程
+// 释放大集合或整个哈希表需要逐个 free 数百万次分配，在事件循环中执行时所有连接都要等待
+// 任意线程通过无锁队列投递，投递只有一次原子交换；没有任务时线程在 atomic::wait 上休眠，不轮询
+class lazy_free
+{
+    mpsc_queue<std::function<void()>> queue;
+    std::atomic<uint32_t> signal{0}; // 每次投递后加1并唤醒，线程等待其变化
+    std::atomic<uint64_t> queued{0};
+    std::atomic<uint64_t> freed{0};
+    std::atomic<bool> stopping{false};
+    std::thread thread; // 最后初始化，启动时其他成员已构造完成
+
+    // 先读 signal 再取队列：之后投递的任务会改变 signal, wait 立即返回，不会在有任务时休眠
+    void run()
+    {
+        for (;;)
+        {
+            auto s = signal.load(std::memory_order_acquire);
+            std::function<void()> job;
+            while (queue.pop(job))
+            {
+                job();
+                job = nullptr;
+                freed.fetch_add(1, std::memory_order_relaxed);
+            }
+            if (stopping.load(std::memory_order_acquire))
+            {
+                return;
+            }
+            signal.wait(s, std::memory_order_acquire);
+        }
+    }
+
+    void wake()
+    {
+        signal.fetch_add(1, std::memory_order_release);
+        signal.notify_one();
+    }
+
+public:
+    lazy_free() : thread([this]
+                         { run(); })
+    {
+    }
+    lazy_free(const lazy_free &) = delete;
+    lazy_free &operator=(const lazy_free &) = delete;
+    // 释放完已投递的对象后退出
+    ~lazy_free()
+    {
+        stopping.store(true, std::memory_order_release);
+        wake();
+        thread.join();
+    }
+
+    // 在后台线程 delete p, 调用方之后不能再访问 p
+    template <typename T>
+    void release(T *p)
+    {
+        queued.fetch_add(1, std::memory_order_relaxed);
+        queue.push([p]
+                   { delete p; });
+        wake();
+    }
+
+    // 已投递尚未释放的对象数
+    uint64_t pending() const
+    {
+        return queued.load(std::memory_order_relaxed) - freed.load(std::memory_order_relaxed);
+    }
+
+    // 已在后台释放的对象数
+    uint64_t released() const
+    {
+        return freed.load(std::memory_order_relaxed);
+    }
+};
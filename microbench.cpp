@@ -0,0 +1,715 @@
+// 热点路径的微基准测试：RESP 解析、命令分发、键空间操作、poll_server 发送队列、回调与协程写法的开销
+// g++ -Wall -std=c++20 -O2 microbench.cpp -o microbench -lpthread
+// 输出每行一项: 名称 每次迭代次数 中位数(纳秒/次) 最小值(纳秒/次)，以 # 开头的行为说明
+#include "coro.cpp"
+#include "redis.cpp"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <charconv>
+#include <fstream>
+#include <map>
+#include <random>
+#include <stdio.h>
+#include <thread>
+
+// 一次运行的结果，ops 为实际执行的操作数(可能按批取整)，ns 为计时部分的耗时
+struct micro_result
+{
+    uint64_t ns = 0;
+    uint64_t ops = 0;
+};
+
+struct micro_case
+{
+    std::string name;
+    std::function<micro_result(uint64_t)> run; // 参数为期望执行的操作数
+};
+
+struct micro_options
+{
+    double min_time = 0.05; // 每次重复的最短时间(秒)
+    int repeat = 5;         // 重复次数，报告中位数和最小值
+    uint64_t max_keys = 10000000;
+    int port = 16479; // 发送队列测试的 loopback 端口
+    std::string filter;
+    std::string save;
+    std::string compare;
+};
+
+static void do_not_optimize(const std::string &s)
+{
+    asm volatile("" : : "r"(s.data()) : "memory");
+}
+
+static resp_command make_command(std::initializer_list<std::string_view> args)
+{
+    resp_command c;
+    for (auto a : args)
+    {
+        c.add(a);
+    }
+    return c;
+}
+
+static std::string key_name(uint64_t i)
+{
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "key:%010llu", (unsigned long long)i);
+    return {buf, (size_t)n};
+}
+
+// RESP 编码的流水线请求
+static std::string encode_pipeline(size_t commands, size_t value_size)
+{
+    std::string value(value_size, 'x'), out;
+    for (size_t i = 0; i < commands; i++)
+    {
+        auto key = key_name(i);
+        out.append("*3\r\n$3\r\nSET\r\n$").append(std::to_string(key.size())).append("\r\n").append(key).append("\r\n");
+        out.append("$").append(std::to_string(value.size())).append("\r\n").append(value).append("\r\n");
+    }
+    return out;
+}
+
+// 数据按 chunk 字节分段到达，每段到达后解析出所有完整的命令，chunk 为0时一次到达
+static uint64_t parse_buffer(resp_parser &p, const std::string &buf, size_t chunk)
+{
+    uint64_t commands = 0;
+    size_t start = 0, avail = chunk == 0 ? buf.size() : 0;
+    while (start < buf.size())
+    {
+        avail = chunk == 0 ? buf.size() : std::min(buf.size(), avail + chunk);
+        for (;;)
+        {
+            auto r = p.parse(buf.data() + start, avail - start);
+            if (r == resp_parser::ERROR)
+            {
+                throw std::runtime_error("parse error");
+            }
+            if (r == resp_parser::NEED_MORE)
+            {
+                break;
+            }
+            start += p.consumed();
+            commands++;
+        }
+    }
+    return commands;
+}
+
+static micro_case parse_case(std::string name, size_t pipeline, size_t value_size, size_t chunk)
+{
+    auto buf = std::make_shared<std::string>(encode_pipeline(pipeline, value_size));
+    return {std::move(name), [buf, pipeline, chunk](uint64_t n)
+            {
+                resp_parser p;
+                micro_result r;
+                uint64_t rounds = std::max<uint64_t>(1, n / pipeline);
+                auto t = clock_ns();
+                for (uint64_t i = 0; i < rounds; i++)
+                {
+                    r.ops += parse_buffer(p, *buf, chunk);
+                }
+                r.ns = clock_ns() - t;
+                return r;
+            }};
+}
+
+// 依次执行预先构造的命令，命令数不是2的幂时按取模循环
+static micro_result run_commands(RedisServer &srv, std::vector<resp_command> &cmds, uint64_t n)
+{
+    std::string out;
+    size_t i = 0;
+    auto t = clock_ns();
+    for (uint64_t k = 0; k < n; k++)
+    {
+        out.clear();
+        srv.call(out, cmds[i].view());
+        do_not_optimize(out);
+        if (++i == cmds.size())
+        {
+            i = 0;
+        }
+    }
+    return {clock_ns() - t, n};
+}
+
+static std::vector<micro_case> dispatch_cases()
+{
+    auto srv = std::make_shared<RedisServer>();
+    std::string out;
+    auto set = make_command({"SET", "key", "value"});
+    srv->call(out, set.view());
+    auto one = [srv](std::string name, std::initializer_list<std::string_view> args)
+    {
+        auto cmds = std::make_shared<std::vector<resp_command>>();
+        cmds->push_back(make_command(args));
+        return micro_case{std::move(name), [srv, cmds](uint64_t n)
+                          { return run_commands(*srv, *cmds, n); }};
+    };
+    return {
+        one("dispatch/ping", {"PING"}),
+        one("dispatch/ping_lowercase", {"ping"}),
+        one("dispatch/unknown", {"NOSUCHCOMMAND", "a"}),
+        one("dispatch/wrong_arity", {"GET"}),
+        one("dispatch/get", {"GET", "key"}),
+    };
+}
+
+// 键空间中有 keys 个 key 时 GET/SET/INCR/DEL/MGET 的耗时，访问的 key 均匀随机
+// 值为整数，INCR 不会出错；DEL 删除后在计时之外重新写入，保持 key 的个数不变
+static constexpr int mget_keys = 16;
+
+static std::vector<micro_case> keyspace_cases(uint64_t keys)
+{
+    auto srv = std::make_shared<RedisServer>();
+    std::string out;
+    for (uint64_t i = 0; i < keys; i++)
+    {
+        auto key = key_name(i);
+        auto cmd = make_command({"SET", key, std::to_string(i)});
+        out.clear();
+        srv->call(out, cmd.view());
+    }
+    std::mt19937_64 rng(keys);
+    auto ring = [&](std::string_view op, std::string_view arg)
+    {
+        auto cmds = std::make_shared<std::vector<resp_command>>();
+        for (int i = 0; i < 65536; i++)
+        {
+            auto key = key_name(rng() % keys);
+            cmds->push_back(arg.empty() ? make_command({op, key}) : make_command({op, key, arg}));
+        }
+        return cmds;
+    };
+    // 每条 MGET 查找 mget_keys 个 key, 与 db/get 比较每个 key 的耗时可以看出批量预取的效果
+    auto mget = std::make_shared<std::vector<resp_command>>();
+    for (int i = 0; i < 4096; i++)
+    {
+        resp_command cmd;
+        cmd.add("MGET");
+        for (int j = 0; j < mget_keys; j++)
+        {
+            cmd.add(key_name(rng() % keys));
+        }
+        mget->push_back(std::move(cmd));
+    }
+    auto suffix = "/keys=" + std::to_string(keys);
+    std::vector<micro_case> cases;
+    for (auto [name, cmds] : {std::pair{"get", ring("GET", "")}, {"set", ring("SET", "12345")}, {"incr", ring("INCR", "")}, {"mget16", mget}})
+    {
+        cases.push_back({std::string("db/") + name + suffix, [srv, cmds](uint64_t n)
+                         { return run_commands(*srv, *cmds, n); }});
+    }
+    cases.push_back({"db/del" + suffix, [srv, keys](uint64_t n)
+                     {
+                         // 每批删除不超过 key 个数的 1/16, 避免缩容影响结果
+                         uint64_t batch = std::clamp<uint64_t>(keys / 16, 1, 65536);
+                         std::mt19937_64 rng(n);
+                         std::vector<resp_command> dels, sets;
+                         std::string out;
+                         micro_result r;
+                         while (r.ops < n)
+                         {
+                             uint64_t m = std::min(batch, n - r.ops), first = rng() % keys;
+                             dels.clear();
+                             sets.clear();
+                             for (uint64_t i = 0; i < m; i++)
+                             {
+                                 auto key = key_name((first + i) % keys);
+                                 dels.push_back(make_command({"DEL", key}));
+                                 sets.push_back(make_command({"SET", key, "1"}));
+                             }
+                             r.ns += run_commands(*srv, dels, m).ns;
+                             r.ops += m;
+                             run_commands(*srv, sets, m);
+                         }
+                         return r;
+                     }});
+    return cases;
+}
+
+// loopback 上的 poll_server, 每收到一行 "<个数> <大小> <c|s>" 发送对应个数的消息
+// c 为复制发送(write 数据指针)，s 为共享缓冲区(write shared_ptr)；发送队列超过高水位暂停读取时停止处理剩余的请求
+class write_server
+{
+    poll_server server;
+    std::atomic<bool> stopping{false};
+    std::thread thread;
+    std::string payload = std::string(1 << 16, 'x');
+    std::shared_ptr<const std::string> shared[17];
+
+    int on_data(poll_server &s, int fd, const char *data, int len)
+    {
+        int used = 0;
+        while (used < len && !s.paused(fd))
+        {
+            auto nl = (const char *)memchr(data + used, '\n', len - used);
+            if (!nl)
+            {
+                break;
+            }
+            // 输入不以 '\0' 结尾，只在本行 [data + used, nl) 内解析
+            unsigned count = 0, size = 0;
+            char mode = 'c';
+            auto p = std::from_chars(data + used, nl, count).ptr;
+            while (p < nl && *p == ' ')
+            {
+                p++;
+            }
+            p = std::from_chars(p, nl, size).ptr;
+            while (p < nl && *p == ' ')
+            {
+                p++;
+            }
+            if (p < nl)
+            {
+                mode = *p;
+            }
+            size = std::min<unsigned>(size, payload.size());
+            int b = 63 - __builtin_clzll(size | 1);
+            for (unsigned i = 0; i < count; i++)
+            {
+                if (mode == 's' && (1u << b) == size)
+                {
+                    s.write(fd, shared[b]);
+                }
+                else
+                {
+                    s.write(fd, payload.data(), size);
+                }
+            }
+            used = nl + 1 - data;
+        }
+        return len > 0 ? used : 0;
+    }
+
+public:
+    explicit write_server(int port) : server([this](poll_server &, int)
+                                             { return stopping ? 0 : 1000; },
+                                             [](poll_server &, int) {},
+                                             [this](poll_server &s, int fd, const char *data, int len)
+                                             { return on_data(s, fd, data, len); })
+    {
+        for (int b = 0; b <= 16; b++)
+        {
+            shared[b] = std::make_shared<const std::string>(size_t(1) << b, 'x');
+        }
+        thread = std::thread([this, port]
+                             { server.start(port, "127.0.0.1"); });
+    }
+    write_server(const write_server &) = delete;
+    write_server &operator=(const write_server &) = delete;
+    ~write_server()
+    {
+        stopping = true;
+        server.post([](poll_server &) {});
+        thread.join();
+    }
+};
+
+static int connect_loopback(int port)
+{
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (int i = 0; i < 100; i++) // 等待服务线程开始监听
+    {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && connect(fd, (sockaddr *)&addr, sizeof(addr)) == 0)
+        {
+            return fd;
+        }
+        close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    throw std::runtime_error(std::string("connect: ") + strerror(errno));
+}
+
+// 请求由单独的线程发出，服务端暂停读取时不会阻塞接收；每行请求256条消息
+static micro_case write_case(std::string name, int port, unsigned size, char mode)
+{
+    return {std::move(name), [port, size, mode](uint64_t n)
+            {
+                constexpr unsigned per_line = 256;
+                uint64_t lines = std::max<uint64_t>(1, n / per_line);
+                int fd = connect_loopback(port);
+                auto t = clock_ns();
+                std::thread sender([fd, lines, size, mode]
+                                   {
+                    char line[64];
+                    int len = snprintf(line, sizeof(line), "%u %u %c\n", per_line, size, mode);
+                    std::string req;
+                    for (uint64_t i = 0; i < lines; i++)
+                    {
+                        req.append(line, len);
+                    }
+                    for (size_t off = 0; off < req.size();)
+                    {
+                        auto k = send(fd, req.data() + off, req.size() - off, MSG_NOSIGNAL);
+                        if (k <= 0)
+                        {
+                            break;
+                        }
+                        off += k;
+                    } });
+                uint64_t want = lines * per_line * size, got = 0;
+                std::vector<char> buf(1 << 18);
+                while (got < want)
+                {
+                    auto k = recv(fd, buf.data(), buf.size(), 0);
+                    if (k <= 0)
+                    {
+                        break;
+                    }
+                    got += k;
+                }
+                micro_result r{clock_ns() - t, lines * per_line};
+                sender.join();
+                close(fd);
+                if (got < want)
+                {
+                    throw std::runtime_error("write queue: connection closed");
+                }
+                return r;
+            }};
+}
+
+// loopback 上的行回显服务器，每行单独 write: callback 为手写的 on_data, coroutine 为 co_server 上顺序写法的处理协程
+class echo_server
+{
+    std::atomic<bool> stopping{false};
+    poll_server callback;
+    co_server coroutine;
+    std::thread threads[2];
+
+    static int on_data(poll_server &s, int fd, const char *data, int len)
+    {
+        int used = 0;
+        while (used < len)
+        {
+            auto nl = (const char *)memchr(data + used, '\n', len - used);
+            if (!nl)
+            {
+                break;
+            }
+            s.write(fd, data + used, nl + 1 - data - used);
+            used = nl + 1 - data;
+        }
+        return len > 0 ? used : 0;
+    }
+
+    static co_task<> session(co_connection &c)
+    {
+        for (;;)
+        {
+            auto line = co_await c.read_until("\n");
+            if (line.empty() || !co_await c.write(line))
+            {
+                co_return;
+            }
+        }
+    }
+
+public:
+    explicit echo_server(int port) : callback([this](poll_server &, int)
+                                              { return stopping ? 0 : 1000; },
+                                              [](poll_server &, int) {}, on_data),
+                                     coroutine(session)
+    {
+        threads[0] = std::thread([this, port]
+                                 { callback.start(port, "127.0.0.1"); });
+        threads[1] = std::thread([this, port]
+                                 { coroutine.start(port + 1, "127.0.0.1"); });
+    }
+    echo_server(const echo_server &) = delete;
+    echo_server &operator=(const echo_server &) = delete;
+    ~echo_server()
+    {
+        stopping = true;
+        callback.post([](poll_server &) {});
+        coroutine.stop();
+        for (auto &t : threads)
+        {
+            t.join();
+        }
+    }
+};
+
+// 由单独的线程连续发出 n 行，每行16字节，接收全部回显
+static micro_case echo_case(std::string name, int port)
+{
+    return {std::move(name), [port](uint64_t n)
+            {
+                constexpr size_t line = 16;
+                int fd = connect_loopback(port);
+                auto t = clock_ns();
+                std::thread sender([fd, n]
+                                   {
+                    std::string req;
+                    for (uint64_t i = 0; i < n; i++)
+                    {
+                        req.append(line - 1, 'e').push_back('\n');
+                    }
+                    for (size_t off = 0; off < req.size();)
+                    {
+                        auto k = send(fd, req.data() + off, req.size() - off, MSG_NOSIGNAL);
+                        if (k <= 0)
+                        {
+                            break;
+                        }
+                        off += k;
+                    } });
+                uint64_t want = n * line, got = 0;
+                std::vector<char> buf(1 << 18);
+                while (got < want)
+                {
+                    auto k = recv(fd, buf.data(), buf.size(), 0);
+                    if (k <= 0)
+                    {
+                        break;
+                    }
+                    got += k;
+                }
+                micro_result r{clock_ns() - t, n};
+                sender.join();
+                close(fd);
+                if (got < want)
+                {
+                    throw std::runtime_error("echo: connection closed");
+                }
+                return r;
+            }};
+}
+
+// 先找出单次不少于 min_time 的操作数，再重复 repeat 次，返回每次操作耗时的中位数和最小值
+static std::pair<double, double> measure(const micro_case &c, const micro_options &opt, uint64_t &ops)
+{
+    uint64_t n = 1;
+    micro_result r;
+    for (;;)
+    {
+        r = c.run(n);
+        if (r.ns >= opt.min_time * 1e9 || n >= (uint64_t)1 << 40)
+        {
+            break;
+        }
+        double scale = r.ns > 0 ? opt.min_time * 1e9 / r.ns * 1.2 : 100;
+        n = std::max<uint64_t>(n * 2, (uint64_t)(std::min(scale, 100.0) * std::max(n, r.ops)));
+    }
+    std::vector<double> per_op;
+    for (int i = 0; i < opt.repeat; i++)
+    {
+        r = c.run(n);
+        per_op.push_back((double)r.ns / std::max<uint64_t>(r.ops, 1));
+    }
+    ops = r.ops;
+    std::sort(per_op.begin(), per_op.end());
+    return {per_op[per_op.size() / 2], per_op[0]};
+}
+
+static std::map<std::string, double> load_baseline(const std::string &path)
+{
+    std::map<std::string, double> r;
+    std::ifstream f(path);
+    if (!f)
+    {
+        throw std::runtime_error(path + ": " + strerror(errno));
+    }
+    std::string line;
+    while (std::getline(f, line))
+    {
+        char name[256];
+        unsigned long long ops;
+        double median;
+        if (line.empty() || line[0] == '#' || sscanf(line.c_str(), "%255s %llu %lf", name, &ops, &median) != 3)
+        {
+            continue;
+        }
+        r[name] = median;
+    }
+    return r;
+}
+
+static void usage()
+{
+    printf("usage: microbench [options]\n"
+           "  --filter S        run benchmarks whose name contains S\n"
+           "  --list            list benchmark names\n"
+           "  --min-time SEC    minimum time of one repetition (0.05)\n"
+           "  --repeat N        repetitions, median and min are reported (5)\n"
+           "  --max-keys N      largest key space for db/* (10000000)\n"
+           "  --port P          loopback port for write/*, echo/* uses P+1 and P+2 (16479)\n"
+           "  --save FILE       save results as a baseline\n"
+           "  --compare FILE    compare medians with a saved baseline\n");
+}
+
+int main(int argc, char *argv[])
+{
+    micro_options opt;
+    bool list = false;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        bool has = i + 1 < argc;
+        if (arg == "--filter" && has)
+        {
+            opt.filter = argv[++i];
+        }
+        else if (arg == "--list")
+        {
+            list = true;
+        }
+        else if (arg == "--min-time" && has)
+        {
+            opt.min_time = atof(argv[++i]);
+        }
+        else if (arg == "--repeat" && has)
+        {
+            opt.repeat = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--max-keys" && has)
+        {
+            opt.max_keys = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--port" && has)
+        {
+            opt.port = atoi(argv[++i]);
+        }
+        else if (arg == "--save" && has)
+        {
+            opt.save = argv[++i];
+        }
+        else if (arg == "--compare" && has)
+        {
+            opt.compare = argv[++i];
+        }
+        else
+        {
+            usage();
+            return arg == "-h" || arg == "--help" ? 0 : 1;
+        }
+    }
+
+    // 每组测试需要的数据(如填充键空间)在该组有测试被选中时才构造
+    std::vector<std::pair<std::vector<std::string>, std::function<std::vector<micro_case>()>>> groups;
+    auto add_group = [&](std::vector<std::string> names, std::function<std::vector<micro_case>()> make)
+    {
+        groups.emplace_back(std::move(names), std::move(make));
+    };
+    auto fixed = [&](std::vector<micro_case> cases)
+    {
+        std::vector<std::string> names;
+        for (auto &c : cases)
+        {
+            names.push_back(c.name);
+        }
+        add_group(names, [cases]
+                  { return cases; });
+    };
+    // 流水线深度及 value 大小不同的完整缓冲区，以及同一缓冲区按不同大小分段到达
+    fixed({
+        parse_case("parse/pipeline=1", 1, 16, 0),
+        parse_case("parse/pipeline=16", 16, 16, 0),
+        parse_case("parse/pipeline=256", 256, 16, 0),
+        parse_case("parse/pipeline=256/value=1024", 256, 1024, 0),
+        parse_case("parse/pipeline=256/chunk=1", 256, 16, 1),
+        parse_case("parse/pipeline=256/chunk=7", 256, 16, 7),
+        parse_case("parse/pipeline=256/chunk=64", 256, 16, 64),
+        parse_case("parse/pipeline=256/chunk=4096", 256, 16, 4096),
+    });
+    add_group({"dispatch/ping", "dispatch/ping_lowercase", "dispatch/unknown", "dispatch/wrong_arity", "dispatch/get"}, dispatch_cases);
+    for (uint64_t keys = 1000; keys <= opt.max_keys; keys *= 10)
+    {
+        auto suffix = "/keys=" + std::to_string(keys);
+        add_group({"db/get" + suffix, "db/set" + suffix, "db/incr" + suffix, "db/mget16" + suffix, "db/del" + suffix}, [keys]
+                  { return keyspace_cases(keys); });
+    }
+    std::shared_ptr<write_server> ws;
+    std::vector<micro_case> writes;
+    for (auto [size, mode] : {std::pair{16u, 'c'}, {512u, 'c'}, {16384u, 'c'}, {16384u, 's'}})
+    {
+        writes.push_back(write_case(std::string("write/") + (mode == 'c' ? "copy" : "shared") + "/size=" + std::to_string(size), opt.port, size, mode));
+    }
+    std::vector<std::string> write_names;
+    for (auto &c : writes)
+    {
+        write_names.push_back(c.name);
+    }
+    add_group(write_names, [&]
+              {
+        ws = std::make_shared<write_server>(opt.port);
+        return writes; });
+
+    std::shared_ptr<echo_server> es;
+    add_group({"echo/callback", "echo/coroutine"}, [&]
+              {
+        es = std::make_shared<echo_server>(opt.port + 1);
+        return std::vector<micro_case>{echo_case("echo/callback", opt.port + 1), echo_case("echo/coroutine", opt.port + 2)}; });
+
+    std::map<std::string, double> base;
+    if (!opt.compare.empty())
+    {
+        base = load_baseline(opt.compare);
+    }
+    std::ofstream saved;
+    if (!opt.save.empty())
+    {
+        saved.open(opt.save);
+        if (!saved)
+        {
+            throw std::runtime_error(opt.save + ": " + strerror(errno));
+        }
+        saved << "# name ops median_ns min_ns\n";
+    }
+    if (!list)
+    {
+        printf("# name ops median_ns min_ns%s\n", base.empty() ? "" : " baseline_ns change%");
+    }
+    auto selected = [&](const std::string &name)
+    {
+        return name.find(opt.filter) != std::string::npos;
+    };
+    for (auto &[names, make] : groups)
+    {
+        if (std::none_of(names.begin(), names.end(), selected))
+        {
+            continue;
+        }
+        if (list)
+        {
+            for (auto &name : names)
+            {
+                if (selected(name))
+                {
+                    printf("%s\n", name.c_str());
+                }
+            }
+            continue;
+        }
+        for (auto &c : make())
+        {
+            if (!selected(c.name))
+            {
+                continue;
+            }
+            uint64_t ops = 0;
+            auto [median, min] = measure(c, opt, ops);
+            char line[512];
+            snprintf(line, sizeof(line), "%s %llu %.2f %.2f", c.name.c_str(), (unsigned long long)ops, median, min);
+            printf("%s", line);
+            if (auto it = base.find(c.name); it != base.end() && it->second > 0)
+            {
+                printf(" %.2f %+.2f%%", it->second, (median / it->second - 1) * 100);
+            }
+            printf("\n");
+            fflush(stdout);
+            if (saved.is_open())
+            {
+                saved << line << "\n";
+            }
+        }
+    }
+    return 0;
+}
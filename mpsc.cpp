@@ -0,0 +1,63 @@
+#pragma once
+#include <atomic>
+#include <utility>
+
+// 无锁多生产者单消费者队列(Vyukov), 任意线程可 push, 只有一个线程 pop
+// push 只有一次原子交换，不会阻塞；pop 可能在生产者尚未完成链接时暂时返回 false, 调用方需配合唤醒机制重试
+template <typename T>
+class mpsc_queue
+{
+    struct node
+    {
+        std::atomic<node *> next{nullptr};
+        T value;
+    };
+
+    alignas(64) std::atomic<node *> head; // 生产者写入端
+    alignas(64) node *tail;               // 消费者读取端，指向已消费的哨兵节点
+
+public:
+    mpsc_queue()
+    {
+        auto stub = new node();
+        head.store(stub, std::memory_order_relaxed);
+        tail = stub;
+    }
+    mpsc_queue(const mpsc_queue &) = delete;
+    mpsc_queue &operator=(const mpsc_queue &) = delete;
+    ~mpsc_queue()
+    {
+        T v;
+        while (pop(v))
+        {
+        }
+        delete tail;
+    }
+
+    void push(T v)
+    {
+        auto n = new node();
+        n->value = std::move(v);
+        auto prev = head.exchange(n, std::memory_order_acq_rel);
+        prev->next.store(n, std::memory_order_release);
+    }
+
+    bool pop(T &out)
+    {
+        auto next = tail->next.load(std::memory_order_acquire);
+        if (!next)
+        {
+            return false;
+        }
+        out = std::move(next->value);
+        delete tail;
+        tail = next;
+        return true;
+    }
+
+    // 仅消费者线程调用
+    bool empty() const
+    {
+        return tail->next.load(std::memory_order_acquire) == nullptr;
+    }
+};
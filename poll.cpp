@@ -1,13 +1,22 @@
 #pragma once
+#include "mpsc.cpp"
+#include "stats.cpp"
+#include "timer.cpp"
+#include "uring.cpp"
 #include <arpa/inet.h>
 #include <array>
+#include <atomic>
+#include <climits>
 #include <cstring>
 #include <ctype.h>
+#include <deque>
 #include <fcntl.h>
 #include <fstream>
 #include <functional>
 #include <iostream>
+#include <memory>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <poll.h>
 #include <queue>
 #include <regex>
@@ -18,9 +27,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <string>
+#include <string_view>
 #include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <unordered_map>
 #include <vector>
@@ -29,40 +43,240 @@ class poll_server
 {
     using self = poll_server;
 
+public:
+    // 事件循环后端
+    // EPOLL: 边缘触发，每次唤醒只处理就绪的fd，仅在关注的事件变化时才调用 epoll_ctl，适合大量空闲连接
+    // POLL: 每轮重建 pollfd 数组，开销与连接数成正比，作为兼容回退
+    // URING: 基于完成事件的 io_uring, multishot accept/recv 配合内核提供的接收缓冲区，发送请求每轮循环批量提交；内核不支持时回退为 EPOLL
+    enum class backend
+    {
+        POLL,
+        EPOLL,
+        URING,
+    };
+
+    struct options
+    {
+        backend engine = backend::EPOLL;
+        int idle_timeout = 0; // 毫秒，连接在此时间内没有收到或发出数据时关闭(-6), 0 表示不限制
+        // 发送队列中内存数据(不含文件区间)的字节数超过 high_watermark 时暂停读取该连接，降到 low_watermark 及以下时恢复，0 表示不暂停
+        size_t high_watermark = 1 << 20;
+        size_t low_watermark = 256 << 10;
+        size_t output_limit = 0;                   // 超过时关闭连接(-7)，0 表示不限制
+        std::function<void(self &, int)> on_drain; // 暂停读取的连接恢复读取时回调
+        std::function<void(self &, int)> on_limit; // 超过 output_limit 即将关闭连接时回调
+        int backlog = 511;                         // listen 的等待队列长度，受 net.core.somaxconn 限制
+        int max_connections = 10000;               // 客户端连接数上限，超过时 accept 后立即关闭(on_open 收到-1)
+        int accept_batch = 64;                     // 每次唤醒最多 accept 的连接数，其余留到下一轮，避免连接风暴时长时间不处理已有连接
+        // 新连接的 socket 选项，统一在 accept 后设置；缓冲区大小为0时使用系统默认值
+        bool tcp_nodelay = true;
+        int send_buffer = 0;
+        int recv_buffer = 0;
+    };
+
+    // 事件循环的统计，只由事件循环线程写入，其他线程可通过 stats() 随时读取，不加锁
+    struct loop_stats
+    {
+        // 关闭原因，下标为 on_data 数据长度取负，-10 记在最后一项
+        static constexpr int close_reasons = 9;
+        static constexpr const char *close_names[close_reasons] = {"app", "hup", "peer_closed", "send_error", "recv_error", "poll_error", "idle_timeout", "output_limit", "half_close"};
+
+        stat_counter iterations;
+        histogram busy;    // 每轮处理事件的耗时(纳秒)，从等待返回到下一次等待，不含等待时间
+        histogram ready;   // 每次唤醒就绪的fd数，URING 后端为完成事件数
+        histogram on_data; // 每次 on_data 回调的耗时(纳秒)
+        stat_counter bytes_in, bytes_out;
+        stat_counter reads;  // recv 调用次数，URING 后端为 recv 完成事件数
+        stat_counter writes; // send/sendmsg/sendfile 调用次数，URING 后端为提交的 sendmsg 数
+        stat_counter posted; // 执行的跨线程投递任务数
+        stat_counter queued; // 所有连接发送队列中内存数据的字节数
+        stat_counter paused; // 暂停读取的连接数
+        stat_counter accepted, rejected;
+        stat_counter closed[close_reasons];
+
+        static int close_index(int err)
+        {
+            return err == -10 ? close_reasons - 1 : -err;
+        }
+    };
+
+private:
+    // 借用数据的释放通知，随请求一起移动，请求销毁(发送完成或连接关闭)时执行一次
+    struct on_release
+    {
+        std::function<void()> fn;
+        on_release() = default;
+        explicit on_release(std::function<void()> f) : fn(std::move(f)) {}
+        on_release(on_release &&o) noexcept : fn(std::move(o.fn))
+        {
+            o.fn = nullptr;
+        }
+        on_release &operator=(on_release &&o) noexcept
+        {
+            if (this != &o)
+            {
+                reset();
+                fn = std::move(o.fn);
+                o.fn = nullptr;
+            }
+            return *this;
+        }
+        ~on_release()
+        {
+            reset();
+        }
+        void reset()
+        {
+            if (fn)
+            {
+                auto f = std::move(fn);
+                fn = nullptr;
+                f();
+            }
+        }
+    };
+
+    // 待发送的数据有三种来源：自有的 data, 外部内存 ptr/len(共享或借用，不复制), 文件区间 file_fd/file_off/len
     struct WriteRequest
     {
         std::string data;                               // 要写入的数据
         std::function<void(self &, int, int)> callback; // 回调函数,参数2:fd，参数3:发送的字节数
-        int out_bytes;                                  // 数据发送计数器，分片发送时，最后一次成功回调需要
+        size_t out_bytes = 0;                           // 数据发送计数器，分片发送时，最后一次成功回调需要
+        const char *ptr = nullptr;                      // 非空时发送外部内存而不是 data
+        size_t len = 0;                                 // 外部内存或文件区间的长度
+        int file_fd = -1;                               // 非负时发送文件区间，使用 sendfile
+        off_t file_off = 0;
+        std::shared_ptr<const void> keep; // 共享缓冲区的引用，保证发送完成前数据有效
+        on_release release;
+
+        const char *bytes() const
+        {
+            return ptr ? ptr : data.data();
+        }
+        size_t size() const
+        {
+            return ptr || file_fd >= 0 ? len : data.size();
+        }
+    };
+
+    // 连接的输入缓冲区，只保存 on_data 尚未消费的数据，消费完毕即归还内存，空闲连接不占用
+    struct input_buffer
+    {
+        std::unique_ptr<char[]> mem;
+        size_t cap = 0;
+        size_t start = 0; // 未消费数据的起点
+        size_t end = 0;   // 未消费数据的终点，之后为空闲空间
+        size_t expect = 0; // 本次 on_data 中应用通过 expect 预告的未消费数据的总长度
+
+        char *begin() const
+        {
+            return mem.get() + start;
+        }
+        size_t size() const
+        {
+            return end - start;
+        }
     };
 
     struct connection
     {
         pollfd info;
-        std::queue<WriteRequest> out;
+        std::deque<WriteRequest> out;
+        input_buffer in;
         bool write_closed = false; // 标记对端是否关闭写端
+        int holds = 0;             // 大于0时，对端半关闭后即使发送队列已空也不关闭，见 hold/release
+        short registered = 0;      // 已注册到 epoll 的事件，仅 EPOLL 后端使用
+        int idle_ms = 0;           // 空闲超时，0 表示不限制
+        uint64_t last_active = 0;  // 最近一次收到或发出数据的时刻
+        uint64_t idle_timer = 0;   // 空闲检查定时器，0 表示未设置
+        uint32_t gen = 0; // 连接代数(24位)，fd 复用后用于识别过期的完成事件和回调
+        size_t queued = 0;        // 发送队列中内存数据的字节数，不含文件区间
+        bool paused = false;      // 已停止读取，原因为以下三者之一
+        bool throttled = false;   // 发送队列超过高水位，降到低水位后清除
+        bool suspended = false;   // 应用调用 suspend 暂停读取
+        bool over_limit = false;  // 发送队列超过 output_limit, 等待关闭
+        bool closing = false;     // 应用调用 shutdown, 停止读取，发送队列为空后关闭
+        // 以下仅 URING 后端使用
+        bool receiving = false; // 有 recv 请求在内核中
+        bool sending = false;   // 有发送请求正在内核中执行
+        bool polling = false;   // 文件区间发送时缓冲区已满，正在等待可写
+        bool dirty = false;     // 已加入待提交发送列表
+        msghdr msg;             // 提交 sendmsg 时使用，提交后内核已复制
+        std::vector<iovec> iov; // 同上
+    };
+
+    // io_uring 请求类型，与连接代数、fd 一起编码到 user_data
+    enum uring_op : uint8_t
+    {
+        OP_ACCEPT = 1,
+        OP_RECV,
+        OP_SEND,
+        OP_CANCEL,
+        OP_WAKE,
+        OP_POLLOUT,
     };
 
 private:
     std::unordered_map<int, connection> connections;
     std::function<int(self &, int)> OnLoop;
     std::function<void(self &, int)> OnOpen;
-    std::function<void(self &, int, const char *, int)> OnData;
-    int startup(int port, int backlog = 128, const char *host = "")
+    std::function<int(self &, int, const char *, int)> OnData;
+    options opt;
+    int server_sock = -1;
+    int epfd = -1; // EPOLL 后端的实例，POLL 后端时为 -1
+    loop_stats stat;
+    uint64_t wake_ns = 0; // 本轮等待返回的时刻(纳秒)，用于统计每轮的处理耗时
+    int spare_fd = -1; // 预留的fd, 进程fd用尽时关闭它以便 accept 后立即关闭新连接，避免监听socket一直可读
+    bool is_running = false;
+    char buf[65536];
+    // 输入缓冲区按 buf 大小分配的内存块，连接之间复用
+    static constexpr size_t slab_size = sizeof(buf);
+    // 按 expect 分配输入缓冲区时额外预留的空间，容纳大参数之后较短的参数和下一个命令的开头
+    static constexpr size_t input_slack = 4096;
+    std::vector<std::unique_ptr<char[]>> slabs;
+
+    // 其他线程通过 post 投递的任务，使用 eventfd 唤醒事件循环
+    mpsc_queue<std::function<void(self &)>> inbox;
+    std::atomic<bool> wake_pending{false};
+    int event_fd = -1;
+
+    iovec iov[IOV_MAX];
+
+    // write 快速路径中直接发送完成的请求，其回调推迟到当前事件处理完毕后执行，避免在 write 内部重入
+    struct completion
     {
-        int httpd = socket(AF_INET, SOCK_STREAM, 0);
-        if (httpd < 0)
-        {
-            throw std::runtime_error(strerror(errno));
-        }
+        int fd;
+        uint32_t gen;
+        std::function<void(self &, int, int)> callback;
+        int bytes;
+        on_release release;
+    };
+    std::vector<completion> completions;
+
+    // 定时器和推迟执行的任务，只在事件循环线程中使用
+    timer_wheel<std::function<void(self &)>> timers;
+    std::vector<std::function<void(self &)>> deferred;
+    uint64_t loop_time = 0; // 本轮等待返回的时刻(毫秒)，定时器与空闲超时以此为准
+
+    uring ring;
+    bool use_uring = false;
+    bool recv_multishot = true; // 内核不支持 multishot recv 时退化为每次完成后重新提交
+    uint32_t next_gen = 0;
+    std::vector<int> send_list; // 本轮循环有数据待发送的连接，下次等待前统一提交
+    // 连接已关闭但发送请求仍在内核中时，保留其数据直到收到完成事件
+    std::unordered_map<uint64_t, std::deque<WriteRequest>> send_orphans;
 
-        if (set_noblocking(httpd) != 0)
+    int startup(int port, int backlog = 511, const char *host = "")
+    {
+        int httpd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (httpd < 0)
         {
             throw std::runtime_error(strerror(errno));
         }
 
         if (set_reuse_port(httpd) != 0)
         {
+            close(httpd);
             throw std::runtime_error(strerror(errno));
         }
 
@@ -83,278 +297,1601 @@ private:
         return httpd;
     }
 
-    inline int set_noblocking(int sockfd) const
+    inline int set_reuse_port(int sockfd) const
     {
-        int flags = fcntl(sockfd, F_GETFL, 0);
-        if (flags == -1)
+        int opt = 1;
+        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)
         {
             return -1;
         }
-        if (fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) == -1)
+        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0)
         {
             return -2;
         }
         return 0;
     }
 
-    inline int set_reuse_port(int sockfd) const
+    // 新连接的 socket 选项只在此处设置，accept4 已设置非阻塞和 close-on-exec, 不再需要 fcntl
+    // 设置失败不影响连接使用，忽略错误
+    void setup_socket(int fd) const
     {
-        int opt = 1;
-        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)
+        int v = 1;
+        if (opt.tcp_nodelay)
         {
-            return -1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &v, sizeof(v));
         }
-        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0)
+        if (opt.send_buffer > 0)
         {
-            return -2;
+            setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &opt.send_buffer, sizeof(opt.send_buffer));
+        }
+        if (opt.recv_buffer > 0)
+        {
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &opt.recv_buffer, sizeof(opt.recv_buffer));
+        }
+    }
+
+    // 加入事件循环, 监听的socket使用水平触发，每次唤醒最多 accept accept_batch 个连接；客户端连接在 EPOLL 后端使用边缘触发
+    // URING 后端下监听的socket提交 multishot accept, 客户端连接提交 multishot recv
+    bool add_connection(int fd, short events)
+    {
+        auto &c = connections[fd];
+        c.info = {fd, events, 0};
+        c.gen = ++next_gen & 0xffffff;
+        if (fd != server_sock)
+        {
+            c.last_active = loop_time;
+            c.idle_ms = opt.idle_timeout;
+            arm_idle(fd, c);
+        }
+        if (use_uring)
+        {
+            return fd == server_sock ? arm_accept() : arm_recv(fd, c);
+        }
+        if (epfd < 0)
+        {
+            return true;
+        }
+        epoll_event ev{};
+        ev.events = fd == server_sock ? (uint32_t)events : ((uint32_t)events | EPOLLET);
+        ev.data.fd = fd;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+        {
+            connections.erase(fd);
+            return false;
+        }
+        c.registered = events;
+        return true;
+    }
+
+    // 唤醒用的 eventfd 不属于连接，不计入连接数，在各后端中单独注册
+    bool add_wakeup()
+    {
+        if (use_uring)
+        {
+            return arm_wakeup();
+        }
+        if (epfd < 0)
+        {
+            return true;
+        }
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = event_fd;
+        return epoll_ctl(epfd, EPOLL_CTL_ADD, event_fd, &ev) == 0;
+    }
+
+    // 先清除唤醒标记再取任务，清除之后投递的任务一定会再次触发唤醒
+    void on_wakeup()
+    {
+        uint64_t v;
+        if (::read(event_fd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+        {
+            throw std::runtime_error(strerror(errno));
+        }
+        wake_pending.store(false);
+        std::function<void(self &)> fn;
+        while (inbox.pop(fn))
+        {
+            stat.posted.add();
+            fn(*this);
+        }
+    }
+
+    // 更新关注的事件，EPOLL 后端仅当与已注册的事件不同时才调用 epoll_ctl
+    void set_events(int fd, connection &c, short events)
+    {
+        c.info.events = events;
+        if (epfd < 0 || c.registered == events)
+        {
+            return;
+        }
+        epoll_event ev{};
+        ev.events = (uint32_t)events | EPOLLET;
+        ev.data.fd = fd;
+        if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == 0)
+        {
+            c.registered = events;
         }
-        return 0;
     }
 
     // 关闭指定的fd, 并执行回调, 如果已经关闭过，则忽略，err>0 时不执行回调
+    // fd 关闭后内核会自动将其移出 epoll，无需 EPOLL_CTL_DEL
+    // URING 后端需先取消该fd上所有未完成的请求，取消请求在提交时同步执行，必须在 close 之前，以免误伤复用此fd的新连接
     bool closefd(int fd, int err)
     {
-        if (connections.erase(fd) > 0)
+        auto it = connections.find(fd);
+        if (it == connections.end())
+        {
+            return false;
+        }
+        if (use_uring)
         {
-            if (err <= 0)
+            auto &c = it->second;
+            if (c.sending)
             {
-                OnData(*this, fd, nullptr, err);
+                send_orphans.emplace(user_data(OP_SEND, c.gen, fd), std::move(c.out));
             }
-            return close(fd) == 0;
+            if (auto sqe = ring.get_sqe())
+            {
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->fd = fd;
+                sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+                sqe->user_data = user_data(OP_CANCEL, 0, fd);
+                ring.submit();
+            }
+        }
+        free_input(it->second.in);
+        stat.queued.sub(it->second.queued);
+        if (it->second.paused)
+        {
+            stat.paused.sub(1);
+        }
+        if (err <= 0 && loop_stats::close_index(err) < loop_stats::close_reasons)
+        {
+            stat.closed[loop_stats::close_index(err)].add();
+        }
+        if (it->second.idle_timer)
+        {
+            timers.cancel(it->second.idle_timer);
         }
-        return false;
+        connections.erase(it);
+        if (err <= 0)
+        {
+            OnData(*this, fd, nullptr, err);
+        }
+        return close(fd) == 0;
     }
 
-public:
-    poll_server(std::function<int(self &, int)> on_loop, std::function<void(self &, int)> on_open, std::function<void(self &, int, const char *, int)> on_data) : OnLoop(std::move(on_loop)), OnOpen(std::move(on_open)), OnData(std::move(on_data))
+    // 新连接加入事件循环，超过连接数限制时直接关闭，不设置 socket 选项也不注册事件
+    void on_accepted(int client_sock)
+    {
+        // connections 中包含监听的socket
+        if ((int)connections.size() - 1 >= opt.max_connections)
+        {
+            close(client_sock);
+            stat.rejected.add();
+            OnOpen(*this, -1);
+            return;
+        }
+        setup_socket(client_sock);
+        // POLLHUP无需设置，总是会自动报告POLLHUP事件，如果设置了POLLOUT，发送缓冲区一直有空间，会重复报告
+        if (add_connection(client_sock, POLLIN))
+        {
+            stat.accepted.add();
+            OnOpen(*this, client_sock);
+        }
+        else
+        {
+            close(client_sock);
+            stat.rejected.add();
+            OnOpen(*this, -1);
+        }
+    }
+
+    // 对端已半关闭或应用调用了 shutdown, 且没有待发送的数据，也没有被应用持有
+    bool drained(const connection &c) const
     {
+        return (c.write_closed || c.closing) && c.out.empty() && !c.sending && c.holds == 0;
     }
-    // 返回值，已经入队的数量，当入队数量过多时，调用者需放缓以防止内存耗尽
-    // 如果传入的fd不对，将抛出异常
-    // 如果要发送的数据0字节，忽略发送请求，并且也没有回调函数
-    int write(int fd, const char *data, int len, std::function<void(self &, int, int)> cb = nullptr)
+
+    // drained 后关闭连接时 on_data 收到的原因，对端半关闭优先
+    static int drain_reason(const connection &c)
     {
-        return write(fd, std::string(data, len), std::move(cb));
+        return c.write_closed ? -10 : 0;
     }
-    // 返回值，已经入队的数量，当入队数量过多时，调用者需放缓以防止内存耗尽
-    // 如果传入的fd不对，返回-1表示错误，而不是抛出异常
-    // 如果要发送的数据0字节，忽略发送请求，并且也没有回调函数
-    int write(int fd, std::string data, std::function<void(self &, int, int)> cb = nullptr)
+
+    // 客户端关闭写端（半关闭状态），待发送数据发送完毕后再关闭
+    void on_eof(int fd, connection &c)
     {
-        auto it = connections.find(fd);
-        if (it == connections.end())
+        c.write_closed = true;
+        set_events(fd, c, c.info.events & ~POLLIN);
+        if (drained(c))
         {
-            return -1;
+            closefd(fd, -10); // 队列为空，直接关闭
         }
-        auto &c = it->second;
-        if (data.empty())
+    }
+
+    // 循环 accept 直到队列为空或达到 accept_batch, 监听的socket是水平触发，剩余的连接下一轮继续
+    void on_accept()
+    {
+        for (int i = 0; i < opt.accept_batch; i++)
         {
-            return c.out.size();
+            int client_sock = accept4(server_sock, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client_sock >= 0)
+            {
+                on_accepted(client_sock);
+                continue;
+            }
+            int err = errno;
+            if (err == EINTR || err == ECONNABORTED)
+            {
+                continue;
+            }
+            if (err == EAGAIN || err == EWOULDBLOCK)
+            {
+                return;
+            }
+            if (!accept_error(err))
+            {
+                return;
+            }
         }
-        c.out.emplace(std::move(data), std::move(cb), 0);
-        c.info.events |= POLLOUT;
-        return c.out.size();
     }
-    // 关闭指定的fd, 供外部主动调用, 如果已经关闭过，则忽略，调用后可能会触发关闭回调
-    bool closefd(int fd)
+
+    // fd 或内存暂时不足时返回是否还可以继续 accept, 其余错误抛出异常
+    bool accept_error(int err)
     {
-        return closefd(fd, 0);
+        if (err == EMFILE || err == ENFILE)
+        {
+            return shed_one();
+        }
+        if (err == ENOBUFS || err == ENOMEM)
+        {
+            return false; // 下一轮再试
+        }
+        throw std::runtime_error(strerror(err));
     }
 
-    bool start(int port, const char *host = "")
+    // fd 用尽时释放预留的fd, 取出一个连接后立即关闭，再重新预留，否则该连接一直留在队列中，监听socket每轮都会就绪
+    bool shed_one()
     {
-        int backlog = 128;
-        int server_sock = startup(port, backlog, host);
-        if (server_sock < 1)
+        if (spare_fd < 0)
         {
             return false;
         }
+        close(spare_fd);
+        int fd = accept4(server_sock, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd >= 0)
+        {
+            close(fd);
+            stat.rejected.add();
+            OnOpen(*this, -1);
+        }
+        spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        return fd >= 0;
+    }
 
-        connections[server_sock] = {.info = {server_sock, POLLIN, 0}};
+    void free_input(input_buffer &in)
+    {
+        if (in.mem && in.cap == slab_size && slabs.size() < 256)
+        {
+            slabs.push_back(std::move(in.mem));
+        }
+        in.mem.reset();
+        in.cap = in.start = in.end = 0;
+    }
 
-        struct sockaddr_in client_name;
-        socklen_t client_name_len = sizeof(client_name);
-        char buf[65536];
-        std::vector<pollfd> pollfds;
-        bool is_running = true;
-        while (is_running)
+    // 保证输入缓冲区尾部至少有 n 字节空闲空间，优先把未消费的数据移到开头，不够时扩容
+    // exact 为 true 时(已知最终大小)按所需大小分配，否则至少翻倍，逐步增长时均摊复制次数
+    char *reserve_input(input_buffer &in, size_t n, bool exact = false)
+    {
+        if (in.cap - in.end >= n)
         {
-            auto cs = connections.size();
-            auto n = OnLoop(*this, cs);
-            if (n < 1 || cs < 1) // OnLoop返回小于1代表意图停止服务
+            return in.mem.get() + in.end;
+        }
+        size_t live = in.size();
+        if (in.cap - live >= n)
+        {
+            memmove(in.mem.get(), in.begin(), live);
+        }
+        else
+        {
+            size_t cap = exact ? live + n : std::max({slab_size, in.cap * 2, live + n});
+            std::unique_ptr<char[]> mem;
+            if (cap == slab_size && !slabs.empty())
+            {
+                mem = std::move(slabs.back());
+                slabs.pop_back();
+            }
+            else
+            {
+                mem.reset(new char[cap]);
+            }
+            if (live > 0)
+            {
+                memcpy(mem.get(), in.begin(), live);
+            }
+            free_input(in);
+            in.mem = std::move(mem);
+            in.cap = cap;
+        }
+        in.start = 0;
+        in.end = live;
+        return in.mem.get() + in.end;
+    }
+
+    // 把数据交给 on_data, 回调看到的是全部未消费的数据，返回值为消费的字节数，未消费的部分保留到下次
+    // data 不为空时是输入缓冲区之外新收到的数据，输入缓冲区为空时直接回调，只复制未消费的剩余部分
+    // data 为空时新数据已经直接读入输入缓冲区
+    // 回调返回负数时关闭连接；返回 false 表示连接已关闭
+    // 回调的长度为 int, 未消费的数据超过 INT_MAX 时只交给回调前 INT_MAX 字节，其余留到下次
+    bool deliver(int fd, connection &c, const char *data, size_t n)
+    {
+        if (data && c.in.size() > 0)
+        {
+            memcpy(reserve_input(c.in, n), data, n);
+            c.in.end += n;
+            data = nullptr;
+        }
+        const char *p = data ? data : c.in.begin();
+        size_t len = data ? n : c.in.size();
+        auto gen = c.gen;
+        c.in.expect = 0;
+        c.last_active = loop_time;
+        auto t = clock_ns();
+        int consumed = OnData(*this, fd, p, (int)std::min<size_t>(len, INT_MAX));
+        stat.on_data.record(clock_ns() - t);
+        auto it = connections.find(fd);
+        if (it == connections.end() || it->second.gen != gen) // 回调中可能已关闭此连接
+        {
+            return false;
+        }
+        if (consumed < 0)
+        {
+            closefd(fd, 0);
+            return false;
+        }
+        size_t k = std::min((size_t)consumed, len);
+        size_t expect = c.in.expect;
+        if (data)
+        {
+            if (k < n)
+            {
+                bool exact = expect > n - k;
+                memcpy(reserve_input(c.in, exact ? expect + input_slack : n - k, exact), data + k, n - k);
+                c.in.end += n - k;
+            }
+        }
+        else if ((c.in.start += k) == c.in.end)
+        {
+            free_input(c.in);
+        }
+        else if (expect > c.in.size())
+        {
+            reserve_input(c.in, expect - c.in.size() + input_slack, true);
+        }
+        return true;
+    }
+
+    // 可读时一直读取到 EAGAIN，边缘触发模式下必须如此，否则剩余数据不会再次通知
+    // 输入缓冲区为空时读入公共的 buf, 有未消费的数据时直接读入输入缓冲区尾部，避免再次复制
+    void on_readable(int fd)
+    {
+        auto it = connections.find(fd);
+        if (it == connections.end())
+        {
+            return;
+        }
+        auto &c = it->second;
+        if (c.paused)
+        {
+            return; // 恢复读取时重新注册 POLLIN, 边缘触发模式下也会再次通知
+        }
+        ssize_t ret;
+        for (;;)
+        {
+            // 尾部还有空闲空间时直接读入，满了才扩容；按 expect 分配的缓冲区收完预告的数据前不会再扩容复制
+            bool direct = c.in.size() > 0;
+            char *dst = direct ? reserve_input(c.in, c.in.end < c.in.cap ? 1 : slab_size / 4) : buf;
+            size_t room = direct ? c.in.cap - c.in.end : sizeof(buf) - 1;
+            stat.reads.add();
+            if ((ret = recv(fd, dst, room, 0)) <= 0)
             {
-                is_running = false;
                 break;
             }
-            // 重新组织 pollfd 数组, 此处有性能开销因此连接数也不应过大，即backlog变量一般应小于1024
-            pollfds.clear();
-            for (const auto &c : connections)
+            stat.bytes_in.add(ret);
+            if (direct)
             {
-                pollfds.emplace_back(c.second.info);
+                c.in.end += ret;
             }
-            int num_fds = poll(pollfds.data(), pollfds.size(), n);
-            // 返回值，正整数：就绪的文件描述符数量，0: 超时，-1: 错误，第三个参数配置的是超时时间(n毫秒)
-            if (num_fds < 1)
+            if (!deliver(fd, c, direct ? nullptr : buf, ret) || c.paused)
             {
-                if (num_fds == 0) // 表明超时
-                {
-                    continue;
-                }
-                // 其他情况 poll 返回 -1 代表错误
-                if (errno == EINTR)
-                {
-                    continue;
-                }
-                throw std::runtime_error(strerror(errno));
+                return;
             }
-            for (const auto &item : pollfds)
+        }
+        if (ret == 0)
+        {
+            on_eof(fd, c);
+        }
+        else
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
             {
-                // 检查服务器套接字是否有新连接
-                if (item.fd == server_sock)
-                {
-                    if (item.revents & POLLIN)
-                    {
-                        // 接受新连接
-                        int client_sock = accept(server_sock, (struct sockaddr *)&client_name, &client_name_len);
-                        if (client_sock < 1)
-                        {
-                            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
-                            {
-                                continue;
-                            }
-                            throw std::runtime_error(strerror(errno));
-                        }
-                        if (set_noblocking(client_sock) != 0)
-                        {
-                            throw std::runtime_error(strerror(errno));
-                        }
-                        if ((int)pollfds.size() < backlog)
-                        {
-                            connections[client_sock] = {.info = {client_sock, POLLIN, 0}}; // POLLHUP无需设置，总是会自动报告POLLHUP事件，如果设置了POLLOUT，发送缓冲区一直有空间，会重复报告
-                            OnOpen(*this, client_sock);
-                        }
-                        else
-                        {
-                            close(client_sock);
-                            OnOpen(*this, -1);
-                        }
-                    }
-                    else if (item.revents & (POLLERR | POLLNVAL | POLLHUP))
-                    {
-                        is_running = false;
-                        break;
-                    }
-                    // 服务器监听的socket，上面是处理逻辑，只需要处理POLLIN事件，处理完毕在此直接跳到下个循环
-                    continue;
-                }
+                // 没有数据可读，继续等待
+                return;
+            }
+            closefd(fd, -4);
+        }
+    }
 
-                if (item.revents & POLLIN)
-                {
-                    int ret;
-                    while ((ret = recv(item.fd, buf, sizeof(buf) - 1, 0)) > 0)
-                    {
-                        OnData(*this, item.fd, buf, ret);
-                    }
-                    if (ret == 0)
-                    {
-                        // 客户端关闭写端（半关闭状态）
-                        auto it = connections.find(item.fd);
-                        if (it == connections.end())
-                        {
-                            continue;
-                        }
-                        auto &c = it->second;
-                        c.write_closed = true;
-                        c.info.events &= ~POLLIN;
-                        if (c.out.empty())
-                        {
-                            closefd(item.fd, -10); // 队列为空，直接关闭
-                        }
-                    }
-                    else
-                    {
-                        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
-                        {
-                            // 没有数据可读，继续等待
-                            continue;
-                        }
-                        closefd(item.fd, -4);
-                    }
-                }
-                else if (item.revents & POLLOUT)
-                {
-                    auto it = connections.find(item.fd);
-                    if (it == connections.end())
-                    {
-                        continue;
-                    }
-                    auto &c = it->second;
-                    auto &q = c.out;
-                    if (!q.empty())
-                    {
-                        auto &r = q.front();
-                        int bytesSent = send(item.fd, r.data.c_str() + r.out_bytes, r.data.size() - r.out_bytes, MSG_DONTWAIT | MSG_NOSIGNAL);
-                        if (bytesSent < 0)
-                        {
-                            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
-                            {
-                                continue; // 发送缓冲区满，稍后重试
-                            }
-                            // 处理 EPIPE 或其他错误 可以读取 strerror(errno)
-                            q.pop();
-                            c.info.events &= ~POLLOUT;
-                            closefd(item.fd, -3);
-                        }
-                        else if (bytesSent > 0)
-                        {
-                            // 部分数据发送成功，可能需要稍后再试
-                            r.out_bytes += bytesSent;
-                            if (r.out_bytes == (int)r.data.size())
-                            {
-                                auto callback = std::move(r.callback); // 保存回调函数
-                                auto sent_bytes = r.out_bytes;         // 保存发送的字节数
-                                q.pop();                               // 发送完成，移除请求
-                                if (callback)
-                                {
-                                    callback(*this, item.fd, sent_bytes);
-                                }
-                            }
-                        }
-                        else // bytesSent == 0（对方关闭连接）
-                        {
-                            q.pop();
-                            c.info.events &= ~POLLOUT;
-                            closefd(item.fd, -2);
-                        }
-                    }
-                    else
-                    {
-                        // 发送队列为空，移除 POLLOUT 事件
-                        c.info.events &= ~POLLOUT;
-                        if (c.write_closed)
-                        {
-                            closefd(item.fd, -10);
-                        }
-                    }
-                }
-                else if (item.revents & POLLHUP)
-                {
-                    // 对方关闭连接,使用-1标记是POLLHUP事件触发了
-                    closefd(item.fd, -1);
-                }
-                else if (item.revents & (POLLERR | POLLNVAL))
-                {
-                    closefd(item.fd, -5);
-                }
-                // else 没有事件
+    // 从队首开始，把待发送的数据填充为 iovec, 最多 max 个，遇到文件区间为止
+    int fill_iov(const connection &c, iovec *iov, int max) const
+    {
+        int n = 0;
+        for (auto &r : c.out)
+        {
+            if (n >= max || r.file_fd >= 0)
+            {
+                break;
             }
+            iov[n++] = {(void *)(r.bytes() + r.out_bytes), r.size() - r.out_bytes};
         }
-        close(server_sock);
-        for (const auto &pair : connections)
+        return n;
+    }
+
+    // 发送队首的文件区间，由内核直接从页缓存复制到 socket
+    // 返回值，正整数：已发送的字节数，0: 发送缓冲区已满，-1: 出错或文件长度不足
+    ssize_t send_file(int fd, const WriteRequest &r)
+    {
+        off_t off = r.file_off + r.out_bytes;
+        stat.writes.add();
+        auto n = ::sendfile(fd, r.file_fd, &off, r.len - r.out_bytes);
+        if (n > 0)
         {
-            close(pair.first);
+            return n;
         }
-        connections.clear();
+        return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    }
+
+    // 已发送 n 字节，依次移除发送完成的请求并按顺序执行回调，发送队列降到低水位时恢复读取
+    // 返回 false 表示连接已在回调中被关闭
+    bool consume_sent(int fd, connection &c, size_t n)
+    {
+        auto gen = c.gen;
+        c.last_active = loop_time;
+        stat.bytes_out.add(n);
+        while (n > 0 && !c.out.empty())
+        {
+            auto &r = c.out.front();
+            size_t remain = r.size() - r.out_bytes;
+            if (r.file_fd < 0)
+            {
+                c.queued -= std::min(n, remain);
+                stat.queued.sub(std::min(n, remain));
+            }
+            if (n < remain)
+            {
+                r.out_bytes += n;
+                break;
+            }
+            n -= remain;
+            auto callback = std::move(r.callback);
+            auto sent_bytes = (int)std::min<size_t>(r.size(), INT_MAX);
+            c.out.pop_front();
+            if (callback)
+            {
+                callback(*this, fd, sent_bytes);
+                auto it = connections.find(fd);
+                if (it == connections.end() || it->second.gen != gen)
+                {
+                    return false;
+                }
+            }
+        }
+        if (c.throttled)
+        {
+            check_watermark(fd, c);
+        }
+        return true;
+    }
+
+    // 发送队列超过高水位时暂停读取，暂停后降到低水位及以下时恢复
+    void check_watermark(int fd, connection &c)
+    {
+        if (!c.throttled && opt.high_watermark > 0 && c.queued > opt.high_watermark)
+        {
+            c.throttled = true;
+            update_read(fd, c);
+        }
+        else if (c.throttled && c.queued <= opt.low_watermark)
+        {
+            c.throttled = false;
+            update_read(fd, c);
+        }
+    }
+
+    // 高水位、应用暂停和超过 output_limit 均已解除时才恢复读取
+    void update_read(int fd, connection &c)
+    {
+        bool stop = c.throttled || c.suspended || c.over_limit || c.closing;
+        if (stop && !c.paused)
+        {
+            pause_read(fd, c);
+        }
+        else if (!stop && c.paused)
+        {
+            resume_read(fd, c);
+        }
+    }
+
+    // EPOLL/POLL 后端不再关注 POLLIN; URING 后端取消 recv 请求，已完成的接收仍会交给 on_data
+    void pause_read(int fd, connection &c)
+    {
+        c.paused = true;
+        stat.paused.add();
+        if (!use_uring)
+        {
+            set_events(fd, c, c.info.events & ~POLLIN);
+        }
+        else if (c.receiving)
+        {
+            if (auto sqe = ring.get_sqe())
+            {
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->addr = user_data(OP_RECV, c.gen, fd);
+                sqe->user_data = user_data(OP_CANCEL, 0, fd);
+            }
+        }
+    }
+
+    // 恢复读取，输入缓冲区中 on_data 尚未消费的数据在当前事件处理完毕后重新交给 on_data, 不必等待新数据到达
+    void resume_read(int fd, connection &c)
+    {
+        c.paused = false;
+        stat.paused.sub(1);
+        if (use_uring)
+        {
+            rearm_recv(fd, c);
+        }
+        else if (!c.write_closed)
+        {
+            set_events(fd, c, c.info.events | POLLIN);
+        }
+        defer([fd, gen = c.gen](self &s)
+              { s.on_resume(fd, gen); });
+    }
+
+    void on_resume(int fd, uint32_t gen)
+    {
+        auto it = connections.find(fd);
+        if (it == connections.end() || it->second.gen != gen || it->second.paused)
+        {
+            return;
+        }
+        if (opt.on_drain)
+        {
+            opt.on_drain(*this, fd);
+            it = connections.find(fd);
+            if (it == connections.end() || it->second.gen != gen)
+            {
+                return;
+            }
+        }
+        auto &c = it->second;
+        if (c.in.size() > 0 && !deliver(fd, c, nullptr, 0))
+        {
+            return;
+        }
+        if (drained(c))
+        {
+            closefd(fd, drain_reason(c));
+        }
+    }
+
+    // 发送队列超过 output_limit, 停止读取并在当前事件处理完毕后强制关闭连接(-7)，不在 write 内部触发关闭回调
+    void exceed_limit(int fd, connection &c)
+    {
+        if (c.over_limit)
+        {
+            return;
+        }
+        c.over_limit = true;
+        update_read(fd, c);
+        defer([fd, gen = c.gen](self &s)
+              {
+            auto it = s.connections.find(fd);
+            if (it == s.connections.end() || it->second.gen != gen)
+            {
+                return;
+            }
+            if (s.opt.on_limit)
+            {
+                s.opt.on_limit(s, fd);
+                it = s.connections.find(fd);
+                if (it == s.connections.end() || it->second.gen != gen)
+                {
+                    return;
+                }
+            }
+            linger lg{1, 0}; // 以 RST 关闭，内核发送缓冲区中的数据一并丢弃
+            setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+            s.closefd(fd, -7); });
+    }
+
+    // 可写时把整个队列合并为一次 sendmsg 发送(每次最多 IOV_MAX 段), 直到队列为空或发送缓冲区已满
+    // 文件区间单独使用 sendfile 发送，每个请求发送完成后按顺序执行其回调
+    void on_writable(int fd)
+    {
+        auto it = connections.find(fd);
+        if (it == connections.end())
+        {
+            return;
+        }
+        auto &c = it->second;
+        while (!c.out.empty())
+        {
+            if (c.out.front().file_fd >= 0)
+            {
+                // sendfile 单次发送量有上限，部分发送不代表缓冲区已满，继续发送直到返回 EAGAIN
+                auto sent = send_file(fd, c.out.front());
+                if (sent < 0)
+                {
+                    closefd(fd, -3);
+                    return;
+                }
+                if (sent == 0)
+                {
+                    return;
+                }
+                if (!consume_sent(fd, c, sent))
+                {
+                    return;
+                }
+                continue;
+            }
+            int n = fill_iov(c, iov, IOV_MAX);
+            size_t total = 0;
+            for (int i = 0; i < n; i++)
+            {
+                total += iov[i].iov_len;
+            }
+            msghdr msg{};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = n;
+            stat.writes.add();
+            auto bytesSent = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (bytesSent < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                {
+                    return; // 发送缓冲区满，稍后重试
+                }
+                // 处理 EPIPE 或其他错误 可以读取 strerror(errno)
+                closefd(fd, -3);
+                return;
+            }
+            else if (bytesSent == 0) // 对方关闭连接
+            {
+                closefd(fd, -2);
+                return;
+            }
+            if (!consume_sent(fd, c, bytesSent))
+            {
+                return; // 回调中已关闭此连接
+            }
+            if ((size_t)bytesSent < total)
+            {
+                return; // 部分发送说明发送缓冲区已满，等待下次可写通知
+            }
+        }
+        // 发送队列为空，移除 POLLOUT 事件
+        set_events(fd, c, c.info.events & ~POLLOUT);
+        if (drained(c))
+        {
+            closefd(fd, drain_reason(c));
+        }
+    }
+
+    // 执行 write 快速路径中已发送完成的请求的回调
+    // 只处理本次调用前积累的部分，回调中再次写入产生的完成事件留到下一次，避免持续写入时长时间不返回事件循环
+    void run_completions()
+    {
+        if (completions.empty())
+        {
+            return;
+        }
+        auto list = std::move(completions);
+        completions.clear();
+        for (auto &x : list)
+        {
+            auto it = connections.find(x.fd);
+            if (x.callback && it != connections.end() && it->second.gen == x.gen)
+            {
+                x.callback(*this, x.fd, x.bytes);
+            }
+            x.release.reset();
+        }
+    }
+
+    static uint64_t clock_ms()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    // 等待返回时更新本轮的时刻，毫秒时刻供定时器和空闲超时使用
+    void wake()
+    {
+        wake_ns = clock_ns();
+        loop_time = wake_ns / 1000000;
+    }
+
+    // 空闲检查定时器只在到期时检查最近活动时刻，收发数据时只更新时刻，不操作定时器
+    void arm_idle(int fd, connection &c)
+    {
+        if (c.idle_timer)
+        {
+            timers.cancel(c.idle_timer);
+            c.idle_timer = 0;
+        }
+        if (c.idle_ms > 0)
+        {
+            c.idle_timer = timers.add(c.last_active + c.idle_ms, 0, [fd, gen = c.gen](self &s)
+                                      { s.on_idle(fd, gen); });
+        }
+    }
+
+    void on_idle(int fd, uint32_t gen)
+    {
+        auto it = connections.find(fd);
+        if (it == connections.end() || it->second.gen != gen)
+        {
+            return;
+        }
+        auto &c = it->second;
+        c.idle_timer = 0;
+        if (c.last_active + c.idle_ms <= loop_time)
+        {
+            closefd(fd, -6);
+        }
+        else
+        {
+            arm_idle(fd, c);
+        }
+    }
+
+    // 执行到期的定时器和推迟的任务，推迟任务中再次推迟的留到下一轮
+    void run_timers()
+    {
+        timers.advance(loop_time, [this](std::function<void(self &)> &fn)
+                       { fn(*this); });
+        if (deferred.empty())
+        {
+            return;
+        }
+        auto list = std::move(deferred);
+        deferred.clear();
+        for (auto &fn : list)
+        {
+            fn(*this);
+        }
+    }
+
+    // 各 write 的公共部分，EPOLL/POLL 后端下若队列为空，先直接尝试发送内存数据，剩余部分入队
+    // copy 为 true 时 ptr 指向的数据只在调用期间有效，入队前复制为自有数据
+    int enqueue(int fd, WriteRequest &&r, bool copy = false)
+    {
+        auto it = connections.find(fd);
+        if (it == connections.end())
+        {
+            return -1;
+        }
+        auto &c = it->second;
+        if (c.over_limit)
+        {
+            return -1;
+        }
+        if (r.size() == 0)
+        {
+            return c.out.size();
+        }
+        if (!use_uring && c.out.empty() && !c.write_closed && r.file_fd < 0)
+        {
+            stat.writes.add();
+            auto n = send(fd, r.bytes(), r.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n > 0)
+            {
+                c.last_active = loop_time;
+                stat.bytes_out.add(n);
+            }
+            if (n == (ssize_t)r.size())
+            {
+                if (r.callback || r.release.fn)
+                {
+                    completions.push_back({fd, c.gen, std::move(r.callback), (int)n, std::move(r.release)});
+                }
+                return 0;
+            }
+            // 部分发送或 EAGAIN 时剩余数据入队；其他错误也入队，由可写事件处理统一关闭连接，避免在 write 内部触发关闭回调
+            r.out_bytes = n > 0 ? n : 0;
+        }
+        if (copy)
+        {
+            r.data.assign(r.ptr, r.len);
+            r.ptr = nullptr;
+        }
+        if (r.file_fd < 0)
+        {
+            c.queued += r.size() - r.out_bytes;
+            stat.queued.add(r.size() - r.out_bytes);
+        }
+        c.out.push_back(std::move(r));
+        if (use_uring)
+        {
+            queue_send(fd, c);
+        }
+        else
+        {
+            set_events(fd, c, c.info.events | POLLOUT);
+        }
+        if (opt.output_limit > 0 && c.queued > opt.output_limit)
+        {
+            exceed_limit(fd, c);
+            return -1;
+        }
+        check_watermark(fd, c);
+        return c.out.size();
+    }
+
+    // 处理单个fd上的就绪事件，poll 与 epoll 的 IN/OUT/ERR/HUP 取值相同，可共用
+    void on_event(int fd, uint32_t revents)
+    {
+        if (fd == event_fd)
+        {
+            on_wakeup();
+            return;
+        }
+        // 检查服务器套接字是否有新连接
+        if (fd == server_sock)
+        {
+            if (revents & POLLIN)
+            {
+                on_accept();
+            }
+            else if (revents & (POLLERR | POLLNVAL | POLLHUP))
+            {
+                is_running = false;
+            }
+            return;
+        }
+        if (revents & (POLLIN | POLLOUT))
+        {
+            if (revents & POLLIN)
+            {
+                on_readable(fd);
+            }
+            if (revents & POLLOUT)
+            {
+                on_writable(fd);
+            }
+        }
+        else if (revents & POLLHUP)
+        {
+            // 对方关闭连接,使用-1标记是POLLHUP事件触发了
+            closefd(fd, -1);
+        }
+        else if (revents & (POLLERR | POLLNVAL))
+        {
+            closefd(fd, -5);
+        }
+        // else 没有事件
+    }
+
+    // 返回值，正整数：就绪的文件描述符数量，0: 超时，-1: 错误
+    int wait_poll(std::vector<pollfd> &pollfds, int timeout)
+    {
+        // 重新组织 pollfd 数组, 此处有性能开销因此连接数也不应过大，即 max_connections 一般应小于1024
+        pollfds.clear();
+        pollfds.push_back({event_fd, POLLIN, 0});
+        for (const auto &c : connections)
+        {
+            pollfds.emplace_back(c.second.info);
+        }
+        int num_fds = poll(pollfds.data(), pollfds.size(), timeout);
+        wake();
+        if (num_fds < 1)
+        {
+            return num_fds;
+        }
+        for (const auto &item : pollfds)
+        {
+            if (item.revents)
+            {
+                on_event(item.fd, item.revents);
+            }
+        }
+        return num_fds;
+    }
+
+    int wait_epoll(std::vector<epoll_event> &events, int timeout)
+    {
+        int num_fds = epoll_wait(epfd, events.data(), events.size(), timeout);
+        wake();
+        for (int i = 0; i < num_fds; i++)
+        {
+            on_event(events[i].data.fd, events[i].events);
+        }
+        return num_fds;
+    }
+
+    static uint64_t user_data(uring_op op, uint32_t gen, int fd)
+    {
+        return ((uint64_t)op << 56) | ((uint64_t)gen << 32) | (uint32_t)fd;
+    }
+
+    // 探测内核是否具备 URING 后端需要的全部能力，任何一项不满足都返回 false 由调用方回退
+    bool init_uring()
+    {
+        if (!ring.init(4096))
+        {
+            return false;
+        }
+        if (!ring.has_feature(IORING_FEAT_EXT_ARG) || !ring.probe({IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_ASYNC_CANCEL}) || !ring.setup_buf_ring(0, 1024, 16384))
+        {
+            ring.exit();
+            return false;
+        }
+        return true;
+    }
+
+    bool arm_accept()
+    {
+        auto sqe = ring.get_sqe();
+        if (!sqe)
+        {
+            return false;
+        }
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = server_sock;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->user_data = user_data(OP_ACCEPT, 0, server_sock);
+        return true;
+    }
+
+    bool arm_wakeup()
+    {
+        auto sqe = ring.get_sqe();
+        if (!sqe)
+        {
+            return false;
+        }
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = event_fd;
+        sqe->poll32_events = POLLIN;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->user_data = user_data(OP_WAKE, 0, event_fd);
+        return true;
+    }
+
+    // 由内核从缓冲区组0中挑选接收缓冲区，一个 multishot 请求持续产生数据直到出错或缓冲区耗尽
+    bool arm_recv(int fd, connection &c)
+    {
+        auto sqe = ring.get_sqe();
+        if (!sqe)
+        {
+            return false;
+        }
+        c.receiving = true;
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+        sqe->ioprio = recv_multishot ? IORING_RECV_MULTISHOT : 0;
+        sqe->user_data = user_data(OP_RECV, c.gen, fd);
+        return true;
+    }
+
+    // 上一个 recv 请求已结束时重新提交，暂停读取或对端已关闭写端时不提交
+    void rearm_recv(int fd, connection &c)
+    {
+        if (!c.receiving && !c.paused && !c.write_closed)
+        {
+            arm_recv(fd, c);
+        }
+    }
+
+    // 同一连接同时只有一个发送请求在内核中，保证数据顺序
+    void queue_send(int fd, connection &c)
+    {
+        if (!c.sending && !c.polling && !c.dirty)
+        {
+            c.dirty = true;
+            send_list.push_back(fd);
+        }
+    }
+
+    // 队首的文件区间直接非阻塞 sendfile, 直到队首为内存数据
+    // 返回值，1: 队首为内存数据或队列为空，0: 发送缓冲区已满，-1: 连接已关闭
+    int send_files(int fd, connection &c)
+    {
+        while (!c.out.empty() && c.out.front().file_fd >= 0)
+        {
+            auto n = send_file(fd, c.out.front());
+            if (n < 0)
+            {
+                closefd(fd, -3);
+                return -1;
+            }
+            if (n == 0)
+            {
+                return 0;
+            }
+            if (!consume_sent(fd, c, n))
+            {
+                return -1;
+            }
+        }
+        return 1;
+    }
+
+    // 把本轮循环积累的发送请求填充为 sendmsg, 随后与等待一起通过一次 io_uring_enter 提交
+    // 文件区间没有对应的 io_uring 发送操作，在此同步 sendfile, 缓冲区满时提交一次 POLLOUT 等待可写
+    void flush_sends()
+    {
+        size_t i = 0;
+        for (; i < send_list.size(); i++)
+        {
+            int fd = send_list[i];
+            auto it = connections.find(fd);
+            if (it == connections.end() || !it->second.dirty)
+            {
+                continue;
+            }
+            auto &c = it->second;
+            int state = send_files(fd, c);
+            if (state < 0)
+            {
+                continue;
+            }
+            if (c.out.empty())
+            {
+                c.dirty = false;
+                if (drained(c))
+                {
+                    closefd(fd, drain_reason(c));
+                }
+                continue;
+            }
+            auto sqe = ring.get_sqe();
+            if (!sqe)
+            {
+                break; // sq 已满且无法提交，剩余的留到下一轮
+            }
+            c.dirty = false;
+            if (state == 0)
+            {
+                sqe->opcode = IORING_OP_POLL_ADD;
+                sqe->fd = fd;
+                sqe->poll32_events = POLLOUT;
+                sqe->user_data = user_data(OP_POLLOUT, c.gen, fd);
+                c.polling = true;
+                continue;
+            }
+            c.iov.resize(std::min<size_t>(c.out.size(), IOV_MAX));
+            c.iov.resize(fill_iov(c, c.iov.data(), c.iov.size()));
+            memset(&c.msg, 0, sizeof(c.msg));
+            c.msg.msg_iov = c.iov.data();
+            c.msg.msg_iovlen = c.iov.size();
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = fd;
+            sqe->addr = (uint64_t)&c.msg;
+            sqe->len = 1;
+            sqe->msg_flags = MSG_NOSIGNAL;
+            sqe->user_data = user_data(OP_SEND, c.gen, fd);
+            c.sending = true;
+            stat.writes.add();
+        }
+        send_list.erase(send_list.begin(), send_list.begin() + i);
+    }
+
+    void on_complete(const io_uring_cqe &cqe)
+    {
+        auto op = (uring_op)(cqe.user_data >> 56);
+        auto gen = (uint32_t)(cqe.user_data >> 32) & 0xffffff;
+        int fd = (int)(uint32_t)cqe.user_data;
+        bool more = cqe.flags & IORING_CQE_F_MORE;
+        if (op == OP_ACCEPT)
+        {
+            if (cqe.res >= 0)
+            {
+                on_accepted(cqe.res);
+            }
+            else if (cqe.res != -EAGAIN && cqe.res != -EINTR && cqe.res != -ECONNABORTED && cqe.res != -ECANCELED)
+            {
+                accept_error(-cqe.res);
+            }
+            if (!more && is_running)
+            {
+                arm_accept();
+            }
+            return;
+        }
+        if (op == OP_CANCEL)
+        {
+            return;
+        }
+        if (op == OP_WAKE)
+        {
+            if (cqe.res > 0)
+            {
+                on_wakeup();
+            }
+            if (!more && is_running)
+            {
+                arm_wakeup();
+            }
+            return;
+        }
+        auto it = connections.find(fd);
+        bool alive = it != connections.end() && it->second.gen == gen;
+        if (op == OP_POLLOUT)
+        {
+            if (alive)
+            {
+                it->second.polling = false;
+                queue_send(fd, it->second);
+            }
+            return;
+        }
+        if (op == OP_SEND)
+        {
+            if (!alive)
+            {
+                send_orphans.erase(cqe.user_data);
+                return;
+            }
+            auto &c = it->second;
+            c.sending = false;
+            if (cqe.res > 0)
+            {
+                if (!consume_sent(fd, c, cqe.res))
+                {
+                    return;
+                }
+                if (!c.out.empty())
+                {
+                    queue_send(fd, c);
+                }
+                else if (drained(c))
+                {
+                    closefd(fd, drain_reason(c));
+                }
+            }
+            else if (cqe.res == 0)
+            {
+                closefd(fd, -2);
+            }
+            else if (cqe.res == -EAGAIN || cqe.res == -EINTR)
+            {
+                queue_send(fd, c);
+            }
+            else
+            {
+                closefd(fd, -3);
+            }
+            return;
+        }
+        // OP_RECV
+        bool has_buf = cqe.flags & IORING_CQE_F_BUFFER;
+        unsigned bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        if (!alive)
+        {
+            if (has_buf)
+            {
+                ring.recycle_buf(bid);
+            }
+            return;
+        }
+        auto &c = it->second;
+        if (!more)
+        {
+            c.receiving = false;
+        }
+        stat.reads.add();
+        if (cqe.res > 0)
+        {
+            stat.bytes_in.add(cqe.res);
+            bool open = deliver(fd, c, ring.buf(bid), cqe.res);
+            ring.recycle_buf(bid);
+            if (open)
+            {
+                rearm_recv(fd, c);
+            }
+            return;
+        }
+        if (has_buf)
+        {
+            ring.recycle_buf(bid);
+        }
+        if (cqe.res == 0)
+        {
+            on_eof(fd, c);
+        }
+        else if (cqe.res == -EINVAL && recv_multishot)
+        {
+            recv_multishot = false; // 内核不支持 multishot recv
+            rearm_recv(fd, c);
+        }
+        else if (cqe.res == -ENOBUFS || cqe.res == -EAGAIN || cqe.res == -EINTR || cqe.res == -ECANCELED)
+        {
+            rearm_recv(fd, c); // 因暂停读取被取消后已恢复时重新提交
+        }
+        else
+        {
+            closefd(fd, -4);
+        }
+    }
+
+    int wait_uring(int timeout)
+    {
+        flush_sends();
+        int ret = ring.submit_and_wait(ring.cq_ready() ? 0 : 1, timeout);
+        wake();
+        if (ret < 0 && ret != -ETIME && ret != -EBUSY)
+        {
+            errno = -ret;
+            return -1;
+        }
+        return ring.for_each_cqe([this](const io_uring_cqe &cqe)
+                                 { on_complete(cqe); });
+    }
+
+public:
+    poll_server(std::function<int(self &, int)> on_loop, std::function<void(self &, int)> on_open, std::function<int(self &, int, const char *, int)> on_data, options o) : OnLoop(std::move(on_loop)), OnOpen(std::move(on_open)), OnData(std::move(on_data)), opt(o)
+    {
+        event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (event_fd < 0)
+        {
+            throw std::runtime_error(strerror(errno));
+        }
+        loop_time = clock_ms();
+        timers.reset(loop_time);
+    }
+    poll_server(std::function<int(self &, int)> on_loop, std::function<void(self &, int)> on_open, std::function<int(self &, int, const char *, int)> on_data) : poll_server(std::move(on_loop), std::move(on_open), std::move(on_data), options{})
+    {
+    }
+    poll_server(const poll_server &) = delete;
+    poll_server &operator=(const poll_server &) = delete;
+    ~poll_server()
+    {
+        close(event_fd);
+    }
+    // 投递一个任务到本事件循环线程执行，线程安全，可在任意线程调用，也可在启动前调用
+    // 用于多个事件循环之间传递消息，同一线程投递的任务按投递顺序执行
+    void post(std::function<void(self &)> fn)
+    {
+        inbox.push(std::move(fn));
+        if (!wake_pending.exchange(true))
+        {
+            uint64_t v = 1;
+            if (::write(event_fd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+            {
+                throw std::runtime_error(strerror(errno));
+            }
+        }
+    }
+    // 返回值：-1 表示 fd 无效或发送队列超过 output_limit 已关闭连接；0 表示已直接全部发送(或数据为空且队列为空)，未入队；
+    // 大于0为发送队列中的请求数，当入队数量过多时，调用者需放缓以防止内存耗尽。返回值 <= 0 时本次数据不在队列中
+    // 如果要发送的数据0字节，忽略发送请求，并且也没有回调函数
+    // 数据只需在调用期间有效，快速路径全部发送完成时不复制，否则复制后入队，调用方可以复用自己的缓冲区
+    int write(int fd, const char *data, int len, std::function<void(self &, int, int)> cb = nullptr)
+    {
+        WriteRequest r;
+        r.ptr = data;
+        r.len = len > 0 ? len : 0;
+        r.callback = std::move(cb);
+        return enqueue(fd, std::move(r), true);
+    }
+    // 返回值与上面的 write 相同：-1 为 fd 无效或超过 output_limit, 0 为已直接全部发送，大于0为发送队列中的请求数
+    // 如果要发送的数据0字节，忽略发送请求，并且也没有回调函数
+    // EPOLL/POLL 后端下若队列为空，会先直接尝试发送，全部发送完成则不入队，回调在当前事件处理完毕后执行
+    int write(int fd, std::string data, std::function<void(self &, int, int)> cb = nullptr)
+    {
+        WriteRequest r;
+        r.data = std::move(data);
+        r.callback = std::move(cb);
+        return enqueue(fd, std::move(r));
+    }
+    // 发送引用计数的共享缓冲区，不复制数据，发送完成或连接关闭前持有一份引用，同一份数据可以同时发给多个连接
+    // 返回值与 write 相同
+    int write(int fd, std::shared_ptr<const std::string> data, std::function<void(self &, int, int)> cb = nullptr)
+    {
+        WriteRequest r;
+        if (data)
+        {
+            r.ptr = data->data();
+            r.len = data->size();
+            r.keep = std::move(data);
+        }
+        r.callback = std::move(cb);
+        return enqueue(fd, std::move(r));
+    }
+    // 发送调用方持有的数据，不复制，调用方需保证数据在 release 执行前有效，静态数据可以不传 release
+    // release 在数据发送完成或连接关闭后执行且只执行一次，只有 fd 无效或数据为空时才会在 write_view 返回前执行
+    // 返回值与 write 相同
+    int write_view(int fd, std::string_view data, std::function<void(self &, int, int)> cb = nullptr, std::function<void()> release = nullptr)
+    {
+        WriteRequest r;
+        r.ptr = data.data();
+        r.len = data.size();
+        r.callback = std::move(cb);
+        r.release = on_release(std::move(release));
+        return enqueue(fd, std::move(r));
+    }
+    // 发送文件 file_fd 中 [offset, offset+count) 区间，使用 sendfile 由内核直接复制，数据不经过用户态
+    // file_fd 由调用方打开和关闭，需保证在 release 执行前有效；文件长度不足 count 时按发送出错(-3)关闭连接
+    // 返回值与 write 相同
+    int write_file(int fd, int file_fd, off_t offset, size_t count, std::function<void(self &, int, int)> cb = nullptr, std::function<void()> release = nullptr)
+    {
+        WriteRequest r;
+        r.file_fd = file_fd;
+        r.file_off = offset;
+        r.len = count;
+        r.callback = std::move(cb);
+        r.release = on_release(std::move(release));
+        return enqueue(fd, std::move(r));
+    }
+    // 发送队列中现有的数据全部发送完成后执行 cb, 时机与最后一个请求的回调相同(在其之后)，用于已写入后才决定等待发送的场合
+    // 队列为空或 fd 无效时返回 false, 不执行 cb；连接关闭时不执行
+    bool when_sent(int fd, std::function<void(self &, int, int)> cb)
+    {
+        auto it = connections.find(fd);
+        if (it == connections.end() || it->second.out.empty())
+        {
+            return false;
+        }
+        auto &r = it->second.out.back();
+        if (!r.callback)
+        {
+            r.callback = std::move(cb);
+            return true;
+        }
+        r.callback = [first = std::move(r.callback), cb = std::move(cb), gen = it->second.gen](self &s, int fd, int n)
+        {
+            first(s, fd, n);
+            auto it = s.connections.find(fd);
+            if (it != s.connections.end() && it->second.gen == gen) // 前一个回调中可能已关闭此连接
+            {
+                cb(s, fd, n);
+            }
+        };
+        return true;
+    }
+    // 关闭指定的fd, 供外部主动调用, 如果已经关闭过，则忽略，调用后可能会触发关闭回调
+    bool closefd(int fd)
+    {
+        return closefd(fd, 0);
+    }
+    // 应用还有尚未写入的回复时(如等待其他线程返回)调用 hold, 对端半关闭后不会因发送队列为空而关闭连接
+    // 每次 hold 需对应一次 release, release 时若已满足半关闭条件则关闭连接并触发 -10 回调
+    void hold(int fd)
+    {
+        auto it = connections.find(fd);
+        if (it != connections.end())
+        {
+            it->second.holds++;
+        }
+    }
+    void release(int fd)
+    {
+        auto it = connections.find(fd);
+        if (it != connections.end() && it->second.holds > 0 && --it->second.holds == 0 && drained(it->second))
+        {
+            closefd(fd, drain_reason(it->second));
+        }
+    }
+    // 发送队列中尚未发送的内存数据字节数(不含文件区间)，fd 无效时为0
+    size_t queued(int fd) const
+    {
+        auto it = connections.find(fd);
+        return it == connections.end() ? 0 : it->second.queued;
+    }
+    // 是否已暂停读取(发送队列超过高水位、超过 output_limit 或调用了 suspend)；on_data 可据此停止处理剩余的请求，
+    // 返回已消费的字节数，未消费的数据在恢复读取时重新回调
+    bool paused(int fd) const
+    {
+        auto it = connections.find(fd);
+        return it != connections.end() && it->second.paused;
+    }
+    // 在 on_data 中调用，预告未消费的数据(从本次返回的消费位置算起)将增长到至少 n 字节，如正在接收的命令中有较大的参数
+    // 输入缓冲区一次分配到此大小，之后收到的数据直接读入，不再随数据到达逐步翻倍扩容并复制已收到的部分；只对本次回调有效
+    void expect(int fd, size_t n)
+    {
+        auto it = connections.find(fd);
+        if (it != connections.end())
+        {
+            it->second.in.expect = n;
+        }
+    }
+    // 停止读取，发送队列中的数据(包括之后写入的)发送完成后关闭连接(0)，队列为空时立即关闭；对端已半关闭时仍按-10关闭
+    // 与 hold 同时使用时等到 release 后才关闭
+    void shutdown(int fd)
+    {
+        auto it = connections.find(fd);
+        if (it == connections.end() || fd == server_sock || it->second.closing)
+        {
+            return;
+        }
+        auto &c = it->second;
+        c.closing = true;
+        update_read(fd, c);
+        if (drained(c))
+        {
+            closefd(fd, drain_reason(c));
+        }
+    }
+    // 应用主动暂停读取，如等待其他线程返回的请求过多时；resume 后与高水位暂停一样重新回调输入缓冲区中的数据
+    void suspend(int fd)
+    {
+        auto it = connections.find(fd);
+        if (it != connections.end() && !it->second.suspended)
+        {
+            it->second.suspended = true;
+            update_read(fd, it->second);
+        }
+    }
+    void resume(int fd)
+    {
+        auto it = connections.find(fd);
+        if (it != connections.end() && it->second.suspended)
+        {
+            it->second.suspended = false;
+            update_read(fd, it->second);
+        }
+    }
+
+    // ms 毫秒后在事件循环线程执行一次 fn, 返回值可用于 clear_timer
+    // 只能在事件循环线程中调用(或 start 之前)，其他线程需通过 post 调用
+    uint64_t set_timeout(int ms, std::function<void(self &)> fn)
+    {
+        return timers.add(loop_time + std::max(ms, 0), 0, std::move(fn));
+    }
+    // 每隔 ms 毫秒执行一次 fn, 直到 clear_timer, 可在 fn 中取消自身
+    uint64_t set_interval(int ms, std::function<void(self &)> fn)
+    {
+        ms = std::max(ms, 1);
+        return timers.add(loop_time + ms, ms, std::move(fn));
+    }
+    // 取消尚未执行的定时器，已执行或已取消时返回 false
+    bool clear_timer(uint64_t id)
+    {
+        return timers.cancel(id);
+    }
+    // 在当前事件处理完毕后执行 fn, 不在调用方的栈上重入，有推迟的任务时事件循环本轮不等待
+    void defer(std::function<void(self &)> fn)
+    {
+        deferred.push_back(std::move(fn));
+    }
+    // 修改单个连接的空闲超时(毫秒)，0 表示不限制，从调用时刻重新计时
+    void set_idle_timeout(int fd, int ms)
+    {
+        auto it = connections.find(fd);
+        if (it == connections.end() || fd == server_sock)
+        {
+            return;
+        }
+        it->second.idle_ms = std::max(ms, 0);
+        it->second.last_active = loop_time;
+        arm_idle(fd, it->second);
+    }
+    // 本轮等待返回、开始处理事件的时刻(单调时钟，毫秒)，回调中可用作当前时间
+    uint64_t now() const
+    {
+        return loop_time;
+    }
+
+    // 事件循环的统计，其他线程读取时不需要加锁，各计数器之间不保证是同一时刻的值
+    const loop_stats &stats() const
+    {
+        return stat;
+    }
+
+    // 当前实际使用的后端，io_uring 不可用时回退为 EPOLL, epoll 不可用时回退为 POLL
+    backend engine() const
+    {
+        return use_uring ? backend::URING : epfd >= 0 ? backend::EPOLL : backend::POLL;
+    }
+
+    bool start(int port, const char *host = "")
+    {
+        // sendfile 不支持 MSG_NOSIGNAL, 对端关闭后发送会产生 SIGPIPE, 应用未设置处理函数时忽略该信号
+        struct sigaction sa;
+        if (sigaction(SIGPIPE, nullptr, &sa) == 0 && sa.sa_handler == SIG_DFL)
+        {
+            signal(SIGPIPE, SIG_IGN);
+        }
+        server_sock = startup(port, opt.backlog, host);
+        spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (server_sock < 1)
+        {
+            return false;
+        }
+        use_uring = opt.engine == backend::URING && init_uring();
+        if (opt.engine == backend::EPOLL || (opt.engine == backend::URING && !use_uring))
+        {
+            epfd = epoll_create1(EPOLL_CLOEXEC);
+        }
+        if (!add_connection(server_sock, POLLIN) || !add_wakeup())
+        {
+            throw std::runtime_error(strerror(errno));
+        }
+
+        std::vector<pollfd> pollfds;
+        std::vector<epoll_event> events(epfd >= 0 ? 1024 : 0);
+        wake();
+        is_running = true;
+        while (is_running)
+        {
+            auto cs = connections.size();
+            auto n = OnLoop(*this, cs);
+            if (n < 1 || cs < 1) // OnLoop返回小于1代表意图停止服务
+            {
+                is_running = false;
+                break;
+            }
+            run_completions();
+            if (!completions.empty() || !deferred.empty())
+            {
+                n = 0; // 还有待执行的回调，本轮不等待
+            }
+            else if (auto t = timers.next_timeout(loop_time); t >= 0 && t < n)
+            {
+                n = t; // 等待时间不超过最近的定时器
+            }
+            stat.busy.record(clock_ns() - wake_ns);
+            int num_fds = use_uring ? wait_uring(n) : epfd >= 0 ? wait_epoll(events, n) : wait_poll(pollfds, n);
+            stat.iterations.add();
+            if (num_fds > 0)
+            {
+                stat.ready.record(num_fds);
+            }
+            // 返回值，正整数：就绪的文件描述符数量，0: 超时，-1: 错误，第三个参数配置的是超时时间(n毫秒)
+            if (num_fds < 0 && errno != EINTR)
+            {
+                throw std::runtime_error(strerror(errno));
+            }
+            run_completions();
+            run_timers();
+        }
+        close(server_sock);
+        if (spare_fd >= 0)
+        {
+            close(spare_fd);
+            spare_fd = -1;
+        }
+        for (const auto &pair : connections)
+        {
+            if (pair.first != server_sock)
+            {
+                close(pair.first);
+            }
+        }
+        connections.clear();
+        if (epfd >= 0)
+        {
+            close(epfd);
+            epfd = -1;
+        }
+        if (use_uring)
+        {
+            ring.exit(); // 销毁 ring 会终止所有未完成的请求，之后才能释放其引用的数据
+            send_orphans.clear();
+            send_list.clear();
+            use_uring = false;
+        }
+        server_sock = -1;
         return true;
     }
 };
@@ -0,0 +1,2860 @@
+#pragma once
+#include "aof.cpp"
+#include "dict.cpp"
+#include "lazyfree.cpp"
+#include "poll.cpp"
+#include "resp.cpp"
+#include "snapshot.cpp"
+#include "stats.cpp"
+#include "value.cpp"
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// 命令名大小写无关的哈希
+constexpr uint32_t command_hash(std::string_view name, uint32_t seed)
+{
+    uint32_t h = 2166136261u ^ seed;
+    for (char c : name)
+    {
+        h = (h ^ (uint8_t)(c >= 'a' && c <= 'z' ? c - 32 : c)) * 16777619u;
+    }
+    return h;
+}
+
+// 编译期为命令表寻找一个没有冲突的哈希种子(完美哈希)，查找时只需一次哈希和一次比较
+template <size_t N>
+struct command_index
+{
+    static_assert(N < 255);
+    static constexpr size_t size = [] {
+        size_t n = 1;
+        while (n < N * 8)
+        {
+            n <<= 1;
+        }
+        return n;
+    }();
+    uint32_t seed = 0;
+    uint8_t slot[size] = {}; // 命令在表中的位置+1, 0 表示空
+
+    template <typename T>
+    static constexpr command_index build(const T (&table)[N])
+    {
+        command_index idx;
+        for (idx.seed = 0;; idx.seed++)
+        {
+            bool ok = true;
+            for (auto &x : idx.slot)
+            {
+                x = 0;
+            }
+            for (size_t i = 0; i < N && ok; i++)
+            {
+                auto &x = idx.slot[command_hash(table[i].name, idx.seed) & (size - 1)];
+                ok = x == 0;
+                x = i + 1;
+            }
+            if (ok)
+            {
+                return idx;
+            }
+        }
+    }
+
+    template <typename T>
+    const T *find(const T (&table)[N], std::string_view name) const
+    {
+        auto i = slot[command_hash(name, seed) & (size - 1)];
+        if (i == 0)
+        {
+            return nullptr;
+        }
+        auto &c = table[i - 1];
+        return c.name.size() == name.size() && strncasecmp(c.name.data(), name.data(), name.size()) == 0 ? &c : nullptr;
+    }
+};
+
+class RedisServer
+{
+    using self = RedisServer;
+
+private:
+    using CommandHandler = void (self::*)(std::string &, const resp_args &);
+
+
+    enum command_flag : uint32_t
+    {
+        CMD_READ = 1,  // 只读取数据
+        CMD_WRITE = 2, // 可能修改数据
+        CMD_BROADCAST = 4, // 多线程模式下在每个分片上执行，回复按 gather 合并
+        CMD_ONE_SHARD = 8, // 多线程模式下所有 key 须在同一分片(如 MSETNX)，否则回复 CROSSSLOT 错误
+        CMD_ARRAY = 16,    // 多key命令按分片拆分后，各分片的数组回复按 key 原来的顺序合并(如 MGET)
+        CMD_CURSOR = 32,   // 多线程模式下转发到游标所属的分片执行(SCAN)
+    };
+
+    struct command
+    {
+        std::string_view name; // 大写
+        CommandHandler handler;
+        int arity;      // 参数个数(包含命令名)，负数表示至少 -arity 个，由分发时统一检查
+        uint32_t flags; // command_flag 的组合
+        int first_key;  // 第一个key所在参数位置，0表示不涉及key
+        int last_key;   // 最后一个key所在参数位置，-1表示直到参数末尾
+        int key_step;   // 相邻key的间隔，如 MSET 为2
+    };
+
+    // 多线程模式下跨分片命令的回复可能乱序到达，pending 保证按命令顺序回复
+    struct client
+    {
+        resp_parser parser;
+        bool closing = false;                           // 协议错误，最后一个回复发送完成后关闭连接
+        uint64_t id = 0;                                // 其他分片返回时，用于识别fd是否已被新连接复用
+        uint64_t head_seq = 0;                          // pending 第一个元素的序号
+        std::deque<std::optional<std::string>> pending; // 等待按顺序发送的回复，nullopt 表示其他分片尚未返回
+    };
+
+    dict<db_value> db; // 存储键值对, 多线程模式下为本线程的分片
+    // 设置了过期时间的key及其过期时刻(unix毫秒)，单独存放，未设置过期时间的key不占用额外内存
+    dict<int64_t> expires;
+    size_t expire_cursor = 0; // 主动过期下次抽查的组
+    // UNLINK 和 FLUSHALL ASYNC 摘下的对象交给 reclaim 在后台释放，所有分片共用；为空时(未通过 serve 启动)直接释放
+    // 释放开销(free_effort)不超过 lazy_free_threshold 的值直接释放，投递和跨线程释放比原地释放更慢
+    lazy_free *reclaim = nullptr;
+    static constexpr size_t lazy_free_threshold = 64;
+    stat_counter expired_keys;
+    // 主动过期每 expire_period 毫秒执行一次，每轮抽查 expire_samples 个key，过期比例超过1/4时继续下一轮
+    // 单次执行不超过 expire_budget，仍有较多过期key时推迟到下一轮事件循环继续，期间照常处理网络事件
+    // 同一定时器也在 expire_budget 内推进 db 和 expires 的渐进式 rehash, 只读负载下迁移也能完成
+    static constexpr int expire_period = 100;
+    static constexpr size_t expire_samples = 20;
+    static constexpr auto expire_budget = std::chrono::microseconds(250);
+    size_t shard_id = 0;
+    std::string snapshot_path = "dump.rdb"; // 分片0的快照文件，其他分片为 snapshot_path.<序号>
+    pid_t save_child = -1;                  // 正在执行 BGSAVE 的子进程
+    int64_t save_child_time = 0;
+    // 开启 AOF 时每个分片一个文件，分片0为 aof_path, 其他分片为 aof_path.<序号>
+    // 修改数据的命令执行后由 propagate 追加记录，本轮事件循环的记录在推迟任务中一次写入
+    std::unique_ptr<aof_log> aof;
+    std::string aof_path = "appendonly.aof";
+    aof_fsync aof_policy = aof_fsync::EVERYSEC;
+    pid_t rewrite_child = -1;                        // 正在执行 BGREWRITEAOF 的子进程
+    std::vector<std::function<void()>> aof_waiters; // 等待本轮记录写入后发送的回复
+    bool loading = false;                            // 重放 AOF 期间不检查过期，也不再追加记录
+    std::unordered_map<int, client> clients;
+    uint64_t next_client_id = 0;
+
+    poll_server server;
+    std::vector<self *> shards{this}; // 所有分片(包含自身)，单线程模式下只有自身
+    // 供其他分片读取 INFO 统计，每轮事件循环更新
+    std::atomic<size_t> key_count{0};
+    std::atomic<size_t> expire_count{0};
+    std::atomic<size_t> client_count{0};
+    std::atomic<bool> saving{false};
+    std::atomic<bool> last_save_ok{true};
+    std::atomic<int64_t> last_save{0}; // 最近一次成功保存的开始时刻(unix秒)
+    std::atomic<bool> aof_rewriting{false};
+    std::atomic<bool> last_rewrite_ok{true};
+    std::atomic<uint64_t> aof_size{0};
+    // 本批命令的回复，on_data 处理完一批命令后一次写出，跨连接复用；超过 reply_flush_size 时提前写出
+    std::string batch;
+    static constexpr size_t reply_flush_size = 64 << 10;
+    // 等待其他分片返回的回复超过 max_pending 时暂停读取该连接，降到一半时恢复；
+    // 这些回复在返回前不计入发送队列，不限制时流水线中的命令会全部转发出去，回复同时堆积在内存中
+    static constexpr size_t max_pending = 64;
+    // 命令(含全部参数)的字节数上限，command_limits 中未单独设置的命令使用 max_command_size
+    // 接收中的命令按 bulk 长度预先检查，超过时回复错误并关闭连接，不等数据全部到达；完整到达的命令超过时回复错误，不执行
+    // 上限最大为 resp_parser::max_command(2GB-1)，更大的配置按此处理
+    size_t max_command_size = 512 << 20;
+    // 解析器的单个参数上限：不小于 resp_parser::max_bulk, 有命令的上限更高时取其中最大的，超过时回复协议错误并关闭连接
+    int64_t bulk_limit = resp_parser::max_bulk;
+    // 接收中的命令等待的 bulk 数据不小于此大小时，预告 poll_server 一次分配好输入缓冲区
+    static constexpr size_t large_bulk = 32 << 10;
+
+    // 命令表见类末尾的 commands, 查找不区分大小写且不分配内存
+    static const command *find_command(std::string_view name)
+    {
+        static constexpr auto index = command_index<std::size(commands)>::build(commands);
+        return index.find(commands, name);
+    }
+
+    // 查找命令并检查参数个数，不合法时错误回复写入 out 并返回 nullptr
+    const command *check_command(std::string &out, const resp_args &args)
+    {
+        if (args.empty())
+        {
+            send_response(out, "-ERR invalid command\r\n");
+            return nullptr;
+        }
+        auto cmd = find_command(args[0]);
+        if (!cmd)
+        {
+            out.append("-ERR unknown command '").append(args[0]).append("'\r\n");
+            return nullptr;
+        }
+        if (!valid_arity(*cmd, args))
+        {
+            out.append("-ERR wrong number of arguments for '").append(cmd->name).append("'\r\n");
+            return nullptr;
+        }
+        return cmd;
+    }
+
+    // 检查参数个数；key 与值成对的命令(如 MSET)还要求参数成对，多线程模式下拆分到各分片前就要检查
+    static bool valid_arity(const command &h, const resp_args &args)
+    {
+        if (h.arity > 0 ? (int)args.size() != h.arity : (int)args.size() < -h.arity)
+        {
+            return false;
+        }
+        return h.last_key >= 0 || h.key_step <= 1 || (args.size() - h.first_key) % h.key_step == 0;
+    }
+
+    // 处理客户端命令，回复写入 batch
+    void process_command(int fd, client &c, const resp_args &args)
+    {
+        auto &out = batch;
+        auto cmd = check_command(out, args);
+        if (!cmd)
+        {
+            return;
+        }
+        auto &h = *cmd;
+        if (c.parser.consumed() > command_limit(h))
+        {
+            send_error(out, "command too large");
+            return;
+        }
+        command_stats[&h - commands].calls.add(); // 在接收命令的分片计一次，之后再转发/拆分/广播
+        if (shards.size() > 1 && (h.flags & CMD_BROADCAST))
+        {
+            broadcast(fd, c, h, args);
+            return;
+        }
+        if (shards.size() > 1 && (h.flags & CMD_CURSOR))
+        {
+            uint64_t cursor = 0;
+            std::from_chars(args[1].data(), args[1].data() + args[1].size(), cursor); // 不合法的游标由本分片回复错误
+            auto owner = shards[cursor % shards.size()];
+            if (owner != this)
+            {
+                forward(fd, c, owner, h, args);
+                return;
+            }
+        }
+        if (shards.size() > 1 && h.first_key > 0 && (int)args.size() > h.first_key)
+        {
+            if (h.last_key == h.first_key)
+            {
+                auto owner = shard_of(args[h.first_key]);
+                if (owner != this)
+                {
+                    forward(fd, c, owner, h, args);
+                    return;
+                }
+            }
+            else if (h.flags & CMD_ONE_SHARD)
+            {
+                auto owner = same_shard(h, args);
+                if (!owner)
+                {
+                    send_response(out, "-CROSSSLOT Keys in request don't hash to the same slot\r\n");
+                    return;
+                }
+                if (owner != this)
+                {
+                    forward(fd, c, owner, h, args);
+                    return;
+                }
+            }
+            else if (scatter(fd, c, h, args))
+            {
+                return;
+            }
+        }
+        execute(h, out, args);
+    }
+
+    size_t command_limit(const command &h) const
+    {
+        auto n = command_limits[&h - commands];
+        return n ? n : max_command_size;
+    }
+
+    // 接收中的命令的上限，args 为已解析完的参数，命令名尚未到达或未知时使用 max_command_size
+    size_t command_limit(const resp_args &args) const
+    {
+        auto h = args.empty() ? nullptr : find_command(args[0]);
+        return h ? command_limit(*h) : max_command_size;
+    }
+
+    // 在本分片执行命令(或拆分后属于本分片的部分)并记录执行次数和耗时，调用次数由接收命令的分片记录
+    // 读取时钟的开销与简单命令本身相当，每个命令每 command_sample 次执行计时一次
+    void execute(const command &h, std::string &out, const resp_args &args)
+    {
+        auto &st = command_stats[&h - commands];
+        if (st.executed.get() % command_sample != 0)
+        {
+            st.executed.add();
+            (this->*(h.handler))(out, args);
+            return;
+        }
+        st.executed.add();
+        auto t = clock_ns();
+        (this->*(h.handler))(out, args);
+        st.time.record(clock_ns() - t);
+    }
+
+    self *shard_of(std::string_view key) const
+    {
+        return shards[std::hash<std::string_view>{}(key) % shards.size()];
+    }
+
+    // 为尚未返回的回复占位，返回其序号；在回复写入前连接不会因对端半关闭而被关闭
+    uint64_t reserve_reply(int fd, client &c)
+    {
+        flush_replies(fd, c); // 之前的回复排在前面
+        c.pending.emplace_back();
+        server.hold(fd);
+        return c.head_seq + c.pending.size() - 1;
+    }
+
+    // 单key命令转发给key所在的分片执行，回复再投递回本线程
+    // 参数引用的是输入缓冲区，需复制一份随消息传递
+    void forward(int fd, client &c, self *owner, const command &h, const resp_args &args)
+    {
+        auto seq = reserve_reply(fd, c);
+        resp_command cmd;
+        for (size_t i = 0; i < args.size(); i++)
+        {
+            cmd.add(args[i]);
+        }
+        owner->server.post([this, owner, h = &h, fd, id = c.id, seq, cmd = std::move(cmd)](poll_server &) mutable
+                           {
+            std::string out;
+            owner->execute(*h, out, cmd.view());
+            owner->after_aof([this, fd, id, seq, out = std::move(out)]() mutable
+                             { server.post([this, fd, id, seq, out = std::move(out)](poll_server &) mutable
+                                           { complete(fd, id, seq, std::move(out)); }); }); });
+    }
+
+    // 多key命令按分片拆分为多个子命令分别执行(如 DEL)
+    // 所有key都在本分片时返回 false, 由调用方直接执行
+    bool scatter(int fd, client &c, const command &h, const resp_args &args)
+    {
+        auto parts = split_keys(h, args);
+        if (parts.size() == 1 && parts.begin()->first == this)
+        {
+            return false;
+        }
+        if (h.flags & CMD_ARRAY)
+        {
+            gather_array(fd, c, h, args, std::move(parts));
+        }
+        else
+        {
+            gather(fd, c, h, std::move(parts));
+        }
+        return true;
+    }
+
+    // 所有 key 所在的分片，不在同一分片时返回 nullptr
+    self *same_shard(const command &h, const resp_args &args) const
+    {
+        int last = h.last_key < 0 ? (int)args.size() - 1 : std::min(h.last_key, (int)args.size() - 1);
+        auto owner = shard_of(args[h.first_key]);
+        for (int i = h.first_key + h.key_step; i <= last; i += h.key_step)
+        {
+            if (shard_of(args[i]) != owner)
+            {
+                return nullptr;
+            }
+        }
+        return owner;
+    }
+
+    // 按 key 所属的分片把多key命令拆分为子命令
+    std::unordered_map<self *, resp_command> split_keys(const command &h, const resp_args &args) const
+    {
+        int last = h.last_key < 0 ? (int)args.size() - 1 : std::min(h.last_key, (int)args.size() - 1);
+        std::unordered_map<self *, resp_command> parts;
+        for (int i = h.first_key; i <= last; i += h.key_step)
+        {
+            auto &part = parts[shard_of(args[i])];
+            if (part.args.empty())
+            {
+                part.add(args[0]);
+            }
+            for (int j = i; j < i + h.key_step && j < (int)args.size(); j++)
+            {
+                part.add(args[j]); // key 及其后的值
+            }
+        }
+        return parts;
+    }
+
+    // 在所有分片上执行同一命令(如 SAVE)，每个分片处理自己的数据
+    void broadcast(int fd, client &c, const command &h, const resp_args &args)
+    {
+        std::unordered_map<self *, resp_command> parts;
+        for (auto s : shards)
+        {
+            auto &part = parts[s];
+            for (size_t i = 0; i < args.size(); i++)
+            {
+                part.add(args[i]);
+            }
+        }
+        gather(fd, c, h, std::move(parts));
+    }
+
+    // 各分片分别执行子命令后合并回复：有错误时回复第一个错误，否则有状态回复时回复第一个状态，否则整数回复求和
+    void gather(int fd, client &c, const command &h, std::unordered_map<self *, resp_command> &&parts)
+    {
+        struct state
+        {
+            size_t remaining;
+            int64_t total = 0;
+            std::optional<std::string> error, status;
+        };
+        auto st = std::make_shared<state>(parts.size());
+        auto seq = reserve_reply(fd, c);
+        auto merge = [this, fd, id = c.id, seq, st](const std::string &out)
+        {
+            if (out[0] == ':')
+            {
+                st->total += std::strtoll(out.c_str() + 1, nullptr, 10);
+            }
+            else if (out[0] == '-')
+            {
+                if (!st->error)
+                {
+                    st->error = out;
+                }
+            }
+            else if (!st->status)
+            {
+                st->status = out;
+            }
+            if (--st->remaining == 0)
+            {
+                std::string total;
+                send_integer(total, st->total);
+                complete(fd, id, seq, st->error ? std::move(*st->error) : st->status ? std::move(*st->status) : std::move(total));
+            }
+        };
+        for (auto &[owner, part] : parts)
+        {
+            owner->server.post([this, owner, h = &h, part = std::move(part), merge](poll_server &) mutable
+                               {
+                std::string out;
+                owner->execute(*h, out, part.view());
+                owner->after_aof([this, out = std::move(out), merge]() mutable
+                                 { server.post([out = std::move(out), merge](poll_server &)
+                                               { merge(out); }); }); });
+        }
+    }
+
+    // 各分片的子命令按 key 的顺序各返回一个数组，按每个 key 在原命令中的位置合并为一个数组；有错误时回复第一个错误
+    // parts 由 split_keys 按参数顺序构造，同一分片的 key 在子命令和原命令中的先后顺序相同
+    void gather_array(int fd, client &c, const command &h, const resp_args &args, std::unordered_map<self *, resp_command> &&parts)
+    {
+        struct state
+        {
+            size_t remaining;
+            std::vector<std::string> items;
+            std::optional<std::string> error;
+        };
+        int last = h.last_key < 0 ? (int)args.size() - 1 : std::min(h.last_key, (int)args.size() - 1);
+        std::unordered_map<self *, std::vector<size_t>> positions;
+        for (int i = h.first_key, k = 0; i <= last; i += h.key_step, k++)
+        {
+            positions[shard_of(args[i])].push_back(k);
+        }
+        auto st = std::make_shared<state>(parts.size());
+        st->items.resize((last - h.first_key) / h.key_step + 1);
+        auto seq = reserve_reply(fd, c);
+        for (auto &[owner, part] : parts)
+        {
+            auto merge = [this, fd, id = c.id, seq, st, pos = std::move(positions[owner])](const std::string &out)
+            {
+                auto items = split_array(out);
+                if (items.size() != pos.size())
+                {
+                    if (!st->error)
+                    {
+                        st->error = out[0] == '-' ? out : "-ERR unexpected reply from shard\r\n";
+                    }
+                }
+                else
+                {
+                    for (size_t i = 0; i < pos.size(); i++)
+                    {
+                        st->items[pos[i]] = items[i];
+                    }
+                }
+                if (--st->remaining == 0)
+                {
+                    std::string total;
+                    if (!st->error)
+                    {
+                        send_array(total, st->items.size());
+                        for (auto &item : st->items)
+                        {
+                            total.append(item);
+                        }
+                    }
+                    complete(fd, id, seq, st->error ? std::move(*st->error) : std::move(total));
+                }
+            };
+            owner->server.post([this, owner, h = &h, part = std::move(part), merge = std::move(merge)](poll_server &) mutable
+                               {
+                std::string out;
+                owner->execute(*h, out, part.view());
+                owner->after_aof([this, out = std::move(out), merge = std::move(merge)]() mutable
+                                 { server.post([out = std::move(out), merge = std::move(merge)](poll_server &)
+                                               { merge(out); }); }); });
+        }
+    }
+
+    // 把元素均为 bulk string 或 nil 的数组回复拆分为各元素的完整回复，格式不符时返回空
+    static std::vector<std::string_view> split_array(std::string_view out)
+    {
+        std::vector<std::string_view> items;
+        size_t n, pos = out.find("\r\n");
+        if (out.empty() || out[0] != '*' || pos == std::string_view::npos ||
+            std::from_chars(out.data() + 1, out.data() + pos, n).ptr != out.data() + pos)
+        {
+            return items;
+        }
+        pos += 2;
+        for (size_t i = 0; i < n; i++)
+        {
+            auto eol = out.find("\r\n", pos);
+            int64_t len;
+            if (eol == std::string_view::npos || out[pos] != '$' ||
+                std::from_chars(out.data() + pos + 1, out.data() + eol, len).ptr != out.data() + eol)
+            {
+                return {};
+            }
+            size_t end = len < 0 ? eol + 2 : eol + 2 + len + 2;
+            if (end > out.size())
+            {
+                return {};
+            }
+            items.push_back(out.substr(pos, end - pos));
+            pos = end;
+        }
+        return items;
+    }
+
+    // 其他分片返回的回复，按序号填入并发送已就绪的部分
+    void complete(int fd, uint64_t id, uint64_t seq, std::string &&out)
+    {
+        auto it = clients.find(fd);
+        if (it == clients.end() || it->second.id != id)
+        {
+            return; // 连接已关闭
+        }
+        auto &c = it->second;
+        c.pending[seq - c.head_seq] = std::move(out);
+        while (!c.pending.empty() && c.pending.front())
+        {
+            write_reply(fd, c, *c.pending.front(), c.pending.size() == 1);
+            c.pending.pop_front();
+            c.head_seq++;
+        }
+        if (c.pending.size() <= max_pending / 2)
+        {
+            server.resume(fd);
+        }
+        server.release(fd); // 可能触发关闭回调，之后不能再访问 c
+    }
+
+    // 协议错误后的最后一个回复发送完成后关闭连接
+    // 数据能直接发送完成时 poll_server 不复制，否则复制后入队
+    void write_reply(int fd, const client &c, std::string_view out, bool last)
+    {
+        if (c.closing && last)
+        {
+            server.write(fd, out.data(), out.size(), [](poll_server &s, int fd, int)
+                         { s.closefd(fd); });
+        }
+        else
+        {
+            server.write(fd, out.data(), out.size());
+        }
+    }
+
+    // 把本批命令的回复一次写出，有等待其他分片返回的回复时按顺序排在其后
+    // 本轮有尚未写入 AOF 的记录时，回复在记录写入后发送
+    void flush_replies(int fd, client &c)
+    {
+        if (batch.empty())
+        {
+            return;
+        }
+        if (aof && aof->pending())
+        {
+            c.pending.emplace_back();
+            server.hold(fd);
+            after_aof([this, fd, id = c.id, seq = c.head_seq + c.pending.size() - 1, out = std::move(batch)]() mutable
+                      { complete(fd, id, seq, std::move(out)); });
+        }
+        else if (c.pending.empty())
+        {
+            write_reply(fd, c, batch, true);
+        }
+        else
+        {
+            c.pending.emplace_back(batch);
+        }
+        batch.clear();
+    }
+
+    // 处理 GET 命令
+    void handle_get(std::string &out, const resp_args &args)
+    {
+        auto v = lookup(args[1]);
+        if (!check_type(out, v, value_type::STRING))
+        {
+            return;
+        }
+        if (v)
+        {
+            char buf[24];
+            send_bulk(out, v->view(buf));
+        }
+        else
+        {
+            send_response(out, "$-1\r\n");
+        }
+    }
+
+    // 处理 SET 命令，支持 EX/PX/NX/XX/KEEPTTL 选项，未指定过期时间且没有 KEEPTTL 时清除原有的过期时间
+    void handle_set(std::string &out, const resp_args &args)
+    {
+        int64_t when = 0; // 过期时刻，0 表示不过期
+        bool nx = false, xx = false, keep = false;
+        for (size_t i = 3; i < args.size(); i++)
+        {
+            auto opt = args[i];
+            if ((iequals(opt, "EX") || iequals(opt, "PX")) && i + 1 < args.size() && when == 0 && !keep)
+            {
+                auto v = parse_int(args[++i]);
+                auto t = v && *v > 0 ? expire_at(*v, opt[0] == 'P' || opt[0] == 'p' ? 1 : 1000) : std::nullopt;
+                if (!t)
+                {
+                    send_error(out, "invalid expire time in 'set' command");
+                    return;
+                }
+                when = *t;
+            }
+            else if (iequals(opt, "NX") && !xx)
+            {
+                nx = true;
+            }
+            else if (iequals(opt, "XX") && !nx)
+            {
+                xx = true;
+            }
+            else if (iequals(opt, "KEEPTTL") && when == 0)
+            {
+                keep = true;
+            }
+            else
+            {
+                send_error(out, "syntax error");
+                return;
+            }
+        }
+        if ((nx || xx) && (lookup(args[1]) != nullptr) == nx)
+        {
+            send_response(out, "$-1\r\n");
+            return;
+        }
+        set_value(args[1], args[2]);
+        if (when > 0)
+        {
+            set_expire(args[1], when);
+        }
+        else if (!keep && !expires.empty())
+        {
+            expires.erase(args[1]);
+        }
+        // 相对过期时间改写为过期时刻，重放时不受重启时间影响
+        if (keep)
+        {
+            propagate({"SET", args[1], args[2], "KEEPTTL"});
+        }
+        else
+        {
+            propagate({"SET", args[1], args[2]});
+        }
+        if (when > 0)
+        {
+            char buf[24];
+            propagate({"PEXPIREAT", args[1], std::string_view(buf, std::to_chars(buf, buf + sizeof(buf), when).ptr - buf)});
+        }
+        send_response(out, "+OK\r\n");
+    }
+
+    // 处理 SETNX 命令
+    void handle_setnx(std::string &out, const resp_args &args)
+    {
+        if (!lookup(args[1]))
+        {
+            db.insert(args[1]).first->assign(args[2]);
+            propagate(args);
+            send_response(out, ":1\r\n");
+        }
+        else
+        {
+            send_response(out, ":0\r\n");
+        }
+    }
+
+    // 处理 DEL 命令
+    void handle_del(std::string &out, const resp_args &args)
+    {
+        size_t total_deleted = 0;
+        // 从索引1开始处理所有的键（跳过命令名称）
+        for (size_t i = 1; i < args.size(); i++)
+        {
+            if (lookup(args[i]))
+            {
+                remove_key(args[i]);
+                total_deleted++;
+            }
+        }
+        if (total_deleted > 0)
+        {
+            propagate(args);
+        }
+        send_integer(out, total_deleted);
+    }
+
+    // 处理 UNLINK 命令，与 DEL 相同，但较大的集合只从键空间摘下，由后台线程释放，回复不等待释放
+    void handle_unlink(std::string &out, const resp_args &args)
+    {
+        size_t total_deleted = 0;
+        for (size_t i = 1; i < args.size(); i++)
+        {
+            auto v = lookup(args[i]);
+            if (!v)
+            {
+                continue;
+            }
+            if (reclaim && v->free_effort() > lazy_free_threshold)
+            {
+                reclaim->release(new db_value(std::move(*v))); // 留下空字符串，随后删除时不再有释放开销
+            }
+            remove_key(args[i]);
+            total_deleted++;
+        }
+        if (total_deleted > 0)
+        {
+            propagate(args);
+        }
+        send_integer(out, total_deleted);
+    }
+
+    // 处理 MGET 命令，不存在或不是字符串的 key 回复 nil
+    void handle_mget(std::string &out, const resp_args &args)
+    {
+        send_array(out, args.size() - 1);
+        char buf[24];
+        for_keys(args, 1, 1, [&](size_t i, uint64_t h)
+                 {
+            auto v = lookup(args[i], h);
+            if (v && v->type() == value_type::STRING)
+            {
+                send_bulk(out, v->view(buf));
+            }
+            else
+            {
+                send_response(out, "$-1\r\n");
+            } });
+    }
+
+    // 处理 MSET 命令，与逐个 SET 相同：覆盖任意类型的原值并清除过期时间
+    void handle_mset(std::string &out, const resp_args &args)
+    {
+        set_pairs(args);
+        propagate(args);
+        send_response(out, "+OK\r\n");
+    }
+
+    // 处理 MSETNX 命令，所有 key 都不存在时才全部设置；多线程模式下要求所有 key 在同一分片(CMD_ONE_SHARD)
+    void handle_msetnx(std::string &out, const resp_args &args)
+    {
+        bool exists = false;
+        for_keys(args, 1, 2, [&](size_t i, uint64_t h)
+                 { exists = exists || lookup(args[i], h); });
+        if (exists)
+        {
+            send_response(out, ":0\r\n");
+            return;
+        }
+        set_pairs(args);
+        propagate(args);
+        send_response(out, ":1\r\n");
+    }
+
+    // MSET/MSETNX 设置 args 中的所有 key-value 对
+    void set_pairs(const resp_args &args)
+    {
+        for_keys(args, 1, 2, [&](size_t i, uint64_t h)
+                 {
+            db.insert(args[i], h).first->assign(args[i + 1]);
+            if (!expires.empty())
+            {
+                expires.erase(args[i]);
+            } });
+    }
+
+    // 批量操作的预取距离，见 dict::prefetch
+    static constexpr size_t prefetch_distance = 4;
+
+    // 对 args 中从 first 开始每隔 step 个的 key 依次调用 fn(i, h)，i 为 key 的位置，h 为其哈希值
+    // 处理当前 key 时预取后面第 prefetch_distance * 2 个 key 的控制字节和第 prefetch_distance 个 key 的槽位，
+    // key 较多且 db 远大于缓存时，各 key 的缓存缺失重叠等待而不是依次等待
+    template <typename F>
+    void for_keys(const resp_args &args, size_t first, size_t step, F &&fn)
+    {
+        constexpr size_t ring = prefetch_distance * 2;
+        uint64_t hashes[ring];
+        size_t n = (args.size() - first + step - 1) / step;
+        auto prefetch = [&](size_t j)
+        {
+            if (j < n)
+            {
+                auto h = hashes[j % ring] = db.key_hash(args[first + j * step]);
+                db.prefetch(h);
+                if (!expires.empty())
+                {
+                    expires.prefetch(h);
+                }
+            }
+        };
+        auto prefetch_slots = [&](size_t j)
+        {
+            if (j < n)
+            {
+                db.prefetch_slots(hashes[j % ring]);
+            }
+        };
+        for (size_t j = 0; j < ring; j++)
+        {
+            prefetch(j);
+        }
+        for (size_t j = 0; j < prefetch_distance; j++)
+        {
+            prefetch_slots(j);
+        }
+        for (size_t j = 0; j < n; j++)
+        {
+            auto h = hashes[j % ring];
+            prefetch(j + ring); // 与 j 使用同一位置，先取出 h
+            prefetch_slots(j + prefetch_distance);
+            fn(first + j * step, h);
+        }
+    }
+
+    // 处理 SCAN 命令，支持 MATCH/COUNT/TYPE 选项
+    // 每次调用遍历到至少 COUNT 个 key 或 COUNT * 10 个组为止，不会因 key 多而长时间阻塞事件循环；返回的 key 数可能少于或多于 COUNT
+    // 遍历期间一直存在的 key 至少返回一次(见 dict::scan)，可能重复；期间新增或删除的 key 可能返回也可能不返回
+    // 多线程模式下游标为 分片内游标 * 分片数 + 分片序号，由分发时转发到所属的分片(CMD_CURSOR)，一个分片遍历完后从下一个分片的0开始
+    void handle_scan(std::string &out, const resp_args &args)
+    {
+        uint64_t cursor;
+        auto [end, ec] = std::from_chars(args[1].data(), args[1].data() + args[1].size(), cursor);
+        if (ec != std::errc() || end != args[1].data() + args[1].size())
+        {
+            send_error(out, "invalid cursor");
+            return;
+        }
+        std::string_view pattern;
+        size_t count = 10;
+        std::optional<value_type> type;
+        for (size_t i = 2; i < args.size(); i += 2)
+        {
+            auto opt = args[i];
+            if (i + 1 >= args.size())
+            {
+                send_error(out, "syntax error");
+                return;
+            }
+            if (iequals(opt, "MATCH"))
+            {
+                pattern = args[i + 1] == "*" ? "" : args[i + 1];
+            }
+            else if (iequals(opt, "COUNT"))
+            {
+                auto v = parse_int(args[i + 1]);
+                if (!v || *v < 1)
+                {
+                    send_error(out, "syntax error");
+                    return;
+                }
+                count = *v;
+            }
+            else if (iequals(opt, "TYPE"))
+            {
+                type = parse_type(args[i + 1]);
+                if (!type)
+                {
+                    send_error(out, "unknown type name");
+                    return;
+                }
+            }
+            else
+            {
+                send_error(out, "syntax error");
+                return;
+            }
+        }
+        size_t n = shards.size();
+        size_t local = cursor / n, scanned = 0, groups = 0;
+        std::vector<std::string> keys;
+        do
+        {
+            local = db.scan(local, [&](std::string_view key, db_value &v)
+                            {
+                scanned++;
+                if ((!type || v.type() == *type) && (pattern.empty() || glob_match(pattern, key)))
+                {
+                    keys.emplace_back(key);
+                } });
+        } while (local != 0 && scanned < count && ++groups < count * 10);
+        uint64_t next = local != 0 ? local * n + shard_id : shard_id + 1 < n ? shard_id + 1 : 0;
+        // 遍历时不能修改 db, 过期的 key 在遍历后删除
+        std::erase_if(keys, [&](const std::string &key)
+                      { return !lookup(key); });
+        char buf[24];
+        send_array(out, 2);
+        send_bulk(out, std::string_view(buf, std::to_chars(buf, buf + sizeof(buf), next).ptr - buf));
+        send_array(out, keys.size());
+        for (auto &key : keys)
+        {
+            send_bulk(out, key);
+        }
+    }
+
+    // 处理 INCR 命令
+    void handle_incr(std::string &out, const resp_args &args)
+    {
+        process_incrby(out, args, 1);
+    }
+
+    // 处理 INCRBY 命令
+    void handle_incrby(std::string &out, const resp_args &args)
+    {
+        auto increment = parse_int(args[2]);
+        if (!increment)
+        {
+            send_error(out, "invalid increment value");
+            return;
+        }
+        process_incrby(out, args, *increment);
+    }
+
+    // 处理 INCRBY 核心逻辑，整数编码的值只需一次查找和一次加法，字符串值解析后改为整数编码
+    void process_incrby(std::string &out, const resp_args &args, int64_t increment)
+    {
+        auto key = args[1];
+        auto v = lookup(key);
+        int64_t value = 0;
+        if (!check_type(out, v, value_type::STRING))
+        {
+            return;
+        }
+        if (v)
+        {
+            auto n = v->as_int();
+            if (!n)
+            {
+                send_error(out, "value is not an integer or out of range");
+                return;
+            }
+            value = *n;
+        }
+        if (__builtin_add_overflow(value, increment, &value))
+        {
+            send_error(out, "increment would overflow");
+            return;
+        }
+        (v ? v : db.insert(key).first)->set_int(value);
+        propagate(args);
+        send_integer(out, value);
+    }
+
+    // 处理 EXPIRE 命令
+    void handle_expire(std::string &out, const resp_args &args)
+    {
+        process_expire(out, args, 1000, false);
+    }
+
+    // 处理 PEXPIRE 命令
+    void handle_pexpire(std::string &out, const resp_args &args)
+    {
+        process_expire(out, args, 1, false);
+    }
+
+    // 处理 EXPIREAT 命令
+    void handle_expireat(std::string &out, const resp_args &args)
+    {
+        process_expire(out, args, 1000, true);
+    }
+
+    // 处理 PEXPIREAT 命令
+    void handle_pexpireat(std::string &out, const resp_args &args)
+    {
+        process_expire(out, args, 1, true);
+    }
+
+    // 设置过期时间，unit 为时间参数的单位(毫秒)，absolute 为 true 时参数为unix时间戳
+    // 相对时间不为正数或过期时刻已过时立即删除；重放 AOF 时只设置过期时刻，加载完成后再按过期处理，后续记录看到的数据与写入时一致
+    // AOF 中统一记录为 PEXPIREAT 或 DEL
+    void process_expire(std::string &out, const resp_args &args, int64_t unit, bool absolute)
+    {
+        auto v = parse_int(args[2]);
+        if (!v)
+        {
+            send_error(out, "value is not an integer or out of range");
+            return;
+        }
+        int64_t ms;
+        auto when = !absolute ? expire_at(*v, unit) : __builtin_mul_overflow(*v, unit, &ms) ? std::nullopt : std::optional<int64_t>(ms);
+        if (!when)
+        {
+            out.append("-ERR invalid expire time in '").append(args[0]).append("' command\r\n");
+            return;
+        }
+        if (!lookup(args[1]))
+        {
+            send_response(out, ":0\r\n");
+            return;
+        }
+        if (!loading && (absolute ? *when <= mstime() : *v <= 0))
+        {
+            remove_key(args[1]);
+            propagate({"DEL", args[1]});
+        }
+        else
+        {
+            set_expire(args[1], *when);
+            char buf[24];
+            propagate({"PEXPIREAT", args[1], std::string_view(buf, std::to_chars(buf, buf + sizeof(buf), *when).ptr - buf)});
+        }
+        send_response(out, ":1\r\n");
+    }
+
+    // 处理 TTL 命令
+    void handle_ttl(std::string &out, const resp_args &args)
+    {
+        process_ttl(out, args[1], 1000);
+    }
+
+    // 处理 PTTL 命令
+    void handle_pttl(std::string &out, const resp_args &args)
+    {
+        process_ttl(out, args[1], 1);
+    }
+
+    // 剩余时间，key 不存在时为-2，没有过期时间时为-1
+    void process_ttl(std::string &out, std::string_view key, int64_t unit)
+    {
+        if (!lookup(key))
+        {
+            send_integer(out, -2);
+            return;
+        }
+        auto when = expires.find(key);
+        if (!when)
+        {
+            send_integer(out, -1);
+            return;
+        }
+        auto left = std::max<int64_t>(*when - mstime(), 0);
+        send_integer(out, (left + unit / 2) / unit);
+    }
+
+    // 处理 PERSIST 命令
+    void handle_persist(std::string &out, const resp_args &args)
+    {
+        if (!lookup(args[1]) || expires.empty())
+        {
+            send_response(out, ":0\r\n");
+            return;
+        }
+        auto n = expires.erase(args[1]);
+        if (n)
+        {
+            propagate(args);
+        }
+        send_integer(out, n);
+    }
+
+    // 处理 HSET 命令，返回新增的字段数
+    void handle_hset(std::string &out, const resp_args &args)
+    {
+        if (args.size() % 2 != 0)
+        {
+            out.append("-ERR wrong number of arguments for '").append(args[0]).append("'\r\n");
+            return;
+        }
+        auto v = lookup_write(out, args[1], value_type::HASH);
+        if (!v)
+        {
+            return;
+        }
+        size_t added = 0;
+        for (size_t i = 2; i < args.size(); i += 2)
+        {
+            added += v->hash_set(args[i], args[i + 1]);
+        }
+        propagate(args);
+        send_integer(out, added);
+    }
+
+    // 处理 HGET 命令
+    void handle_hget(std::string &out, const resp_args &args)
+    {
+        auto v = lookup(args[1]);
+        if (!check_type(out, v, value_type::HASH))
+        {
+            return;
+        }
+        auto field = v ? v->hash_get(args[2]) : std::nullopt;
+        if (field)
+        {
+            send_bulk(out, *field);
+        }
+        else
+        {
+            send_response(out, "$-1\r\n");
+        }
+    }
+
+    // 处理 HDEL 命令，删除最后一个字段时删除 key
+    void handle_hdel(std::string &out, const resp_args &args)
+    {
+        auto v = lookup(args[1]);
+        if (!check_type(out, v, value_type::HASH))
+        {
+            return;
+        }
+        size_t deleted = 0;
+        for (size_t i = 2; v && i < args.size(); i++)
+        {
+            deleted += v->hash_del(args[i]);
+        }
+        if (deleted > 0)
+        {
+            if (v->length() == 0)
+            {
+                remove_key(args[1]);
+            }
+            propagate(args);
+        }
+        send_integer(out, deleted);
+    }
+
+    // 处理 HGETALL 命令，字段和值交替返回
+    void handle_hgetall(std::string &out, const resp_args &args)
+    {
+        auto v = lookup(args[1]);
+        if (!check_type(out, v, value_type::HASH))
+        {
+            return;
+        }
+        if (!v)
+        {
+            send_response(out, "*0\r\n");
+            return;
+        }
+        send_array(out, v->length() * 2);
+        v->hash_for_each([&](std::string_view field, std::string_view value)
+                         {
+            send_bulk(out, field);
+            send_bulk(out, value); });
+    }
+
+    // 处理 LPUSH 命令
+    void handle_lpush(std::string &out, const resp_args &args)
+    {
+        process_push(out, args, true);
+    }
+
+    // 处理 RPUSH 命令
+    void handle_rpush(std::string &out, const resp_args &args)
+    {
+        process_push(out, args, false);
+    }
+
+    // 依次插入各元素，LPUSH a b c 之后列表为 c b a，返回插入后的长度
+    void process_push(std::string &out, const resp_args &args, bool front)
+    {
+        auto v = lookup_write(out, args[1], value_type::LIST);
+        if (!v)
+        {
+            return;
+        }
+        for (size_t i = 2; i < args.size(); i++)
+        {
+            v->list_push(args[i], front);
+        }
+        propagate(args);
+        send_integer(out, v->length());
+    }
+
+    // 处理 LPOP 命令，带 count 时返回最多 count 个元素的数组，删除最后一个元素时删除 key
+    void handle_lpop(std::string &out, const resp_args &args)
+    {
+        std::optional<int64_t> count;
+        if (args.size() > 3)
+        {
+            send_error(out, "syntax error");
+            return;
+        }
+        if (args.size() == 3 && (!(count = parse_int(args[2])) || *count < 0))
+        {
+            send_error(out, "value is out of range, must be positive");
+            return;
+        }
+        auto v = lookup(args[1]);
+        if (!check_type(out, v, value_type::LIST))
+        {
+            return;
+        }
+        if (!v)
+        {
+            send_response(out, count ? "*-1\r\n" : "$-1\r\n");
+            return;
+        }
+        size_t n = count ? std::min<size_t>(*count, v->length()) : 1;
+        if (count)
+        {
+            send_array(out, n);
+        }
+        for (size_t i = 0; i < n; i++)
+        {
+            v->list_pop_front([&](std::string_view e)
+                              { send_bulk(out, e); });
+        }
+        if (n > 0)
+        {
+            if (v->length() == 0)
+            {
+                remove_key(args[1]);
+            }
+            propagate(args);
+        }
+    }
+
+    // 处理 LRANGE 命令，start 和 stop 为负数时从末尾计算
+    void handle_lrange(std::string &out, const resp_args &args)
+    {
+        auto start = parse_int(args[2]), stop = parse_int(args[3]);
+        if (!start || !stop)
+        {
+            send_error(out, "value is not an integer or out of range");
+            return;
+        }
+        auto v = lookup(args[1]);
+        if (!check_type(out, v, value_type::LIST))
+        {
+            return;
+        }
+        auto [first, n] = normalize_range(*start, *stop, v ? v->length() : 0);
+        send_array(out, n);
+        if (n > 0)
+        {
+            v->list_range(first, n, [&](std::string_view e)
+                          { send_bulk(out, e); });
+        }
+    }
+
+    // 处理 ZADD 命令，参数为 score member 对，返回新增的成员数；任一分值不合法时不做修改
+    void handle_zadd(std::string &out, const resp_args &args)
+    {
+        if (args.size() % 2 != 0)
+        {
+            send_error(out, "syntax error");
+            return;
+        }
+        for (size_t i = 2; i < args.size(); i += 2)
+        {
+            if (!parse_score(args[i]))
+            {
+                send_error(out, "value is not a valid float");
+                return;
+            }
+        }
+        auto v = lookup_write(out, args[1], value_type::ZSET);
+        if (!v)
+        {
+            return;
+        }
+        size_t added = 0;
+        for (size_t i = 2; i < args.size(); i += 2)
+        {
+            added += v->zset_add(args[i + 1], *parse_score(args[i]));
+        }
+        propagate(args);
+        send_integer(out, added);
+    }
+
+    // 处理 ZRANGE 命令，按分值从小到大返回排名在 [start, stop] 的成员，支持 WITHSCORES
+    void handle_zrange(std::string &out, const resp_args &args)
+    {
+        bool scores = args.size() == 5 && iequals(args[4], "WITHSCORES");
+        if (args.size() > 5 || (args.size() == 5 && !scores))
+        {
+            send_error(out, "syntax error");
+            return;
+        }
+        auto start = parse_int(args[2]), stop = parse_int(args[3]);
+        if (!start || !stop)
+        {
+            send_error(out, "value is not an integer or out of range");
+            return;
+        }
+        auto v = lookup(args[1]);
+        if (!check_type(out, v, value_type::ZSET))
+        {
+            return;
+        }
+        auto [first, n] = normalize_range(*start, *stop, v ? v->length() : 0);
+        send_array(out, scores ? n * 2 : n);
+        if (n > 0)
+        {
+            v->zset_range(first, n, [&](std::string_view member, double score)
+                          {
+                send_bulk(out, member);
+                if (scores)
+                {
+                    send_score(out, score);
+                } });
+        }
+    }
+
+    // 处理 ZSCORE 命令
+    void handle_zscore(std::string &out, const resp_args &args)
+    {
+        auto v = lookup(args[1]);
+        if (!check_type(out, v, value_type::ZSET))
+        {
+            return;
+        }
+        auto score = v ? v->zset_score(args[2]) : std::nullopt;
+        if (score)
+        {
+            send_score(out, *score);
+        }
+        else
+        {
+            send_response(out, "$-1\r\n");
+        }
+    }
+
+    // 处理 FLUSHDB/FLUSHALL [ASYNC|SYNC] 命令，只有一个 db, 两者相同；多线程模式下每个分片清空自己的分片
+    // 默认与 Redis 相同为 SYNC, 在事件循环中释放；ASYNC 把整个 db 和 expires 换成空表，旧表交给后台线程释放
+    void handle_flushall(std::string &out, const resp_args &args)
+    {
+        bool async = false;
+        if (args.size() == 2 && iequals(args[1], "ASYNC"))
+        {
+            async = true;
+        }
+        else if (args.size() > 2 || (args.size() == 2 && !iequals(args[1], "SYNC")))
+        {
+            send_error(out, "syntax error");
+            return;
+        }
+        auto old_db = std::make_unique<dict<db_value>>();
+        auto old_expires = std::make_unique<dict<int64_t>>();
+        old_db->swap(db);
+        old_expires->swap(expires);
+        expire_cursor = 0;
+        if (async && reclaim)
+        {
+            reclaim->release(old_db.release());
+            reclaim->release(old_expires.release());
+        }
+        propagate(args);
+        send_response(out, "+OK\r\n");
+    }
+
+    // 分片数变化后重放 AOF 时，原分片 file(共 files 个)中的 FLUSHALL 只清除原属于该分片的 key, 这些 key 现在分散在各分片中
+    void remove_origin(size_t file, size_t files)
+    {
+        std::vector<std::string> keys;
+        db.for_each([&](std::string_view key, db_value &)
+                    {
+            if (std::hash<std::string_view>{}(key) % files == file)
+            {
+                keys.emplace_back(key);
+            } });
+        for (auto &key : keys)
+        {
+            remove_key(key);
+        }
+    }
+
+    // 处理 SAVE 命令，在当前线程中保存，多线程模式下每个分片保存自己的文件
+    void handle_save(std::string &out, const resp_args &args)
+    {
+        if (save_child > 0)
+        {
+            send_error(out, "Background save already in progress");
+            return;
+        }
+        auto time = mstime();
+        try
+        {
+            save_snapshot(time);
+        }
+        catch (const std::exception &e)
+        {
+            last_save_ok = false;
+            send_error(out, e.what());
+            return;
+        }
+        last_save_ok = true;
+        last_save = time / 1000;
+        send_response(out, "+OK\r\n");
+    }
+
+    // 处理 BGSAVE 命令，fork 后由子进程写入快照，写时复制使子进程看到的是 fork 时刻的数据，事件循环不等待
+    // 多线程模式下每个分片在自己的线程中 fork, 子进程只访问该分片的数据，其他线程的数据可能处于修改中途
+    void handle_bgsave(std::string &out, const resp_args &args)
+    {
+        if (save_child > 0)
+        {
+            send_error(out, "Background save already in progress");
+            return;
+        }
+        if (rewrite_child > 0)
+        {
+            send_error(out, "Background append only file rewriting already in progress");
+            return;
+        }
+        auto time = mstime();
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            // 不持有连接和监听socket, 父进程关闭连接时对端能立即收到
+#ifdef SYS_close_range
+            syscall(SYS_close_range, 3, ~0u, 0);
+#endif
+            int code = 0;
+            try
+            {
+                save_snapshot(time);
+            }
+            catch (...)
+            {
+                code = 1;
+            }
+            _exit(code);
+        }
+        if (pid < 0)
+        {
+            send_error(out, strerror(errno));
+            return;
+        }
+        save_child = pid;
+        save_child_time = time;
+        saving = true;
+        send_response(out, "+Background saving started\r\n");
+    }
+
+    // 由定时器检查 BGSAVE 和 BGREWRITEAOF 子进程是否结束，AOF 超过上次重写后的2倍时自动重写
+    void check_children()
+    {
+        int status;
+        if (save_child > 0 && waitpid(save_child, &status, WNOHANG) == save_child)
+        {
+            bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+            last_save_ok = ok;
+            if (ok)
+            {
+                last_save = save_child_time / 1000;
+            }
+            save_child = -1;
+            saving = false;
+        }
+        if (rewrite_child > 0 && waitpid(rewrite_child, &status, WNOHANG) == rewrite_child)
+        {
+            auto tmp = aof_file(aof_path, shard_id) + ".rewrite";
+            bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+            if (ok)
+            {
+                try
+                {
+                    aof->finish_rewrite(tmp);
+                }
+                catch (const std::exception &)
+                {
+                    ok = false;
+                }
+            }
+            if (!ok)
+            {
+                aof->abort_rewrite();
+                unlink(tmp.c_str());
+            }
+            last_rewrite_ok = ok;
+            rewrite_child = -1;
+            aof_rewriting = false;
+        }
+        if (aof && save_child < 0 && rewrite_child < 0 && aof->should_rewrite())
+        {
+            start_rewrite();
+        }
+    }
+
+    // 处理 BGREWRITEAOF 命令，子进程按 fork 时刻的数据写出新文件，期间的写命令同时记入原文件和重写缓冲区
+    void handle_bgrewriteaof(std::string &out, const resp_args &args)
+    {
+        if (!aof)
+        {
+            send_error(out, "Append only file is disabled");
+            return;
+        }
+        if (rewrite_child > 0)
+        {
+            send_error(out, "Background append only file rewriting already in progress");
+            return;
+        }
+        if (save_child > 0)
+        {
+            send_error(out, "Background save already in progress");
+            return;
+        }
+        if (!start_rewrite())
+        {
+            send_error(out, strerror(errno));
+            return;
+        }
+        send_response(out, "+Background append only file rewriting started\r\n");
+    }
+
+    bool start_rewrite()
+    {
+        aof->begin_rewrite(); // 子进程的数据已包含本轮的记录，先写入原文件，不再进入重写缓冲区
+        auto tmp = aof_file(aof_path, shard_id) + ".rewrite";
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+#ifdef SYS_close_range
+            syscall(SYS_close_range, 3, ~0u, 0);
+#endif
+            int code = 0;
+            try
+            {
+                write_aof(tmp);
+            }
+            catch (...)
+            {
+                code = 1;
+            }
+            _exit(code);
+        }
+        if (pid < 0)
+        {
+            aof->abort_rewrite();
+            return false;
+        }
+        rewrite_child = pid;
+        aof_rewriting = true;
+        return true;
+    }
+
+    static std::string aof_file(const std::string &path, size_t shard)
+    {
+        return shard == 0 ? path : path + "." + std::to_string(shard);
+    }
+
+    // 把本分片的数据写为完整的 AOF 文件，已过期的key不写入
+    void write_aof(const std::string &path)
+    {
+        aof_writer w(path, shard_id, shards.size());
+        auto now = mstime();
+        db.for_each([&](std::string_view key, db_value &v)
+                    {
+            int64_t when = 0;
+            if (!expires.empty())
+            {
+                if (auto e = expires.find(key))
+                {
+                    if (*e <= now)
+                    {
+                        return;
+                    }
+                    when = *e;
+                }
+            }
+            char buf[24];
+            if (v.type() == value_type::STRING)
+            {
+                w.add({"SET", key, v.view(buf)});
+            }
+            else
+            {
+                write_collection(w, key, v);
+            }
+            if (when)
+            {
+                w.add({"PEXPIREAT", key, std::string_view(buf, std::to_chars(buf, buf + sizeof(buf), when).ptr - buf)});
+            } });
+        w.finish();
+    }
+
+    // 集合写为 HSET/RPUSH/ZADD, 每条记录最多 aof_batch 个元素，避免大集合产生过大的单条记录
+    static constexpr size_t aof_batch = 64;
+    static void write_collection(aof_writer &w, std::string_view key, db_value &v)
+    {
+        auto type = v.type();
+        resp_command cmd;
+        size_t items = 0;
+        auto add = [&](std::string_view a, std::string_view b)
+        {
+            if (items == 0)
+            {
+                cmd.add(type == value_type::HASH ? "HSET" : type == value_type::LIST ? "RPUSH" : "ZADD");
+                cmd.add(key);
+            }
+            cmd.add(a);
+            if (type != value_type::LIST)
+            {
+                cmd.add(b);
+            }
+            if (++items == aof_batch)
+            {
+                w.add(cmd.view());
+                cmd = resp_command();
+                items = 0;
+            }
+        };
+        if (type == value_type::HASH)
+        {
+            v.hash_for_each(add);
+        }
+        else if (type == value_type::LIST)
+        {
+            v.list_range(0, v.length(), [&](std::string_view e)
+                         { add(e, {}); });
+        }
+        else
+        {
+            v.zset_range(0, v.length(), [&](std::string_view member, double score)
+                         {
+                char buf[32];
+                add(std::string_view(buf, std::to_chars(buf, buf + sizeof(buf), score).ptr - buf), member); });
+        }
+        if (items > 0)
+        {
+            w.add(cmd.view());
+        }
+    }
+
+    // 追加 AOF 记录，本轮第一条记录安排在事件处理完毕后写入
+    void propagate(const resp_args &args)
+    {
+        if (aof && !loading)
+        {
+            schedule_aof();
+            aof->append(args);
+        }
+    }
+
+    void propagate(std::initializer_list<std::string_view> args)
+    {
+        if (aof && !loading)
+        {
+            schedule_aof();
+            aof->append(args);
+        }
+    }
+
+    void schedule_aof()
+    {
+        if (!aof->pending())
+        {
+            server.defer([this](poll_server &)
+                         { flush_aof(); });
+        }
+    }
+
+    // 本轮所有命令的记录一次写入(always 策略下同时落盘)，之后才发送这些命令的回复
+    void flush_aof()
+    {
+        aof->flush();
+        aof_size.store(aof->file_size(), std::memory_order_relaxed);
+        auto list = std::move(aof_waiters);
+        aof_waiters.clear();
+        for (auto &fn : list)
+        {
+            fn();
+        }
+    }
+
+    // 本轮有尚未写入 AOF 的记录时 fn 在写入后执行，否则立即执行
+    void after_aof(std::function<void()> fn)
+    {
+        if (aof && aof->pending())
+        {
+            aof_waiters.push_back(std::move(fn));
+        }
+        else
+        {
+            fn();
+        }
+    }
+
+    // 处理 LASTSAVE 命令，多线程模式下为各分片中最早的一次
+    void handle_lastsave(std::string &out, const resp_args &args)
+    {
+        int64_t t = INT64_MAX;
+        for (auto s : shards)
+        {
+            t = std::min(t, s->last_save.load(std::memory_order_relaxed));
+        }
+        send_integer(out, t);
+    }
+
+    static std::string snapshot_file(const std::string &path, size_t shard)
+    {
+        return shard == 0 ? path : path + "." + std::to_string(shard);
+    }
+
+    // 写入本分片的快照，已过期的key不写入
+    void save_snapshot(int64_t time)
+    {
+        snapshot_header head{.time = (uint64_t)time, .shard = (uint32_t)shard_id, .shards = (uint32_t)shards.size()};
+        snapshot_writer w(snapshot_file(snapshot_path, shard_id), head);
+        auto now = mstime();
+        db.for_each([&](std::string_view key, db_value &v)
+                    {
+            int64_t when = 0;
+            if (!expires.empty())
+            {
+                if (auto e = expires.find(key))
+                {
+                    if (*e <= now)
+                    {
+                        return;
+                    }
+                    when = *e;
+                }
+            }
+            switch (v.type())
+            {
+            case value_type::STRING:
+                if (v.is_int())
+                {
+                    w.add(key, *v.as_int(), when);
+                }
+                else
+                {
+                    char buf[24];
+                    w.add(key, v.view(buf), when);
+                }
+                break;
+            case value_type::HASH:
+                w.add_collection(key, SNAPSHOT_HASH, v.length() * 2, when);
+                v.hash_for_each([&](std::string_view field, std::string_view value)
+                                {
+                    w.element(field);
+                    w.element(value); });
+                break;
+            case value_type::LIST:
+                w.add_collection(key, SNAPSHOT_LIST, v.length(), when);
+                v.list_range(0, v.length(), [&](std::string_view e)
+                             { w.element(e); });
+                break;
+            case value_type::ZSET:
+                w.add_collection(key, SNAPSHOT_ZSET, v.length() * 2, when);
+                v.zset_range(0, v.length(), [&](std::string_view member, double score)
+                             {
+                    char buf[8];
+                    memcpy(buf, &score, 8);
+                    w.element(member);
+                    w.element(std::string_view(buf, 8)); });
+                break;
+            } });
+        w.finish();
+    }
+
+    void load_record(std::string_view key, snapshot_type type, std::string_view str, int64_t num, int64_t expire, int64_t now)
+    {
+        if (expire && expire <= now)
+        {
+            return;
+        }
+        auto v = db.insert(key).first;
+        std::string_view prev; // 哈希的字段或有序集合的成员
+        size_t i = 0;
+        switch (type)
+        {
+        case SNAPSHOT_INT:
+            v->set_int(num);
+            break;
+        case SNAPSHOT_HASH:
+            v->make(value_type::HASH);
+            snapshot_reader::elements(str, [&](std::string_view e)
+                                      {
+                if (i++ % 2 == 1)
+                {
+                    v->hash_set(prev, e);
+                }
+                prev = e; });
+            break;
+        case SNAPSHOT_LIST:
+            v->make(value_type::LIST);
+            snapshot_reader::elements(str, [&](std::string_view e)
+                                      { v->list_push(e, false); });
+            break;
+        case SNAPSHOT_ZSET:
+            v->make(value_type::ZSET);
+            snapshot_reader::elements(str, [&](std::string_view e)
+                                      {
+                if (i++ % 2 == 1)
+                {
+                    double score;
+                    memcpy(&score, e.data(), 8);
+                    v->zset_add(prev, score);
+                }
+                prev = e; });
+            break;
+        default:
+            v->assign(str);
+        }
+        if (expire)
+        {
+            set_expire(key, expire);
+        }
+    }
+
+    // 启动时加载快照，按文件头中的 key 数预先分配哈希表，加载过程中不扩容
+    // 分片数与保存时相同时每个分片在各自的线程中并行加载自己的文件，否则按 key 重新分配到所属分片
+    static void load_snapshot(const std::vector<self *> &all)
+    {
+        auto &path = all[0]->snapshot_path;
+        if (access(path.c_str(), F_OK) != 0)
+        {
+            return;
+        }
+        std::vector<std::unique_ptr<snapshot_reader>> files;
+        files.push_back(std::make_unique<snapshot_reader>(path));
+        size_t n = files[0]->header.shards;
+        uint64_t keys = files[0]->header.keys, nexpires = files[0]->header.expires;
+        for (size_t i = 1; i < n; i++)
+        {
+            files.push_back(std::make_unique<snapshot_reader>(snapshot_file(path, i)));
+            keys += files[i]->header.keys;
+            nexpires += files[i]->header.expires;
+        }
+        for (size_t i = 0; i < n; i++)
+        {
+            if (files[i]->header.shards != n || files[i]->header.shard != i)
+            {
+                throw std::runtime_error("snapshot files do not match: " + snapshot_file(path, i));
+            }
+        }
+        auto now = mstime();
+        if (n == all.size())
+        {
+            run_parallel(n, [&](size_t i)
+                         {
+                auto s = all[i];
+                s->db.reserve(files[i]->header.keys);
+                s->expires.reserve(files[i]->header.expires);
+                files[i]->load([&](std::string_view key, snapshot_type type, std::string_view str, int64_t num, int64_t expire)
+                               { s->load_record(key, type, str, num, expire, now); }); });
+            return;
+        }
+        for (auto s : all)
+        {
+            s->db.reserve(keys / all.size() + keys / all.size() / 8);
+            s->expires.reserve(nexpires / all.size() + nexpires / all.size() / 8);
+        }
+        for (auto &f : files)
+        {
+            f->load([&](std::string_view key, snapshot_type type, std::string_view str, int64_t num, int64_t expire)
+                    { all[0]->shard_of(key)->load_record(key, type, str, num, expire, now); });
+        }
+    }
+
+    // 启动时重放 AOF, 文件不存在时返回 false
+    // 分片数与写入时相同时每个分片在各自的线程中并行重放自己的文件，否则依次重放并在 key 所属的分片上执行，之后按当前分片数重写所有文件
+    static bool load_aof(const std::vector<self *> &all)
+    {
+        auto &path = all[0]->aof_path;
+        if (access(path.c_str(), F_OK) != 0)
+        {
+            return false;
+        }
+        std::vector<std::unique_ptr<aof_reader>> files;
+        files.push_back(std::make_unique<aof_reader>(path));
+        size_t n = files[0]->shards;
+        for (size_t i = 1; i < n; i++)
+        {
+            files.push_back(std::make_unique<aof_reader>(aof_file(path, i)));
+        }
+        for (size_t i = 0; i < n; i++)
+        {
+            if (files[i]->shards != n || files[i]->shard != i)
+            {
+                throw std::runtime_error("append only files do not match: " + aof_file(path, i));
+            }
+        }
+        for (auto s : all)
+        {
+            s->loading = true;
+        }
+        if (n == all.size())
+        {
+            run_parallel(n, [&](size_t i)
+                         { files[i]->load([&](const resp_args &args)
+                                          { all[i]->replay(args, i, n, aof_file(path, i)); }); });
+        }
+        else
+        {
+            for (size_t i = 0; i < n; i++)
+            {
+                files[i]->load([&](const resp_args &args)
+                               { all[0]->replay(args, i, n, aof_file(path, i)); });
+            }
+        }
+        for (auto s : all)
+        {
+            s->loading = false;
+        }
+        if (n != all.size())
+        {
+            create_aof(all);
+            for (size_t i = all.size(); i < n; i++)
+            {
+                unlink(aof_file(path, i).c_str());
+            }
+        }
+        return true;
+    }
+
+    // 重放第 file 个(共 files 个) AOF 文件中的一条记录，文件数与当前分片数不同时在 key 当前所属的分片上执行
+    void replay(const resp_args &args, size_t file, size_t files, const std::string &path)
+    {
+        bool redistribute = files != shards.size();
+        auto h = args.empty() ? nullptr : find_command(args[0]);
+        if (!h || !(h->flags & CMD_WRITE) || !valid_arity(*h, args))
+        {
+            throw std::runtime_error("invalid command in append only file " + path);
+        }
+        std::string out;
+        if (!redistribute || (shards.size() == 1 && !(h->flags & CMD_BROADCAST)))
+        {
+            (this->*(h->handler))(out, args);
+        }
+        else if (h->flags & CMD_BROADCAST)
+        {
+            for (auto s : shards)
+            {
+                s->remove_origin(file, files);
+            }
+        }
+        else if (h->last_key == h->first_key)
+        {
+            auto owner = shard_of(args[h->first_key]);
+            (owner->*(h->handler))(out, args);
+        }
+        else
+        {
+            for (auto &[owner, part] : split_keys(*h, args))
+            {
+                (owner->*(h->handler))(out, part.view());
+            }
+        }
+    }
+
+    // 按各分片当前的数据写出完整的 AOF 文件(开启 AOF 时文件不存在，或分片数变化后)
+    static void create_aof(const std::vector<self *> &all)
+    {
+        run_parallel(all.size(), [&](size_t i)
+                     {
+            auto file = aof_file(all[i]->aof_path, i);
+            all[i]->write_aof(file + ".rewrite");
+            if (rename((file + ".rewrite").c_str(), file.c_str()) < 0)
+            {
+                throw std::runtime_error(file + ": " + strerror(errno));
+            } });
+    }
+
+    // 在 n 个线程中分别执行 fn(i)，全部结束后重新抛出第一个异常
+    template <typename F>
+    static void run_parallel(size_t n, F &&fn)
+    {
+        std::vector<std::exception_ptr> errors(n);
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < n; i++)
+        {
+            workers.emplace_back([&, i]
+                                 {
+                try
+                {
+                    fn(i);
+                }
+                catch (...)
+                {
+                    errors[i] = std::current_exception();
+                } });
+        }
+        for (auto &t : workers)
+        {
+            t.join();
+        }
+        for (auto &e : errors)
+        {
+            if (e)
+            {
+                std::rethrow_exception(e);
+            }
+        }
+    }
+
+    // 处理 INFO [section] 命令，section 为 stats/commandstats/latency/all, 省略时输出基本信息和 stats
+    void handle_info(std::string &out, const resp_args &args)
+    {
+        if (args.size() > 2)
+        {
+            send_error(out, "syntax error");
+            return;
+        }
+        std::string info_str = generate_info_response(args.size() == 2 ? args[1] : "default");
+        send_bulk(out, info_str);
+    }
+
+    void handle_ping(std::string &out, const resp_args &args)
+    {
+        if (args.size() > 2)
+        {
+            send_error(out, "wrong number of arguments for 'PING'");
+            return;
+        }
+        if (args.size() == 2)
+        {
+            // 如果提供了参数，返回该参数
+            send_bulk(out, args[1]);
+        }
+        else
+        {
+            // 无参数时返回 PONG
+            send_response(out, "+PONG\r\n");
+        }
+    }
+
+    // 生成 INFO 响应内容，多线程模式下为所有分片的合计
+    // 统计由各分片线程各自写入，这里只做 relaxed 读取，不加锁，也不向其他线程投递任务
+    std::string generate_info_response(std::string_view section) const
+    {
+        bool all = iequals(section, "all") || iequals(section, "everything");
+        bool basic = all || iequals(section, "default");
+        std::string info;
+        if (basic)
+        {
+            info += basic_info();
+        }
+        if (basic || iequals(section, "stats"))
+        {
+            info += stats_info();
+        }
+        if (all || iequals(section, "commandstats"))
+        {
+            info += command_info();
+        }
+        if (all || iequals(section, "latency") || iequals(section, "latencystats"))
+        {
+            info += latency_info();
+        }
+        return info;
+    }
+
+    std::string basic_info() const
+    {
+        size_t keys = 0, nexpires = 0, nclients = 0;
+        bool bgsave = false, save_ok = true, rewriting = false, rewrite_ok = true;
+        uint64_t aof_bytes = 0;
+        int64_t lastsave = INT64_MAX;
+        for (auto s : shards)
+        {
+            bgsave = bgsave || s->saving.load(std::memory_order_relaxed);
+            save_ok = save_ok && s->last_save_ok.load(std::memory_order_relaxed);
+            lastsave = std::min(lastsave, s->last_save.load(std::memory_order_relaxed));
+            rewriting = rewriting || s->aof_rewriting.load(std::memory_order_relaxed);
+            rewrite_ok = rewrite_ok && s->last_rewrite_ok.load(std::memory_order_relaxed);
+            aof_bytes += s->aof_size.load(std::memory_order_relaxed);
+            keys += s == this ? db.size() : s->key_count.load(std::memory_order_relaxed);
+            nexpires += s == this ? expires.size() : s->expire_count.load(std::memory_order_relaxed);
+            nclients += s == this ? clients.size() : s->client_count.load(std::memory_order_relaxed);
+        }
+        std::ostringstream oss;
+        oss << "keys:" << keys << "\r\n";
+        oss << "expires:" << nexpires << "\r\n";
+        oss << "clients:" << nclients << "\r\n";
+        oss << "threads:" << shards.size() << "\r\n";
+        oss << "rdb_bgsave_in_progress:" << bgsave << "\r\n";
+        oss << "rdb_last_save_time:" << lastsave << "\r\n";
+        oss << "rdb_last_bgsave_status:" << (save_ok ? "ok" : "err") << "\r\n";
+        oss << "aof_enabled:" << (aof != nullptr) << "\r\n";
+        oss << "aof_rewrite_in_progress:" << rewriting << "\r\n";
+        oss << "aof_last_bgrewrite_status:" << (rewrite_ok ? "ok" : "err") << "\r\n";
+        oss << "aof_current_size:" << aof_bytes << "\r\n";
+        return oss.str();
+    }
+
+    std::string stats_info() const
+    {
+        uint64_t accepted = 0, rejected = 0, commands = 0, bytes_in = 0, bytes_out = 0, reads = 0, writes = 0;
+        uint64_t expired = 0, cycles = 0, busy = 0, posted = 0, queued = 0, paused = 0;
+        uint64_t closed[poll_server::loop_stats::close_reasons] = {};
+        for (auto s : shards)
+        {
+            auto &st = s->server.stats();
+            accepted += st.accepted.get();
+            rejected += st.rejected.get();
+            bytes_in += st.bytes_in.get();
+            bytes_out += st.bytes_out.get();
+            reads += st.reads.get();
+            writes += st.writes.get();
+            cycles += st.iterations.get();
+            busy += st.busy.sum.get();
+            posted += st.posted.get();
+            queued += st.queued.get();
+            paused += st.paused.get();
+            for (int i = 0; i < poll_server::loop_stats::close_reasons; i++)
+            {
+                closed[i] += st.closed[i].get();
+            }
+            for (auto &h : s->command_stats)
+            {
+                commands += h.calls.get();
+            }
+            expired += s->expired_keys.get();
+        }
+        std::ostringstream oss;
+        oss << "# Stats\r\n";
+        oss << "total_connections_received:" << accepted << "\r\n";
+        oss << "rejected_connections:" << rejected << "\r\n";
+        oss << "total_commands_processed:" << commands << "\r\n";
+        oss << "total_net_input_bytes:" << bytes_in << "\r\n";
+        oss << "total_net_output_bytes:" << bytes_out << "\r\n";
+        oss << "total_reads_processed:" << reads << "\r\n";
+        oss << "total_writes_processed:" << writes << "\r\n";
+        oss << "expired_keys:" << expired << "\r\n";
+        oss << "lazyfree_pending_objects:" << (reclaim ? reclaim->pending() : 0) << "\r\n";
+        oss << "lazyfreed_objects:" << (reclaim ? reclaim->released() : 0) << "\r\n";
+        oss << "eventloop_cycles:" << cycles << "\r\n";
+        oss << "eventloop_duration_sum:" << busy / 1000 << "\r\n";
+        oss << "posted_tasks:" << posted << "\r\n";
+        oss << "output_buffer_bytes:" << queued << "\r\n";
+        oss << "paused_clients:" << paused << "\r\n";
+        for (int i = 0; i < poll_server::loop_stats::close_reasons; i++)
+        {
+            oss << "closed_" << poll_server::loop_stats::close_names[i] << ":" << closed[i] << "\r\n";
+        }
+        return oss.str();
+    }
+
+    // 各命令在所有分片上的合计，calls 为客户端命令数；usec 为各分片执行耗时之和，按抽样的平均耗时乘执行次数估计
+    std::string command_info() const
+    {
+        std::string out = "# Commandstats\r\n";
+        for (size_t i = 0; i < std::size(commands); i++)
+        {
+            histogram::snapshot h;
+            uint64_t calls = 0, executed = 0;
+            for (auto s : shards)
+            {
+                h.merge(s->command_stats[i].time);
+                calls += s->command_stats[i].calls.get();
+                executed += s->command_stats[i].executed.get();
+            }
+            if (calls > 0)
+            {
+                double usec = h.count ? h.sum / 1000.0 / h.count * executed : 0;
+                char buf[128];
+                snprintf(buf, sizeof(buf), ":calls=%llu,usec=%llu,usec_per_call=%.2f\r\n", (unsigned long long)calls, (unsigned long long)usec, usec / calls);
+                out.append("cmdstat_").append(lower(commands[i].name)).append(buf);
+            }
+        }
+        return out;
+    }
+
+    // 各命令在单个分片上的执行耗时(多分片命令的每个部分单独计)和事件循环的分位数，单位微秒，按直方图桶的上界估计
+    std::string latency_info() const
+    {
+        auto line = [](std::string &out, std::string_view name, const histogram::snapshot &h, double scale)
+        {
+            char buf[160];
+            snprintf(buf, sizeof(buf), ":p50=%.3f,p99=%.3f,p99.9=%.3f,max=%.3f\r\n", h.percentile(0.5) / scale, h.percentile(0.99) / scale, h.percentile(0.999) / scale, h.max / scale);
+            out.append(name).append(buf);
+        };
+        std::string out = "# Latencystats\r\n";
+        for (size_t i = 0; i < std::size(commands); i++)
+        {
+            histogram::snapshot h;
+            for (auto s : shards)
+            {
+                h.merge(s->command_stats[i].time);
+            }
+            if (h.count > 0)
+            {
+                line(out, "shard_exec_percentiles_usec_" + lower(commands[i].name), h, 1000.0);
+            }
+        }
+        histogram::snapshot busy, on_data, ready;
+        for (auto s : shards)
+        {
+            busy.merge(s->server.stats().busy);
+            on_data.merge(s->server.stats().on_data);
+            ready.merge(s->server.stats().ready);
+        }
+        line(out, "eventloop_busy_usec", busy, 1000.0);
+        line(out, "eventloop_on_data_usec", on_data, 1000.0);
+        line(out, "eventloop_ready_fds", ready, 1.0);
+        return out;
+    }
+
+    static std::string lower(std::string_view v)
+    {
+        std::string s(v);
+        for (auto &ch : s)
+        {
+            ch = tolower((unsigned char)ch);
+        }
+        return s;
+    }
+
+    // 解析整数参数
+    static std::optional<int64_t> parse_int(std::string_view v)
+    {
+        int64_t value;
+        auto [end, ec] = std::from_chars(v.data(), v.data() + v.size(), value);
+        if (ec != std::errc() || end != v.data() + v.size())
+        {
+            return std::nullopt;
+        }
+        return value;
+    }
+
+    // SCAN TYPE 的类型名，不区分大小写
+    static std::optional<value_type> parse_type(std::string_view name)
+    {
+        if (iequals(name, "string"))
+        {
+            return value_type::STRING;
+        }
+        if (iequals(name, "hash"))
+        {
+            return value_type::HASH;
+        }
+        if (iequals(name, "list"))
+        {
+            return value_type::LIST;
+        }
+        if (iequals(name, "zset"))
+        {
+            return value_type::ZSET;
+        }
+        return std::nullopt;
+    }
+
+    // glob 风格匹配(SCAN MATCH)，支持 * ? [abc] [^abc] [a-z] 和 \ 转义
+    // 遇到 * 时记下位置，之后失配时回到该处让 * 多匹配一个字符，不需要递归
+    static bool glob_match(std::string_view p, std::string_view s)
+    {
+        size_t pi = 0, si = 0, star = std::string_view::npos, mark = 0;
+        while (si < s.size())
+        {
+            size_t next;
+            if (pi < p.size() && p[pi] == '*')
+            {
+                star = ++pi;
+                mark = si;
+            }
+            else if (pi < p.size() && glob_char(p, pi, s[si], next))
+            {
+                pi = next;
+                si++;
+            }
+            else if (star != std::string_view::npos)
+            {
+                pi = star;
+                si = ++mark;
+            }
+            else
+            {
+                return false;
+            }
+        }
+        while (pi < p.size() && p[pi] == '*')
+        {
+            pi++;
+        }
+        return pi == p.size();
+    }
+
+    // 模式 p 在 i 处的一个字符或字符类是否匹配 c，next 为其后的位置；缺少 ']' 时字符类到模式末尾为止
+    static bool glob_char(std::string_view p, size_t i, char c, size_t &next)
+    {
+        if (p[i] == '?')
+        {
+            next = i + 1;
+            return true;
+        }
+        if (p[i] == '\\' && i + 1 < p.size())
+        {
+            next = i + 2;
+            return p[i + 1] == c;
+        }
+        if (p[i] != '[')
+        {
+            next = i + 1;
+            return p[i] == c;
+        }
+        size_t j = i + 1;
+        bool negate = j < p.size() && p[j] == '^';
+        j += negate;
+        bool hit = false;
+        while (j < p.size() && p[j] != ']')
+        {
+            if (p[j] == '\\' && j + 1 < p.size())
+            {
+                hit = hit || p[j + 1] == c;
+                j += 2;
+            }
+            else if (j + 2 < p.size() && p[j + 1] == '-' && p[j + 2] != ']')
+            {
+                auto lo = std::min(p[j], p[j + 2]), hi = std::max(p[j], p[j + 2]);
+                hit = hit || (c >= lo && c <= hi);
+                j += 3;
+            }
+            else
+            {
+                hit = hit || p[j] == c;
+                j++;
+            }
+        }
+        next = std::min(j + 1, p.size());
+        return hit != negate;
+    }
+
+    // 解析分值，接受 inf/+inf/-inf, 不接受 nan
+    static std::optional<double> parse_score(std::string_view v)
+    {
+        if (!v.empty() && v[0] == '+')
+        {
+            v.remove_prefix(1);
+        }
+        double value;
+        auto [end, ec] = std::from_chars(v.data(), v.data() + v.size(), value);
+        if (ec != std::errc() || end != v.data() + v.size() || std::isnan(value))
+        {
+            return std::nullopt;
+        }
+        return value;
+    }
+
+    // 把可以为负数(从末尾计算)的闭区间 [start, stop] 转换为起始位置和元素个数，超出范围时个数为0
+    static std::pair<size_t, size_t> normalize_range(int64_t start, int64_t stop, size_t len)
+    {
+        int64_t n = len;
+        start = start < 0 ? std::max<int64_t>(start + n, 0) : start;
+        stop = stop < 0 ? stop + n : std::min(stop, n - 1);
+        if (start > stop || start >= n)
+        {
+            return {0, 0};
+        }
+        return {start, stop - start + 1};
+    }
+
+    // key 存在且类型不是 t 时写入 WRONGTYPE 错误并返回 false, 不存在时返回 true
+    bool check_type(std::string &out, db_value *v, value_type t)
+    {
+        if (v && v->type() != t)
+        {
+            send_response(out, "-WRONGTYPE Operation against a key holding the wrong kind of value\r\n");
+            return false;
+        }
+        return true;
+    }
+
+    // 写命令查找 t 类型的 key, 不存在时创建空集合；类型不符时写入错误并返回 nullptr
+    db_value *lookup_write(std::string &out, std::string_view key, value_type t)
+    {
+        auto v = lookup(key);
+        if (!check_type(out, v, t))
+        {
+            return nullptr;
+        }
+        if (!v)
+        {
+            v = db.insert(key).first;
+            v->make(t);
+        }
+        return v;
+    }
+
+    // 查找未过期的key，已过期的key在访问时删除(惰性过期)并追加 DEL 记录，没有设置过期时间的key不查询 expires
+    // 返回的指针在下一次修改 db 前有效
+    db_value *lookup(std::string_view key)
+    {
+        return lookup(key, db.key_hash(key));
+    }
+
+    // h 为 key 的哈希值，批量查找时由 prefetch_key 预先计算
+    db_value *lookup(std::string_view key, uint64_t h)
+    {
+        auto v = db.find(key, h);
+        if (v && !expires.empty() && !loading)
+        {
+            auto when = expires.find(key, h);
+            if (when && *when <= mstime())
+            {
+                expires.erase(key);
+                db.erase(key);
+                expired_keys.add();
+                propagate({"DEL", key});
+                return nullptr;
+            }
+        }
+        return v;
+    }
+
+    void remove_key(std::string_view key)
+    {
+        if (!expires.empty())
+        {
+            expires.erase(key);
+        }
+        db.erase(key);
+    }
+
+    void set_expire(std::string_view key, int64_t when)
+    {
+        *expires.insert(key).first = when;
+    }
+
+    // 主动过期：从上次的位置继续按组抽查设置了过期时间的key，删除已过期的
+    // 抽查时不能修改 expires, 先记下过期的key再删除；大量删除后表中空组较多，检查空组只需一次比较，每轮最多检查 expire_samples * 20 组
+    void active_expire()
+    {
+        if (expires.empty())
+        {
+            return;
+        }
+        auto start = std::chrono::steady_clock::now();
+        auto now = mstime();
+        std::vector<std::string> dead;
+        for (;;)
+        {
+            size_t sampled = 0, visited = 0;
+            do
+            {
+                expire_cursor = expires.sample(expire_cursor, [&](std::string_view key, int64_t when)
+                                             {
+                    sampled++;
+                    if (when <= now)
+                    {
+                        dead.emplace_back(key);
+                    } });
+            } while (sampled < expire_samples && ++visited < expire_samples * 20 && expire_cursor != 0);
+            for (auto &key : dead)
+            {
+                db.erase(key);
+                expires.erase(key);
+                propagate({"DEL", key});
+            }
+            expired_keys.add(dead.size());
+            bool more = dead.size() * 4 > sampled;
+            dead.clear();
+            if (!more || expires.empty())
+            {
+                return;
+            }
+            if (std::chrono::steady_clock::now() - start >= expire_budget)
+            {
+                server.defer([this](poll_server &)
+                             { active_expire(); });
+                return;
+            }
+        }
+    }
+
+    // 推进 db 和 expires 的渐进式 rehash, 直到完成或超出 expire_budget
+    void background_rehash()
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (;;)
+        {
+            bool more = db.rehash(64);
+            more = expires.rehash(64) || more;
+            if (!more || std::chrono::steady_clock::now() - start >= expire_budget)
+            {
+                return;
+            }
+        }
+    }
+
+    // 相对时间转换为过期时刻，unit 为时间参数的单位(毫秒)，溢出时返回 nullopt
+    static std::optional<int64_t> expire_at(int64_t v, int64_t unit)
+    {
+        int64_t ms, when;
+        if (__builtin_mul_overflow(v, unit, &ms) || __builtin_add_overflow(ms, mstime(), &when))
+        {
+            return std::nullopt;
+        }
+        return when;
+    }
+
+    // 当前unix时间(毫秒)，过期时刻使用绝对时间
+    static int64_t mstime()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    static bool iequals(std::string_view a, std::string_view b)
+    {
+        return a.size() == b.size() && strncasecmp(a.data(), b.data(), a.size()) == 0;
+    }
+
+    // 已存在时复用原有的 value 内存，不改变过期时间；整数的规范写法以整数编码保存
+    void set_value(std::string_view key, std::string_view value)
+    {
+        db.insert(key).first->assign(value);
+    }
+
+    // 写入响应
+    void send_response(std::string &out, std::string_view resp)
+    {
+        out.append(resp);
+    }
+
+    // 统一错误响应
+    void send_error(std::string &out, std::string_view msg)
+    {
+        out.append("-ERR ").append(msg).append("\r\n");
+    }
+
+    // 整数回复，使用 to_chars 直接写入，不产生临时字符串
+    void send_integer(std::string &out, int64_t v)
+    {
+        char buf[24];
+        buf[0] = ':';
+        auto end = std::to_chars(buf + 1, buf + sizeof(buf) - 2, v).ptr;
+        *end++ = '\r';
+        *end++ = '\n';
+        out.append(buf, end - buf);
+    }
+
+    void send_bulk(std::string &out, std::string_view v)
+    {
+        char buf[24];
+        buf[0] = '$';
+        auto end = std::to_chars(buf + 1, buf + sizeof(buf) - 2, v.size()).ptr;
+        *end++ = '\r';
+        *end++ = '\n';
+        out.append(buf, end - buf).append(v).append("\r\n");
+    }
+
+    void send_array(std::string &out, size_t n)
+    {
+        char buf[24];
+        buf[0] = '*';
+        auto end = std::to_chars(buf + 1, buf + sizeof(buf) - 2, n).ptr;
+        *end++ = '\r';
+        *end++ = '\n';
+        out.append(buf, end - buf);
+    }
+
+    // 分值以能精确还原的最短十进制形式返回
+    void send_score(std::string &out, double score)
+    {
+        char buf[32];
+        send_bulk(out, std::string_view(buf, std::to_chars(buf, buf + sizeof(buf), score).ptr - buf));
+    }
+
+    void publish_stats()
+    {
+        key_count.store(db.size(), std::memory_order_relaxed);
+        expire_count.store(expires.size(), std::memory_order_relaxed);
+        client_count.store(clients.size(), std::memory_order_relaxed);
+        if (aof)
+        {
+            aof_size.store(aof->file_size(), std::memory_order_relaxed);
+        }
+    }
+
+    int on_loop(poll_server &, int)
+    {
+        publish_stats();
+        return 1000;
+    }
+
+    void on_open(poll_server &, int fd)
+    {
+        if (fd > 0)
+        {
+            clients[fd] = {.parser = resp_parser(bulk_limit), .id = ++next_client_id};
+        }
+    }
+
+    // 输入缓冲区由 poll_server 持有，返回已解析的字节数，不完整的命令留到下次连同新数据一起回调
+    // 解析器保存了不完整命令的进度，下次从中断处继续
+    int on_data(poll_server &s, int fd, const char *data, int len)
+    {
+        if (len > 0)
+        {
+            auto &c = clients.at(fd);
+            if (c.closing)
+            {
+                return len; // 等待错误回复发送完成，丢弃之后的输入
+            }
+            size_t parsed = 0;
+            bool paused = s.paused(fd);
+            while (parsed < (size_t)len && !paused)
+            {
+                auto r = c.parser.parse(data + parsed, len - parsed);
+                if (r == resp_parser::NEED_MORE)
+                {
+                    // 未接收完的命令：已知命令名时按其上限检查；等待较大的 bulk 时输入缓冲区按其结束位置一次分配，
+                    // 之后的数据直接读入其中，参数完整后只在写入 db 时复制一次
+                    size_t need = c.parser.expected();
+                    if (need > command_limit(c.parser.args()))
+                    {
+                        c.closing = true;
+                        send_response(batch, "-ERR Protocol error: command too large\r\n");
+                        flush_replies(fd, c);
+                        return len;
+                    }
+                    if (need >= large_bulk && need > len - parsed)
+                    {
+                        s.expect(fd, need);
+                    }
+                    break;
+                }
+                if (r == resp_parser::ERROR)
+                {
+                    c.closing = true;
+                    send_response(batch, "-ERR Protocol error\r\n");
+                    flush_replies(fd, c);
+                    return len;
+                }
+                parsed += c.parser.consumed();
+                process_command(fd, c, c.parser.args());
+                // 回复较多时先写出，发送队列超过高水位时 poll_server 暂停读取，剩余的命令留在输入缓冲区，恢复读取后再回调
+                if (batch.size() >= reply_flush_size)
+                {
+                    flush_replies(fd, c);
+                    paused = s.paused(fd);
+                }
+                if (c.pending.size() >= max_pending)
+                {
+                    s.suspend(fd);
+                    paused = true;
+                }
+            }
+            flush_replies(fd, c);
+            return parsed;
+        }
+        clients.erase(fd);
+        s.closefd(fd);
+        return 0;
+    }
+
+public:
+    RedisServer(poll_server::options opt = {}) : server([this](poll_server &s, int n)
+                                                        { return on_loop(s, n); },
+                                                        [this](poll_server &s, int fd)
+                                                        { on_open(s, fd); },
+                                                        [this](poll_server &s, int fd, const char *data, int len)
+                                                        { return on_data(s, fd, data, len); },
+                                                        opt)
+    {
+        server.set_interval(expire_period, [this](poll_server &)
+                            {
+            active_expire();
+            background_rehash();
+            check_children(); });
+    }
+    RedisServer(const RedisServer &) = delete;
+    RedisServer &operator=(const RedisServer &) = delete;
+
+    // 持久化及命令大小上限配置
+    struct config
+    {
+        std::string dbfilename = "dump.rdb";
+        bool appendonly = false;
+        aof_fsync appendfsync = aof_fsync::EVERYSEC;
+        std::string appendfilename = "appendonly.aof";
+        size_t max_command_size = 512 << 20;
+        std::vector<std::pair<std::string, size_t>> command_limits; // 按命令名(不区分大小写)单独设置的上限
+    };
+
+    void run(int port)
+    {
+        server.start(port);
+    }
+
+    // 在调用线程直接执行一条命令，回复追加到 out, 不经过网络和分片路由，只访问本分片的数据
+    // 用于微基准测试等进程内调用，只能在事件循环启动前或事件循环线程中调用
+    void call(std::string &out, const resp_args &args)
+    {
+        if (auto cmd = check_command(out, args))
+        {
+            command_stats[cmd - commands].calls.add();
+            execute(*cmd, out, args);
+        }
+    }
+
+    // 启动 threads 个事件循环线程，每个线程独立监听同一端口(SO_REUSEPORT)，由内核分配连接
+    // 每个线程持有一个 db 分片，key 按哈希归属分片，访问其他分片的命令通过事件循环间的消息队列执行
+    // 启动前加载数据：开启 AOF 时重放 AOF, AOF 不存在时加载快照后创建；否则加载快照
+    // 分片 i 的快照文件为 dbfilename.<i>, AOF 为 appendfilename.<i>(分片0为文件名本身)
+    static void serve(int port, int threads, poll_server::options opt, const config &cfg)
+    {
+        lazy_free reclaim; // 在所有分片之后析构，退出前释放完已投递的对象
+        std::vector<std::unique_ptr<self>> list;
+        std::vector<self *> all;
+        for (int i = 0; i < std::max(threads, 1); i++)
+        {
+            list.push_back(std::make_unique<self>(opt));
+            all.push_back(list.back().get());
+        }
+        for (size_t i = 0; i < list.size(); i++)
+        {
+            list[i]->shards = all;
+            list[i]->shard_id = i;
+            list[i]->snapshot_path = cfg.dbfilename;
+            list[i]->aof_path = cfg.appendfilename;
+            list[i]->aof_policy = cfg.appendfsync;
+            list[i]->max_command_size = std::min<size_t>(cfg.max_command_size, resp_parser::max_command);
+            list[i]->bulk_limit = std::max<int64_t>(resp_parser::max_bulk, list[i]->max_command_size);
+            list[i]->reclaim = &reclaim;
+            for (auto &[name, limit] : cfg.command_limits)
+            {
+                auto h = find_command(name);
+                if (!h)
+                {
+                    throw std::runtime_error("unknown command in command size limit: " + name);
+                }
+                auto n = std::min<size_t>(limit, resp_parser::max_command);
+                list[i]->command_limits[h - commands] = n;
+                list[i]->bulk_limit = std::max<int64_t>(list[i]->bulk_limit, n);
+            }
+        }
+        if (!cfg.appendonly)
+        {
+            load_snapshot(all);
+        }
+        else
+        {
+            if (!load_aof(all))
+            {
+                load_snapshot(all);
+                create_aof(all);
+            }
+            for (auto s : all)
+            {
+                s->aof = std::make_unique<aof_log>(aof_file(s->aof_path, s->shard_id), s->aof_policy);
+            }
+        }
+        for (auto s : all)
+        {
+            s->publish_stats(); // 其他线程启动前也能读到加载后的统计
+        }
+        std::vector<std::thread> workers;
+        for (size_t i = 1; i < list.size(); i++)
+        {
+            workers.emplace_back([&list, i, port]
+                                 { list[i]->run(port); });
+        }
+        list[0]->run(port);
+        for (auto &t : workers)
+        {
+            t.join();
+        }
+    }
+
+private:
+    // 命令表在编译期构造，声明在所有处理函数之后
+    static constexpr command commands[] = {
+        {"GET", &self::handle_get, 2, CMD_READ, 1, 1, 1},
+        {"SET", &self::handle_set, -3, CMD_WRITE, 1, 1, 1},
+        {"SETNX", &self::handle_setnx, 3, CMD_WRITE, 1, 1, 1},
+        {"DEL", &self::handle_del, -2, CMD_WRITE, 1, -1, 1},
+        {"UNLINK", &self::handle_unlink, -2, CMD_WRITE, 1, -1, 1},
+        {"MGET", &self::handle_mget, -2, CMD_READ | CMD_ARRAY, 1, -1, 1},
+        {"MSET", &self::handle_mset, -3, CMD_WRITE, 1, -1, 2},
+        {"MSETNX", &self::handle_msetnx, -3, CMD_WRITE | CMD_ONE_SHARD, 1, -1, 2},
+        {"SCAN", &self::handle_scan, -2, CMD_READ | CMD_CURSOR, 0, 0, 0},
+        {"INCR", &self::handle_incr, 2, CMD_WRITE, 1, 1, 1},
+        {"INCRBY", &self::handle_incrby, 3, CMD_WRITE, 1, 1, 1},
+        {"EXPIRE", &self::handle_expire, 3, CMD_WRITE, 1, 1, 1},
+        {"PEXPIRE", &self::handle_pexpire, 3, CMD_WRITE, 1, 1, 1},
+        {"EXPIREAT", &self::handle_expireat, 3, CMD_WRITE, 1, 1, 1},
+        {"PEXPIREAT", &self::handle_pexpireat, 3, CMD_WRITE, 1, 1, 1},
+        {"TTL", &self::handle_ttl, 2, CMD_READ, 1, 1, 1},
+        {"PTTL", &self::handle_pttl, 2, CMD_READ, 1, 1, 1},
+        {"PERSIST", &self::handle_persist, 2, CMD_WRITE, 1, 1, 1},
+        {"HSET", &self::handle_hset, -4, CMD_WRITE, 1, 1, 1},
+        {"HGET", &self::handle_hget, 3, CMD_READ, 1, 1, 1},
+        {"HDEL", &self::handle_hdel, -3, CMD_WRITE, 1, 1, 1},
+        {"HGETALL", &self::handle_hgetall, 2, CMD_READ, 1, 1, 1},
+        {"LPUSH", &self::handle_lpush, -3, CMD_WRITE, 1, 1, 1},
+        {"RPUSH", &self::handle_rpush, -3, CMD_WRITE, 1, 1, 1},
+        {"LPOP", &self::handle_lpop, -2, CMD_WRITE, 1, 1, 1},
+        {"LRANGE", &self::handle_lrange, 4, CMD_READ, 1, 1, 1},
+        {"ZADD", &self::handle_zadd, -4, CMD_WRITE, 1, 1, 1},
+        {"ZRANGE", &self::handle_zrange, -4, CMD_READ, 1, 1, 1},
+        {"ZSCORE", &self::handle_zscore, 3, CMD_READ, 1, 1, 1},
+        {"FLUSHDB", &self::handle_flushall, -1, CMD_WRITE | CMD_BROADCAST, 0, 0, 0},
+        {"FLUSHALL", &self::handle_flushall, -1, CMD_WRITE | CMD_BROADCAST, 0, 0, 0},
+        {"SAVE", &self::handle_save, 1, CMD_BROADCAST, 0, 0, 0},
+        {"BGSAVE", &self::handle_bgsave, 1, CMD_BROADCAST, 0, 0, 0},
+        {"LASTSAVE", &self::handle_lastsave, 1, 0, 0, 0, 0},
+        {"BGREWRITEAOF", &self::handle_bgrewriteaof, 1, CMD_BROADCAST, 0, 0, 0},
+        {"INFO", &self::handle_info, -1, 0, 0, 0, 0},
+        {"PING", &self::handle_ping, -1, 0, 0, 0, 0},
+    };
+
+    // 各命令由本分片接收的客户端命令数、在本分片的执行次数和抽样的执行耗时(纳秒)，下标为命令在 commands 中的位置
+    // 转发/拆分/广播的命令只在接收的分片计入 calls, 每个执行部分的分片计入 executed 和 time；只由本线程写入，INFO 读取所有分片
+    struct command_stat
+    {
+        stat_counter calls;
+        stat_counter executed;
+        histogram time;
+    };
+    static constexpr uint64_t command_sample = 64;
+    command_stat command_stats[std::size(commands)];
+    size_t command_limits[std::size(commands)] = {}; // 单独设置的命令大小上限，0 表示使用 max_command_size
+};
@@ -0,0 +1,357 @@
+#pragma once
+#include <algorithm>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// 命令参数，保存为相对于命令起点的偏移量，数据移动后(如输入缓冲区扩容、复制到其他线程)只需更新 base
+// 参数个数不超过 inline_cap 时不分配内存
+class resp_args
+{
+    struct slot
+    {
+        uint32_t off;
+        uint32_t len;
+    };
+    static constexpr size_t inline_cap = 8;
+
+    const char *base = nullptr;
+    size_t n = 0;
+    slot fixed[inline_cap];
+    std::vector<slot> more;
+
+    const slot &at(size_t i) const
+    {
+        return i < inline_cap ? fixed[i] : more[i - inline_cap];
+    }
+
+public:
+    size_t size() const
+    {
+        return n;
+    }
+    bool empty() const
+    {
+        return n == 0;
+    }
+    std::string_view operator[](size_t i) const
+    {
+        auto &s = at(i);
+        return {base + s.off, s.len};
+    }
+    void rebase(const char *b)
+    {
+        base = b;
+    }
+    void clear()
+    {
+        n = 0;
+        more.clear();
+    }
+    void push(size_t off, size_t len)
+    {
+        slot s{(uint32_t)off, (uint32_t)len};
+        if (n < inline_cap)
+        {
+            fixed[n] = s;
+        }
+        else
+        {
+            more.push_back(s);
+        }
+        n++;
+    }
+};
+
+// 持有数据的命令参数，用于把命令投递到其他线程执行
+struct resp_command
+{
+    std::string data;
+    resp_args args;
+
+    void add(std::string_view a)
+    {
+        args.push(data.size(), a.size());
+        data.append(a);
+    }
+    const resp_args &view()
+    {
+        args.rebase(data.data());
+        return args;
+    }
+};
+
+// 查找 [p, end) 中第一个字符 c, 不存在时返回 end
+inline const char *resp_find(const char *p, const char *end, char c)
+{
+#if defined(__AVX2__)
+    auto needle32 = _mm256_set1_epi8(c);
+    for (; end - p >= 32; p += 32)
+    {
+        unsigned m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), needle32));
+        if (m)
+        {
+            return p + __builtin_ctz(m);
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    auto needle = _mm_set1_epi8(c);
+    for (; end - p >= 16; p += 16)
+    {
+        unsigned m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), needle));
+        if (m)
+        {
+            return p + __builtin_ctz(m);
+        }
+    }
+#endif
+    for (; p < end; p++)
+    {
+        if (*p == c)
+        {
+            return p;
+        }
+    }
+    return end;
+}
+
+// 解析以 \r\n 结尾的非负十进制长度，成功时 next 指向 \r\n 之后
+// 返回值，1: 成功，0: 数据不完整，-1: 格式错误
+// 剩余数据不少于16字节时一次比较找出第一个非数字字符，长度行一般只需一次
+inline int resp_parse_len(const char *p, const char *end, int64_t &v, const char *&next)
+{
+    int n = 0;
+#if defined(__SSE2__)
+    if (end - p >= 16)
+    {
+        auto x = _mm_loadu_si128((const __m128i *)p);
+        auto digits = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(x, _mm_set1_epi8('9' + 1)));
+        unsigned m = ~_mm_movemask_epi8(digits) & 0xffff;
+        if (m == 0)
+        {
+            return -1;
+        }
+        n = __builtin_ctz(m);
+    }
+    else
+#endif
+    {
+        while (p + n < end && p[n] >= '0' && p[n] <= '9')
+        {
+            n++;
+        }
+    }
+    if (n == 0 || n > 15)
+    {
+        return p + n == end && n == 0 ? 0 : -1;
+    }
+    if (end - (p + n) < 2)
+    {
+        return 0;
+    }
+    if (p[n] != '\r' || p[n + 1] != '\n')
+    {
+        return -1;
+    }
+    v = 0;
+    for (int i = 0; i < n; i++)
+    {
+        v = v * 10 + (p[i] - '0');
+    }
+    next = p + n + 2;
+    return 1;
+}
+
+// RESP 请求的增量解析器，每个连接一个，跨 on_data 调用保存解析进度
+// 不完整的 bulk 只记录还差多少字节，数据到齐前不再重复扫描；参数以偏移量保存，解析结果不复制数据
+// 也支持以空白分隔、\n 结尾的 inline 命令(如 telnet 输入的 PING)，不处理引号
+class resp_parser
+{
+public:
+    enum result
+    {
+        NEED_MORE,
+        DONE,
+        ERROR,
+    };
+
+    static constexpr int64_t max_args = 1024 * 1024;
+    static constexpr int64_t max_bulk = 512 * 1024 * 1024; // 默认的单个参数上限
+    static constexpr size_t max_inline = 64 * 1024;
+    // 一个命令(含全部参数)能表示的最大字节数：poll_server 以 int 传递输入长度，resp_args 以 uint32_t 保存偏移量
+    static constexpr int64_t max_command = INT_MAX;
+
+private:
+    enum state
+    {
+        START,
+        BULK_LEN,
+        BULK_DATA,
+        INLINE,
+    };
+    state st = START;
+    size_t pos = 0;        // 当前命令已解析到的位置，INLINE 状态下为已查找过的位置
+    int64_t remaining = 0; // 尚未解析的参数个数
+    int64_t bulk = 0;      // 当前 bulk 的长度
+    size_t used = 0;       // 上一个完成的命令的长度
+    int64_t bulk_limit = max_bulk;
+    resp_args list;
+
+    result finish(size_t n)
+    {
+        used = n;
+        st = START;
+        pos = 0;
+        return DONE;
+    }
+
+    result parse_inline(const char *data, size_t len)
+    {
+        auto end = data + len;
+        auto nl = resp_find(data + pos, end, '\n');
+        if (nl == end)
+        {
+            pos = len;
+            return len > max_inline ? ERROR : NEED_MORE;
+        }
+        list.clear();
+        auto line_end = nl > data && nl[-1] == '\r' ? nl - 1 : nl;
+        for (auto p = data; p < line_end;)
+        {
+            while (p < line_end && (*p == ' ' || *p == '\t'))
+            {
+                p++;
+            }
+            auto start = p;
+            while (p < line_end && *p != ' ' && *p != '\t')
+            {
+                p++;
+            }
+            if (p > start)
+            {
+                list.push(start - data, p - start);
+            }
+        }
+        return finish(nl + 1 - data);
+    }
+
+public:
+    resp_parser() = default;
+    // 单个参数超过 bulk_limit(不超过 max_command)时返回 ERROR
+    explicit resp_parser(int64_t bulk_limit) : bulk_limit(std::min(bulk_limit, max_command))
+    {
+    }
+
+    // data 为当前命令的起点，返回 NEED_MORE 时保存进度，下次传入同一起点(地址可以变化)及之后到达的全部数据
+    // 返回 DONE 时 args() 为解析结果，引用 data 中的数据，consumed() 为此命令占用的字节数，下一个命令从其后开始
+    result parse(const char *data, size_t len)
+    {
+        list.rebase(data);
+        auto end = data + len;
+        for (;;)
+        {
+            auto p = data + pos;
+            const char *next;
+            switch (st)
+            {
+            case START:
+            {
+                if (len == 0)
+                {
+                    return NEED_MORE;
+                }
+                if (*p != '*')
+                {
+                    st = INLINE;
+                    break;
+                }
+                int r = resp_parse_len(p + 1, end, remaining, next);
+                if (r <= 0)
+                {
+                    return r < 0 ? ERROR : NEED_MORE;
+                }
+                if (remaining > max_args)
+                {
+                    return ERROR;
+                }
+                list.clear();
+                pos = next - data;
+                st = BULK_LEN;
+                break;
+            }
+            case BULK_LEN:
+            {
+                if (remaining == 0)
+                {
+                    return finish(pos);
+                }
+                if (pos >= len)
+                {
+                    return NEED_MORE;
+                }
+                if (*p != '$')
+                {
+                    return ERROR;
+                }
+                int r = resp_parse_len(p + 1, end, bulk, next);
+                if (r <= 0)
+                {
+                    return r < 0 ? ERROR : NEED_MORE;
+                }
+                if (bulk > bulk_limit)
+                {
+                    return ERROR;
+                }
+                pos = next - data;
+                st = BULK_DATA;
+                break;
+            }
+            case BULK_DATA:
+            {
+                if (len - pos < (size_t)bulk + 2)
+                {
+                    return NEED_MORE;
+                }
+                if (p[bulk] != '\r' || p[bulk + 1] != '\n')
+                {
+                    return ERROR;
+                }
+                list.push(pos, bulk);
+                pos += bulk + 2;
+                remaining--;
+                st = BULK_LEN;
+                break;
+            }
+            case INLINE:
+                return parse_inline(data, len);
+            }
+        }
+    }
+
+    const resp_args &args() const
+    {
+        return list;
+    }
+
+    size_t consumed() const
+    {
+        return used;
+    }
+
+    // 返回 NEED_MORE 后，当前命令至少需要的字节数(从命令起点算起)：等待 bulk 数据时为该 bulk 结束的位置，否则为已解析的长度
+    // 由 bulk 的长度可以预先得知较大参数的大小，调用方可据此一次分配好缓冲区，或在数据到达前拒绝过大的命令
+    size_t expected() const
+    {
+        return st == BULK_DATA ? pos + bulk + 2 : pos;
+    }
+};
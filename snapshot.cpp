@@ -0,0 +1,384 @@
+#pragma once
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <memory>
+#include <stdexcept>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// 快照文件格式，整数均为小端序
+// 文件头40字节: "PSNAP001", u64 保存时刻(unix毫秒), u32 分片序号, u32 分片数, u64 key数, u64 设置了过期时间的key数
+// 每个key: u8 类型(snapshot_type, 带 SNAPSHOT_EXPIRE 时其后为 i64 过期时刻), varint 长度 + key, 值为字符串时 varint 长度 + 内容，为整数时 i64
+// 值为集合时 varint 元素个数，之后每个元素为 varint 长度 + 内容；哈希为字段和值交替，有序集合为成员和8字节 double 分值交替，按分值排序
+// 结尾: u8 SNAPSHOT_EOF, u64 从文件头之后到 SNAPSHOT_EOF(含)的校验值
+enum snapshot_type : uint8_t
+{
+    SNAPSHOT_STRING = 0,
+    SNAPSHOT_INT = 1,
+    SNAPSHOT_HASH = 2,
+    SNAPSHOT_LIST = 3,
+    SNAPSHOT_ZSET = 4,
+    SNAPSHOT_EXPIRE = 0x80,
+    SNAPSHOT_EOF = 0xff,
+};
+
+struct snapshot_header
+{
+    uint64_t time = 0;
+    uint32_t shard = 0;
+    uint32_t shards = 1;
+    uint64_t keys = 0;
+    uint64_t expires = 0;
+};
+
+constexpr char snapshot_magic[8] = {'P', 'S', 'N', 'A', 'P', '0', '0', '1'};
+constexpr size_t snapshot_header_size = 40;
+
+// 每次处理8字节，比逐字节的 FNV 快数倍；只有最后一段可以不是8的倍数
+inline uint64_t snapshot_checksum(uint64_t h, const char *p, size_t n)
+{
+    for (; n >= 8; p += 8, n -= 8)
+    {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 0x9e3779b97f4a7c15ull;
+        h ^= h >> 32;
+    }
+    for (; n > 0; p++, n--)
+    {
+        h = (h ^ (uint8_t)*p) * 0x100000001b3ull;
+    }
+    return h;
+}
+constexpr uint64_t snapshot_seed = 0xcbf29ce484222325ull;
+
+// 写入 path 对应的临时文件，finish 时补写文件头、fsync 后改名，中途失败时删除临时文件，已有的快照不受影响
+class snapshot_writer
+{
+    static constexpr size_t buf_size = 1 << 20;
+
+    int fd = -1;
+    std::string path, tmp;
+    std::unique_ptr<char[]> buf{new char[buf_size]};
+    size_t len = 0;
+    uint64_t sum = snapshot_seed;
+    snapshot_header head;
+
+    // 除最后一次外每次写出整个缓冲区，校验值按8字节分段计算不受写出时机影响
+    void flush()
+    {
+        sum = snapshot_checksum(sum, buf.get(), len);
+        for (size_t off = 0; off < len;)
+        {
+            auto n = ::write(fd, buf.get() + off, len - off);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                throw std::runtime_error(strerror(errno));
+            }
+            off += n;
+        }
+        len = 0;
+    }
+
+    void put(const void *p, size_t n)
+    {
+        auto s = (const char *)p;
+        while (n > 0)
+        {
+            size_t k = std::min(n, buf_size - len);
+            memcpy(buf.get() + len, s, k);
+            len += k;
+            s += k;
+            n -= k;
+            if (len == buf_size)
+            {
+                flush();
+            }
+        }
+    }
+
+    void put_varint(uint64_t v)
+    {
+        uint8_t b[10];
+        size_t n = 0;
+        do
+        {
+            b[n++] = (v & 0x7f) | (v >= 0x80 ? 0x80 : 0);
+            v >>= 7;
+        } while (v);
+        put(b, n);
+    }
+
+    void put_head(uint8_t type, std::string_view key, int64_t expire)
+    {
+        type |= expire ? SNAPSHOT_EXPIRE : 0;
+        put(&type, 1);
+        if (expire)
+        {
+            put(&expire, 8);
+            head.expires++;
+        }
+        put_varint(key.size());
+        put(key.data(), key.size());
+        head.keys++;
+    }
+
+public:
+    snapshot_writer(std::string p, snapshot_header h) : path(std::move(p)), tmp(path + ".tmp"), head(h)
+    {
+        fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0 || lseek(fd, snapshot_header_size, SEEK_SET) < 0)
+        {
+            throw std::runtime_error(strerror(errno));
+        }
+    }
+    snapshot_writer(const snapshot_writer &) = delete;
+    snapshot_writer &operator=(const snapshot_writer &) = delete;
+    ~snapshot_writer()
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+            unlink(tmp.c_str());
+        }
+    }
+
+    // expire 为过期时刻，0 表示不过期
+    void add(std::string_view key, std::string_view value, int64_t expire)
+    {
+        put_head(SNAPSHOT_STRING, key, expire);
+        put_varint(value.size());
+        put(value.data(), value.size());
+    }
+
+    void add(std::string_view key, int64_t value, int64_t expire)
+    {
+        put_head(SNAPSHOT_INT, key, expire);
+        put(&value, 8);
+    }
+
+    // 集合的开头，之后调用 count 次 element 写入各元素
+    void add_collection(std::string_view key, snapshot_type type, uint64_t count, int64_t expire)
+    {
+        put_head(type, key, expire);
+        put_varint(count);
+    }
+
+    void element(std::string_view v)
+    {
+        put_varint(v.size());
+        put(v.data(), v.size());
+    }
+
+    void finish()
+    {
+        uint8_t eof = SNAPSHOT_EOF;
+        put(&eof, 1);
+        flush();
+        put(&sum, 8);
+        flush();
+        char h[snapshot_header_size];
+        memcpy(h, snapshot_magic, 8);
+        memcpy(h + 8, &head.time, 8);
+        memcpy(h + 16, &head.shard, 4);
+        memcpy(h + 20, &head.shards, 4);
+        memcpy(h + 24, &head.keys, 8);
+        memcpy(h + 32, &head.expires, 8);
+        if (pwrite(fd, h, sizeof(h), 0) != (ssize_t)sizeof(h) || fsync(fd) < 0 || close(fd) < 0)
+        {
+            throw std::runtime_error(strerror(errno));
+        }
+        fd = -1;
+        if (rename(tmp.c_str(), path.c_str()) < 0)
+        {
+            unlink(tmp.c_str());
+            throw std::runtime_error(strerror(errno));
+        }
+    }
+};
+
+// mmap 整个快照文件，先校验再逐个回调，损坏的文件不会加载一部分
+class snapshot_reader
+{
+    std::string path;
+    const char *base = nullptr;
+    size_t size = 0;
+
+    [[noreturn]] void corrupted() const
+    {
+        throw std::runtime_error("corrupted snapshot " + path);
+    }
+
+    uint64_t get_varint(const char *&p, const char *end) const
+    {
+        uint64_t v = 0;
+        for (int shift = 0; p < end && shift < 64; shift += 7)
+        {
+            uint8_t b = *p++;
+            v |= (uint64_t)(b & 0x7f) << shift;
+            if (!(b & 0x80))
+            {
+                return v;
+            }
+        }
+        corrupted();
+    }
+
+public:
+    snapshot_header header;
+
+    explicit snapshot_reader(std::string p) : path(std::move(p))
+    {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0)
+        {
+            throw std::runtime_error(path + ": " + strerror(errno));
+        }
+        size = st.st_size;
+        if (size < snapshot_header_size + 9)
+        {
+            close(fd);
+            corrupted();
+        }
+        auto m = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (m == MAP_FAILED)
+        {
+            throw std::runtime_error(path + ": " + strerror(errno));
+        }
+        base = (const char *)m;
+        madvise(m, size, MADV_SEQUENTIAL);
+        if (memcmp(base, snapshot_magic, 8) != 0)
+        {
+            munmap(m, size);
+            corrupted();
+        }
+        memcpy(&header.time, base + 8, 8);
+        memcpy(&header.shard, base + 16, 4);
+        memcpy(&header.shards, base + 20, 4);
+        memcpy(&header.keys, base + 24, 8);
+        memcpy(&header.expires, base + 32, 8);
+    }
+    snapshot_reader(const snapshot_reader &) = delete;
+    snapshot_reader &operator=(const snapshot_reader &) = delete;
+    ~snapshot_reader()
+    {
+        munmap((void *)base, size);
+    }
+
+    // fn(key, type, str, num, expire)，type 为 SNAPSHOT_STRING 时值为 str, 为 SNAPSHOT_INT 时值为 num, expire 为0表示不过期
+    // 为集合时 str 为编码后的全部元素，num 为元素个数，由 elements 逐个读取
+    // 回调中的 string_view 指向映射的文件，只在回调期间有效
+    template <typename F>
+    void load(F &&fn)
+    {
+        auto p = base + snapshot_header_size;
+        auto end = base + size - 8;
+        uint64_t sum;
+        memcpy(&sum, end, 8);
+        if (end[-1] != (char)SNAPSHOT_EOF || snapshot_checksum(snapshot_seed, p, end - p) != sum)
+        {
+            corrupted();
+        }
+        end--;
+        while (p < end)
+        {
+            uint8_t type = *p++;
+            int64_t expire = 0;
+            if (type & SNAPSHOT_EXPIRE)
+            {
+                if (end - p < 8)
+                {
+                    corrupted();
+                }
+                memcpy(&expire, p, 8);
+                p += 8;
+                type &= ~SNAPSHOT_EXPIRE;
+            }
+            auto klen = get_varint(p, end);
+            if ((uint64_t)(end - p) < klen)
+            {
+                corrupted();
+            }
+            std::string_view key(p, klen);
+            p += klen;
+            if (type == SNAPSHOT_STRING)
+            {
+                auto vlen = get_varint(p, end);
+                if ((uint64_t)(end - p) < vlen)
+                {
+                    corrupted();
+                }
+                fn(key, (snapshot_type)type, std::string_view(p, vlen), int64_t(0), expire);
+                p += vlen;
+            }
+            else if (type == SNAPSHOT_INT)
+            {
+                if (end - p < 8)
+                {
+                    corrupted();
+                }
+                int64_t v;
+                memcpy(&v, p, 8);
+                p += 8;
+                fn(key, (snapshot_type)type, std::string_view(), v, expire);
+            }
+            else if (type == SNAPSHOT_HASH || type == SNAPSHOT_LIST || type == SNAPSHOT_ZSET)
+            {
+                auto count = get_varint(p, end);
+                auto start = p;
+                for (uint64_t i = 0; i < count; i++)
+                {
+                    auto len = get_varint(p, end);
+                    if ((uint64_t)(end - p) < len || (type == SNAPSHOT_ZSET && i % 2 == 1 && len != 8))
+                    {
+                        corrupted();
+                    }
+                    p += len;
+                }
+                if ((type == SNAPSHOT_HASH || type == SNAPSHOT_ZSET) && count % 2 != 0)
+                {
+                    corrupted();
+                }
+                fn(key, (snapshot_type)type, std::string_view(start, p - start), (int64_t)count, expire);
+            }
+            else
+            {
+                corrupted();
+            }
+        }
+    }
+
+    // 依次读取 load 回调中集合的各元素 fn(v)，数据已在 load 中校验过
+    template <typename F>
+    static void elements(std::string_view data, F &&fn)
+    {
+        auto p = (const uint8_t *)data.data(), end = p + data.size();
+        while (p < end)
+        {
+            uint64_t len = 0;
+            for (int shift = 0;; shift += 7)
+            {
+                uint8_t b = *p++;
+                len |= (uint64_t)(b & 0x7f) << shift;
+                if (!(b & 0x80))
+                {
+                    break;
+                }
+            }
+            fn(std::string_view((const char *)p, len));
+            p += len;
+        }
+    }
+};
@@ -0,0 +1,263 @@
+#pragma once
+#include <algorithm>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+// 分层时间轮，精度1毫秒，4层每层64格，覆盖约4.6小时，更远的定时器先放在最高层，到期前重新分配
+// 添加和取消都是 O(1)，每个毫秒只需检查第0层的一格，每64毫秒把上一层的一格分散到下层
+// 只在单线程内使用，T 为回调类型，由 advance 的调用方执行
+template <typename T>
+class timer_wheel
+{
+    static constexpr int bits = 6;
+    static constexpr int slots = 1 << bits;
+    static constexpr int levels = 4;
+    static constexpr uint32_t nil = UINT32_MAX;
+    static constexpr uint32_t expired_list = levels * slots; // 本轮已到期、等待执行的定时器
+
+    struct node
+    {
+        uint64_t expire = 0;
+        uint32_t interval = 0; // 大于0时为周期定时器
+        uint32_t gen = 0;      // 节点复用后用于识别过期的 id
+        uint32_t prev = nil;
+        uint32_t next = nil;
+        uint32_t list = nil; // 所在的格，nil 表示空闲
+        T fn;
+    };
+
+    std::vector<node> nodes;
+    std::vector<uint32_t> free_nodes;
+    uint32_t heads[levels * slots + 1];
+    uint64_t masks[levels] = {}; // 每层非空的格
+    uint64_t current = 0;        // 下一个要处理的时刻，之前的时刻都已处理
+    size_t count = 0;
+
+    void link(uint32_t i, uint32_t list)
+    {
+        auto &n = nodes[i];
+        n.list = list;
+        n.prev = nil;
+        n.next = heads[list];
+        if (n.next != nil)
+        {
+            nodes[n.next].prev = i;
+        }
+        heads[list] = i;
+        if (list < expired_list)
+        {
+            masks[list / slots] |= 1ull << (list % slots);
+        }
+    }
+
+    void unlink(uint32_t i)
+    {
+        auto &n = nodes[i];
+        if (n.prev != nil)
+        {
+            nodes[n.prev].next = n.next;
+        }
+        else
+        {
+            heads[n.list] = n.next;
+            if (n.next == nil && n.list < expired_list)
+            {
+                masks[n.list / slots] &= ~(1ull << (n.list % slots));
+            }
+        }
+        if (n.next != nil)
+        {
+            nodes[n.next].prev = n.prev;
+        }
+        n.prev = n.next = n.list = nil;
+    }
+
+    // 按距离到期的时间放入对应层，已到期的放入当前格
+    void place(uint32_t i)
+    {
+        auto &n = nodes[i];
+        if (n.expire < current)
+        {
+            n.expire = current;
+        }
+        uint64_t delta = n.expire - current;
+        for (int level = 0; level < levels; level++)
+        {
+            if (delta < (1ull << (bits * (level + 1))) || level == levels - 1)
+            {
+                uint64_t t = delta < (1ull << (bits * (level + 1))) ? n.expire : current + (1ull << (bits * levels)) - 1;
+                link(i, level * slots + ((t >> (bits * level)) & (slots - 1)));
+                return;
+            }
+        }
+    }
+
+    void release(uint32_t i)
+    {
+        auto &n = nodes[i];
+        n.gen++;
+        n.fn = T();
+        free_nodes.push_back(i);
+        count--;
+    }
+
+    // 把上层的一格重新分配到下层
+    void cascade(int level)
+    {
+        uint32_t list = level * slots + ((current >> (bits * level)) & (slots - 1));
+        uint32_t i = heads[list];
+        heads[list] = nil;
+        masks[level] &= ~(1ull << (list % slots));
+        while (i != nil)
+        {
+            uint32_t next = nodes[i].next;
+            nodes[i].prev = nodes[i].next = nodes[i].list = nil;
+            place(i);
+            i = next;
+        }
+    }
+
+    static uint64_t id_of(uint32_t i, uint32_t gen)
+    {
+        return ((uint64_t)gen << 32) | i;
+    }
+
+public:
+    timer_wheel()
+    {
+        for (auto &h : heads)
+        {
+            h = nil;
+        }
+    }
+    timer_wheel(const timer_wheel &) = delete;
+    timer_wheel &operator=(const timer_wheel &) = delete;
+
+    // 设置起始时刻，需在添加定时器之前调用
+    void reset(uint64_t now)
+    {
+        current = now;
+    }
+
+    size_t size() const
+    {
+        return count;
+    }
+
+    // 下一个要处理的时刻，回调执行期间为其到期时刻+1
+    uint64_t time() const
+    {
+        return current;
+    }
+
+    // 在 expire 时刻到期，interval 大于0时到期后每隔 interval 毫秒重复，返回值用于取消，不会为0
+    uint64_t add(uint64_t expire, uint32_t interval, T fn)
+    {
+        uint32_t i;
+        if (!free_nodes.empty())
+        {
+            i = free_nodes.back();
+            free_nodes.pop_back();
+        }
+        else
+        {
+            i = nodes.size();
+            nodes.emplace_back();
+            nodes[i].gen = 1;
+        }
+        auto &n = nodes[i];
+        n.expire = expire;
+        n.interval = interval;
+        n.fn = std::move(fn);
+        count++;
+        place(i);
+        return id_of(i, n.gen);
+    }
+
+    // 取消尚未执行的定时器，周期定时器可在自身回调中取消；id 已失效时返回 false
+    bool cancel(uint64_t id)
+    {
+        uint32_t i = (uint32_t)id;
+        if (i >= nodes.size() || nodes[i].gen != (uint32_t)(id >> 32) || nodes[i].list == nil)
+        {
+            return false;
+        }
+        unlink(i);
+        release(i);
+        return true;
+    }
+
+    // 处理 now 及之前到期的定时器，对每个到期的定时器调用 run(fn)
+    // 回调中可以添加或取消定时器；周期定时器在执行前已重新加入，执行后恢复其回调
+    template <typename F>
+    void advance(uint64_t now, F &&run)
+    {
+        while (current <= now)
+        {
+            for (int level = 1; level < levels && (current & ((1ull << (bits * level)) - 1)) == 0; level++)
+            {
+                cascade(level);
+            }
+            uint32_t list = current & (slots - 1);
+            // 先整体移到到期列表，回调中取消同一格的其他定时器也是安全的
+            while (heads[list] != nil)
+            {
+                auto i = heads[list];
+                unlink(i);
+                link(i, expired_list);
+            }
+            current++;
+            while (heads[expired_list] != nil)
+            {
+                auto i = heads[expired_list];
+                unlink(i);
+                auto &n = nodes[i];
+                auto fn = std::move(n.fn);
+                auto gen = n.gen;
+                if (n.interval > 0)
+                {
+                    n.expire += n.interval;
+                    place(i);
+                }
+                else
+                {
+                    release(i);
+                }
+                run(fn);
+                if (nodes[i].gen == gen && nodes[i].list != nil)
+                {
+                    nodes[i].fn = std::move(fn);
+                }
+            }
+        }
+    }
+
+    // 距离下一次需要处理的时刻的毫秒数，没有定时器时返回 -1
+    // 上层的定时器以重新分配的时刻计算，可能早于实际到期时间，届时重新计算
+    int64_t next_timeout(uint64_t now) const
+    {
+        if (count == 0)
+        {
+            return -1;
+        }
+        uint64_t best = UINT64_MAX;
+        for (int level = 0; level < levels; level++)
+        {
+            if (!masks[level])
+            {
+                continue;
+            }
+            int shift = bits * level;
+            uint64_t base = current >> shift; // 本层当前格对应的时刻(以本层格为单位)
+            unsigned idx = base & (slots - 1);
+            // 第0层从当前格开始找，上层的当前格已经分配过，从下一格开始找
+            unsigned start = level == 0 ? idx : (idx + 1) & (slots - 1);
+            uint64_t rotated = (masks[level] >> start) | (start ? masks[level] << (slots - start) : 0);
+            unsigned k = __builtin_ctzll(rotated) + (level == 0 ? 0 : 1);
+            uint64_t t = (base + k) << shift;
+            best = std::min(best, t);
+        }
+        return best > now ? best - now : 0;
+    }
+};
@@ -0,0 +1,536 @@
+#pragma once
+#include "dict.cpp"
+#include <deque>
+#include <new>
+#include <optional>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string_view>
+
+// 紧凑编码的字符串序列，所有元素连续存放在一次分配的内存中：8字节头(数据字节数、元素个数)，每个元素为 varint 长度加内容
+// 小的哈希、列表、有序集合使用此编码，没有每个元素的指针和分配，遍历只需顺序读取一块内存；插入和删除需要移动其后的数据，只用于元素较少的集合
+// 元素以数据区内的偏移量定位，插入和删除后之前取得的偏移量和 string_view 失效
+class listpack
+{
+    struct header
+    {
+        uint32_t bytes;
+        uint32_t count;
+    };
+
+    char *mem = nullptr; // 没有元素时不分配
+
+    header &head() const
+    {
+        return *(header *)mem;
+    }
+    char *data() const
+    {
+        return mem + sizeof(header);
+    }
+
+    static size_t varint_size(uint64_t v)
+    {
+        size_t n = 1;
+        while (v >= 0x80)
+        {
+            v >>= 7;
+            n++;
+        }
+        return n;
+    }
+
+    static size_t put_varint(char *p, uint64_t v)
+    {
+        size_t n = 0;
+        do
+        {
+            p[n++] = (char)((v & 0x7f) | (v >= 0x80 ? 0x80 : 0));
+            v >>= 7;
+        } while (v);
+        return n;
+    }
+
+    // 数据区改为 n 字节，原有内容保留
+    void resize(size_t n)
+    {
+        auto p = (char *)realloc(mem, sizeof(header) + n);
+        if (!p)
+        {
+            throw std::bad_alloc();
+        }
+        if (!mem)
+        {
+            memset(p, 0, sizeof(header));
+        }
+        mem = p;
+    }
+
+public:
+    static constexpr size_t npos = SIZE_MAX;
+
+    listpack() = default;
+    listpack(listpack &&o) noexcept : mem(o.mem)
+    {
+        o.mem = nullptr;
+    }
+    listpack &operator=(listpack &&o) noexcept
+    {
+        if (this != &o)
+        {
+            free(mem);
+            mem = o.mem;
+            o.mem = nullptr;
+        }
+        return *this;
+    }
+    listpack(const listpack &) = delete;
+    listpack &operator=(const listpack &) = delete;
+    ~listpack()
+    {
+        free(mem);
+    }
+
+    size_t size() const
+    {
+        return mem ? head().count : 0;
+    }
+    bool empty() const
+    {
+        return size() == 0;
+    }
+    // 数据区的字节数，即第一个元素之后的偏移量上限
+    size_t bytes() const
+    {
+        return mem ? head().bytes : 0;
+    }
+
+    // 读取偏移量 off 处的元素，off 移到下一个元素
+    std::string_view next(size_t &off) const
+    {
+        auto p = (const uint8_t *)data() + off;
+        uint64_t len = 0;
+        int shift = 0;
+        for (;; shift += 7)
+        {
+            uint8_t b = *p++;
+            len |= (uint64_t)(b & 0x7f) << shift;
+            if (!(b & 0x80))
+            {
+                break;
+            }
+        }
+        std::string_view v((const char *)p, len);
+        off = (const char *)p + len - data();
+        return v;
+    }
+
+    // 每 step 个元素为一组，查找第一个元素等于 v 的组，返回其偏移量，不存在时返回 npos
+    // 哈希以字段和值交替保存，查找字段时 step 为2
+    size_t find(std::string_view v, size_t step = 1) const
+    {
+        for (size_t off = 0, end = bytes(); off < end;)
+        {
+            size_t at = off;
+            if (next(off) == v)
+            {
+                return at;
+            }
+            for (size_t i = 1; i < step && off < end; i++)
+            {
+                next(off);
+            }
+        }
+        return npos;
+    }
+
+    // 在偏移量 off 处插入元素，返回插入的元素之后的偏移量；v 不能引用本对象的数据
+    size_t insert(size_t off, std::string_view v)
+    {
+        size_t old = bytes(), n = varint_size(v.size()) + v.size();
+        if (old + n > UINT32_MAX)
+        {
+            throw std::length_error("listpack too large");
+        }
+        resize(old + n);
+        memmove(data() + off + n, data() + off, old - off);
+        size_t k = put_varint(data() + off, v.size());
+        memcpy(data() + off + k, v.data(), v.size());
+        head().bytes = old + n;
+        head().count++;
+        return off + n;
+    }
+
+    // 删除偏移量 off 开始的 n 个元素，删除全部元素后释放内存
+    void erase(size_t off, size_t n = 1)
+    {
+        size_t end = off;
+        for (size_t i = 0; i < n; i++)
+        {
+            next(end);
+        }
+        size_t old = bytes();
+        memmove(data() + off, data() + end, old - end);
+        head().bytes = old - (end - off);
+        head().count -= n;
+        if (head().count == 0)
+        {
+            free(mem);
+            mem = nullptr;
+        }
+    }
+
+    void push_back(std::string_view v)
+    {
+        insert(bytes(), v);
+    }
+    void push_front(std::string_view v)
+    {
+        insert(0, v);
+    }
+};
+
+// 元素较多的列表：以 listpack 为段的双端队列，每段不超过 chunk_bytes, 两端插入和删除只修改端部的一段
+class quicklist
+{
+    std::deque<listpack> chunks;
+    size_t count = 0;
+
+public:
+    static constexpr size_t chunk_bytes = 8 << 10;
+
+    size_t size() const
+    {
+        return count;
+    }
+    size_t chunk_count() const
+    {
+        return chunks.size();
+    }
+
+    void push_front(std::string_view v)
+    {
+        if (chunks.empty() || chunks.front().bytes() + v.size() > chunk_bytes)
+        {
+            chunks.emplace_front();
+        }
+        chunks.front().push_front(v);
+        count++;
+    }
+
+    void push_back(std::string_view v)
+    {
+        if (chunks.empty() || chunks.back().bytes() + v.size() > chunk_bytes)
+        {
+            chunks.emplace_back();
+        }
+        chunks.back().push_back(v);
+        count++;
+    }
+
+    // 删除第一个元素，删除前以其内容调用 fn(v)，列表为空时返回 false
+    template <typename F>
+    bool pop_front(F &&fn)
+    {
+        if (count == 0)
+        {
+            return false;
+        }
+        size_t off = 0;
+        fn(chunks.front().next(off));
+        chunks.front().erase(0);
+        if (chunks.front().empty())
+        {
+            chunks.pop_front();
+        }
+        count--;
+        return true;
+    }
+
+    // 从第 start 个元素开始依次对 n 个元素调用 fn(v)，跳过的段只读取元素个数
+    template <typename F>
+    void range(size_t start, size_t n, F &&fn) const
+    {
+        for (auto &c : chunks)
+        {
+            if (n == 0)
+            {
+                return;
+            }
+            if (start >= c.size())
+            {
+                start -= c.size();
+                continue;
+            }
+            size_t off = 0;
+            for (size_t i = 0; i < start; i++)
+            {
+                c.next(off);
+            }
+            for (size_t i = start; i < c.size() && n > 0; i++, n--)
+            {
+                fn(c.next(off));
+            }
+            start = 0;
+        }
+    }
+};
+
+// 按 (分值, 成员) 排序的跳表，每层记录到下一个节点跨过的元素个数(span)，按排名定位为 O(log n)
+class zskiplist
+{
+    static constexpr int max_level = 32;
+
+    struct node
+    {
+        double score;
+        small_string member;
+        node *backward;
+        struct
+        {
+            node *forward;
+            size_t span;
+        } level[];
+    };
+
+    node *header;
+    node *tail = nullptr;
+    size_t length = 0;
+    int level = 1;
+    uint64_t seed = 0x2545f4914f6cdd1dull;
+
+    static node *create(int n, double score, std::string_view member)
+    {
+        auto x = (node *)malloc(sizeof(node) + n * sizeof(node::level[0]));
+        if (!x)
+        {
+            throw std::bad_alloc();
+        }
+        x->score = score;
+        new (&x->member) small_string(member);
+        x->backward = nullptr;
+        for (int i = 0; i < n; i++)
+        {
+            x->level[i].forward = nullptr;
+            x->level[i].span = 0;
+        }
+        return x;
+    }
+
+    static void destroy(node *x)
+    {
+        x->member.~small_string();
+        free(x);
+    }
+
+    static bool less(const node *x, double score, std::string_view member)
+    {
+        return x->score < score || (x->score == score && x->member.view() < member);
+    }
+
+    // 每升高一层的概率为1/4
+    int random_level()
+    {
+        int n = 1;
+        for (;;)
+        {
+            seed ^= seed << 13;
+            seed ^= seed >> 7;
+            seed ^= seed << 17;
+            if ((seed & 3) != 0 || n == max_level)
+            {
+                return n;
+            }
+            n++;
+        }
+    }
+
+public:
+    zskiplist() : header(create(max_level, 0, {}))
+    {
+    }
+    zskiplist(const zskiplist &) = delete;
+    zskiplist &operator=(const zskiplist &) = delete;
+    ~zskiplist()
+    {
+        for (auto x = header; x;)
+        {
+            auto next = x->level[0].forward;
+            destroy(x);
+            x = next;
+        }
+    }
+
+    size_t size() const
+    {
+        return length;
+    }
+
+    // 插入新成员，调用方保证成员不存在
+    void insert(double score, std::string_view member)
+    {
+        node *update[max_level];
+        size_t rank[max_level];
+        auto x = header;
+        for (int i = level - 1; i >= 0; i--)
+        {
+            rank[i] = i == level - 1 ? 0 : rank[i + 1];
+            while (x->level[i].forward && less(x->level[i].forward, score, member))
+            {
+                rank[i] += x->level[i].span;
+                x = x->level[i].forward;
+            }
+            update[i] = x;
+        }
+        int n = random_level();
+        if (n > level)
+        {
+            for (int i = level; i < n; i++)
+            {
+                rank[i] = 0;
+                update[i] = header;
+                header->level[i].span = length;
+            }
+            level = n;
+        }
+        x = create(n, score, member);
+        for (int i = 0; i < n; i++)
+        {
+            x->level[i].forward = update[i]->level[i].forward;
+            update[i]->level[i].forward = x;
+            x->level[i].span = update[i]->level[i].span - (rank[0] - rank[i]);
+            update[i]->level[i].span = rank[0] - rank[i] + 1;
+        }
+        for (int i = n; i < level; i++)
+        {
+            update[i]->level[i].span++;
+        }
+        x->backward = update[0] == header ? nullptr : update[0];
+        if (x->level[0].forward)
+        {
+            x->level[0].forward->backward = x;
+        }
+        else
+        {
+            tail = x;
+        }
+        length++;
+    }
+
+    // 删除分值为 score 的成员，不存在时返回 false
+    bool erase(double score, std::string_view member)
+    {
+        node *update[max_level];
+        auto x = header;
+        for (int i = level - 1; i >= 0; i--)
+        {
+            while (x->level[i].forward && less(x->level[i].forward, score, member))
+            {
+                x = x->level[i].forward;
+            }
+            update[i] = x;
+        }
+        x = x->level[0].forward;
+        if (!x || x->score != score || x->member.view() != member)
+        {
+            return false;
+        }
+        for (int i = 0; i < level; i++)
+        {
+            if (update[i]->level[i].forward == x)
+            {
+                update[i]->level[i].span += x->level[i].span - 1;
+                update[i]->level[i].forward = x->level[i].forward;
+            }
+            else
+            {
+                update[i]->level[i].span--;
+            }
+        }
+        if (x->level[0].forward)
+        {
+            x->level[0].forward->backward = x->backward;
+        }
+        else
+        {
+            tail = x->backward;
+        }
+        while (level > 1 && !header->level[level - 1].forward)
+        {
+            level--;
+        }
+        length--;
+        destroy(x);
+        return true;
+    }
+
+    // 从排名 start(从0开始)的成员开始依次对 n 个成员调用 fn(member, score)
+    template <typename F>
+    void range(size_t start, size_t n, F &&fn) const
+    {
+        if (start >= length)
+        {
+            return;
+        }
+        size_t traversed = 0;
+        auto x = header;
+        for (int i = level - 1; i >= 0; i--)
+        {
+            while (x->level[i].forward && traversed + x->level[i].span <= start + 1)
+            {
+                traversed += x->level[i].span;
+                x = x->level[i].forward;
+            }
+        }
+        for (; x && n > 0; x = x->level[0].forward, n--)
+        {
+            fn(x->member.view(), x->score);
+        }
+    }
+};
+
+// 元素较多的有序集合：成员到分值的哈希表用于按成员查找，跳表用于按分值和排名遍历，成员在两者中各保存一份
+class sorted_set
+{
+    dict<double> scores;
+    zskiplist order;
+
+public:
+    size_t size() const
+    {
+        return order.size();
+    }
+
+    std::optional<double> score(std::string_view member)
+    {
+        if (auto s = scores.find(member))
+        {
+            return *s;
+        }
+        return std::nullopt;
+    }
+
+    // 添加成员或更新分值，新增时返回 true; 分值改变时从跳表中移除后按新分值重新插入
+    bool add(std::string_view member, double score)
+    {
+        auto [s, added] = scores.insert(member);
+        if (!added)
+        {
+            if (*s == score)
+            {
+                return false;
+            }
+            order.erase(*s, member);
+        }
+        *s = score;
+        order.insert(score, member);
+        return added;
+    }
+
+    template <typename F>
+    void range(size_t start, size_t n, F &&fn) const
+    {
+        order.range(start, n, fn);
+    }
+};
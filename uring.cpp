@@ -0,0 +1,306 @@
+#pragma once
+#include <algorithm>
+#include <errno.h>
+#include <initializer_list>
+#include <linux/io_uring.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// io_uring 的最小封装，直接使用系统调用，不依赖 liburing
+// 只在单线程内使用：sqe 的填充、提交以及 cqe 的消费都由事件循环线程完成
+class uring
+{
+    int ring_fd = -1;
+    unsigned features = 0;
+
+    unsigned *sq_head = nullptr;
+    unsigned *sq_tail = nullptr;
+    unsigned *sq_mask = nullptr;
+    unsigned sq_entries = 0;
+    unsigned sqe_tail = 0; // 已填充但可能尚未提交给内核的 sqe 尾部
+    io_uring_sqe *sqes = nullptr;
+
+    unsigned *cq_head = nullptr;
+    unsigned *cq_tail = nullptr;
+    unsigned *cq_mask = nullptr;
+    io_uring_cqe *cqes = nullptr;
+
+    void *sq_ptr = MAP_FAILED;
+    void *cq_ptr = MAP_FAILED;
+    size_t sq_size = 0;
+    size_t cq_size = 0;
+    size_t sqes_size = 0;
+
+    // 内核提供的接收缓冲区(provided buffer ring), 用于 multishot recv
+    // 头文件中的 io_uring_buf_ring::bufs 在 C++ 下偏移不为0, 因此直接按 io_uring_buf 数组访问, 尾指针与 bufs[0].resv 重叠
+    io_uring_buf *br = nullptr;
+    char *br_data = nullptr;
+    unsigned br_entries = 0;
+    unsigned br_size = 0;
+    size_t br_ring_size = 0;
+
+    int enter(unsigned to_submit, unsigned wait_nr, unsigned flags, void *arg, size_t argsz)
+    {
+        int ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, wait_nr, flags, arg, argsz);
+        return ret < 0 ? -errno : ret;
+    }
+
+    unsigned publish()
+    {
+        __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+        return sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    }
+
+public:
+    uring() = default;
+    uring(const uring &) = delete;
+    uring &operator=(const uring &) = delete;
+    ~uring()
+    {
+        exit();
+    }
+
+    // 创建 ring, 优先使用 SINGLE_ISSUER|DEFER_TASKRUN 减少内核任务调度, 旧内核不支持时逐级去除
+    // 返回 false 代表当前内核或运行环境(如 seccomp)不可用 io_uring
+    bool init(unsigned entries)
+    {
+        const unsigned setup_flags[] = {IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN, IORING_SETUP_COOP_TASKRUN, 0};
+        io_uring_params p;
+        for (auto flags : setup_flags)
+        {
+            memset(&p, 0, sizeof(p));
+            p.flags = flags | IORING_SETUP_CQSIZE;
+            p.cq_entries = entries * 4; // multishot 会为一个 sqe 产生多个 cqe
+            ring_fd = syscall(__NR_io_uring_setup, entries, &p);
+            if (ring_fd >= 0 || errno != EINVAL)
+            {
+                break;
+            }
+        }
+        if (ring_fd < 0)
+        {
+            return false;
+        }
+        features = p.features;
+        sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap)
+        {
+            sq_size = cq_size = std::max(sq_size, cq_size);
+        }
+        sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED)
+        {
+            exit();
+            return false;
+        }
+        cq_ptr = single_mmap ? sq_ptr : mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED)
+        {
+            exit();
+            return false;
+        }
+        sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+        void *sqe_ptr = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (sqe_ptr == MAP_FAILED)
+        {
+            exit();
+            return false;
+        }
+        sqes = (io_uring_sqe *)sqe_ptr;
+        auto sq = (char *)sq_ptr;
+        sq_head = (unsigned *)(sq + p.sq_off.head);
+        sq_tail = (unsigned *)(sq + p.sq_off.tail);
+        sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+        sq_entries = p.sq_entries;
+        sqe_tail = *sq_tail;
+        auto sq_array = (unsigned *)(sq + p.sq_off.array);
+        for (unsigned i = 0; i < sq_entries; i++)
+        {
+            sq_array[i] = i; // sqe 与 sq 数组一一对应
+        }
+        auto cq = (char *)cq_ptr;
+        cq_head = (unsigned *)(cq + p.cq_off.head);
+        cq_tail = (unsigned *)(cq + p.cq_off.tail);
+        cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+        cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+        return true;
+    }
+
+    void exit()
+    {
+        if (br)
+        {
+            munmap(br, br_ring_size);
+            br = nullptr;
+            delete[] br_data;
+            br_data = nullptr;
+        }
+        if (sqes)
+        {
+            munmap(sqes, sqes_size);
+            sqes = nullptr;
+        }
+        if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+        {
+            munmap(cq_ptr, cq_size);
+        }
+        if (sq_ptr != MAP_FAILED)
+        {
+            munmap(sq_ptr, sq_size);
+        }
+        sq_ptr = cq_ptr = MAP_FAILED;
+        if (ring_fd >= 0)
+        {
+            close(ring_fd);
+            ring_fd = -1;
+        }
+    }
+
+    bool has_feature(unsigned f) const
+    {
+        return features & f;
+    }
+
+    // 检查内核是否支持全部指定的操作码
+    bool probe(std::initializer_list<int> ops)
+    {
+        constexpr int n = 256;
+        auto size = sizeof(io_uring_probe) + n * sizeof(io_uring_probe_op);
+        auto p = (io_uring_probe *)calloc(1, size);
+        if (!p)
+        {
+            return false;
+        }
+        bool ok = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, p, n) == 0;
+        for (auto op : ops)
+        {
+            if (!ok || op > p->last_op || !(p->ops[op].flags & IO_URING_OP_SUPPORTED))
+            {
+                ok = false;
+                break;
+            }
+        }
+        free(p);
+        return ok;
+    }
+
+    // 注册 entries 个大小为 size 的接收缓冲区，entries 必须为2的幂
+    bool setup_buf_ring(unsigned short bgid, unsigned entries, unsigned size)
+    {
+        br_ring_size = entries * sizeof(io_uring_buf);
+        void *ptr = mmap(nullptr, br_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED)
+        {
+            return false;
+        }
+        io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uint64_t)ptr;
+        reg.ring_entries = entries;
+        reg.bgid = bgid;
+        if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+        {
+            munmap(ptr, br_ring_size);
+            return false;
+        }
+        br = (io_uring_buf *)ptr;
+        br_entries = entries;
+        br_size = size;
+        br_data = new char[(size_t)entries * size];
+        br[0].resv = 0;
+        for (unsigned i = 0; i < entries; i++)
+        {
+            recycle_buf(i);
+        }
+        return true;
+    }
+
+    char *buf(unsigned bid) const
+    {
+        return br_data + (size_t)bid * br_size;
+    }
+
+    // 数据处理完毕后，把缓冲区归还给内核
+    void recycle_buf(unsigned bid)
+    {
+        auto tail = br[0].resv;
+        auto &b = br[tail & (br_entries - 1)];
+        b.addr = (uint64_t)buf(bid);
+        b.len = br_size;
+        b.bid = bid;
+        __atomic_store_n(&br[0].resv, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+    }
+
+    // 获取一个空闲 sqe, 队列满时先提交已填充的部分
+    io_uring_sqe *get_sqe()
+    {
+        if (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+        {
+            if (submit() < 0 || sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+            {
+                return nullptr;
+            }
+        }
+        auto sqe = &sqes[sqe_tail & *sq_mask];
+        sqe_tail++;
+        memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    // 只提交不等待，取消等需要立即生效的请求使用
+    int submit()
+    {
+        return enter(publish(), 0, 0, nullptr, 0);
+    }
+
+    // 提交所有 sqe 并等待至少 wait_nr 个完成事件，最长等待 timeout_ms 毫秒
+    // 返回值 <0 为 -errno, 超时返回 -ETIME
+    int submit_and_wait(unsigned wait_nr, int timeout_ms)
+    {
+        unsigned flags = IORING_ENTER_GETEVENTS;
+        io_uring_getevents_arg arg;
+        __kernel_timespec ts;
+        void *argp = nullptr;
+        size_t argsz = 0;
+        if (wait_nr > 0 && timeout_ms >= 0)
+        {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+            memset(&arg, 0, sizeof(arg));
+            arg.sigmask_sz = _NSIG / 8;
+            arg.ts = (uint64_t)&ts;
+            argp = &arg;
+            argsz = sizeof(arg);
+            flags |= IORING_ENTER_EXT_ARG;
+        }
+        return enter(publish(), wait_nr, flags, argp, argsz);
+    }
+
+    unsigned cq_ready() const
+    {
+        return __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE) - *cq_head;
+    }
+
+    // 逐个消费完成事件，回调中可以继续获取 sqe 或提交
+    template <typename F>
+    unsigned for_each_cqe(F &&fn)
+    {
+        unsigned n = 0;
+        unsigned head = *cq_head;
+        while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+        {
+            io_uring_cqe cqe = cqes[head & *cq_mask];
+            __atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE);
+            fn(cqe);
+            n++;
+        }
+        return n;
+    }
+};
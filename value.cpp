@@ -0,0 +1,536 @@
+#pragma once
+#include "dict.cpp"
+#include "types.cpp"
+#include <charconv>
+#include <optional>
+#include <stdint.h>
+#include <string.h>
+#include <string_view>
+
+enum class value_type
+{
+    STRING,
+    HASH,
+    LIST,
+    ZSET,
+};
+
+// db 中的值，与 small_string 一样为16字节：字符串、int64 整数或集合
+// 整数和集合使用 small_string 未用到的标记值区分；写入的字符串是整数的规范写法(如计数器)时以整数保存，INCR 直接加减，GET 时再格式化
+// 集合元素较少且都不长时以 listpack 保存，一个集合只有一次分配；超过 pack_entries 个元素或有元素超过 pack_value 字节时
+// 哈希转换为 dict, 列表转换为 quicklist, 有序集合转换为跳表加哈希表，之后不再转换回来
+class db_value
+{
+    static constexpr uint8_t int_tag = 0x81;
+    static constexpr uint8_t hash_pack_tag = 0x82;  // 字段和值交替
+    static constexpr uint8_t hash_table_tag = 0x83; // dict<small_string>
+    static constexpr uint8_t list_pack_tag = 0x84;
+    static constexpr uint8_t list_chunks_tag = 0x85; // quicklist
+    static constexpr uint8_t zset_pack_tag = 0x86;   // 按 (分值, 成员) 排序，成员和8字节分值交替
+    static constexpr uint8_t zset_index_tag = 0x87;  // sorted_set
+
+    union
+    {
+        small_string str;
+        struct
+        {
+            int64_t num;
+            uint8_t pad[7];
+            uint8_t tag;
+        } integer;
+        struct
+        {
+            listpack pack;
+            uint8_t pad[7];
+            uint8_t tag;
+        } packed;
+        struct
+        {
+            void *ptr;
+            uint8_t pad[7];
+            uint8_t tag;
+        } object;
+    };
+
+    uint8_t tag() const
+    {
+        return reinterpret_cast<const uint8_t *>(this)[15];
+    }
+
+    void destroy()
+    {
+        switch (tag())
+        {
+        case int_tag:
+            break;
+        case hash_pack_tag:
+        case list_pack_tag:
+        case zset_pack_tag:
+            packed.pack.~listpack();
+            break;
+        case hash_table_tag:
+            delete (dict<small_string> *)object.ptr;
+            break;
+        case list_chunks_tag:
+            delete (quicklist *)object.ptr;
+            break;
+        case zset_index_tag:
+            delete (sorted_set *)object.ptr;
+            break;
+        default:
+            str.~small_string();
+        }
+    }
+
+    // 释放原有的值，变为空字符串
+    void reset()
+    {
+        destroy();
+        new (&str) small_string();
+    }
+
+    void set_object(void *p, uint8_t t)
+    {
+        destroy();
+        object.ptr = p;
+        object.tag = t;
+    }
+
+    static std::string_view encode_score(double score, char (&buf)[8])
+    {
+        memcpy(buf, &score, 8);
+        return {buf, 8};
+    }
+
+    static double decode_score(std::string_view v)
+    {
+        double score;
+        memcpy(&score, v.data(), 8);
+        return score;
+    }
+
+    void hash_convert()
+    {
+        auto table = new dict<small_string>();
+        auto &lp = packed.pack;
+        table->reserve(lp.size() / 2);
+        for (size_t off = 0; off < lp.bytes();)
+        {
+            auto field = lp.next(off);
+            table->insert(field).first->assign(lp.next(off));
+        }
+        set_object(table, hash_table_tag);
+    }
+
+    void list_convert()
+    {
+        auto list = new quicklist();
+        auto &lp = packed.pack;
+        for (size_t off = 0; off < lp.bytes();)
+        {
+            list->push_back(lp.next(off));
+        }
+        set_object(list, list_chunks_tag);
+    }
+
+    void zset_convert()
+    {
+        auto zs = new sorted_set();
+        auto &lp = packed.pack;
+        for (size_t off = 0; off < lp.bytes();)
+        {
+            auto member = lp.next(off);
+            zs->add(member, decode_score(lp.next(off)));
+        }
+        set_object(zs, zset_index_tag);
+    }
+
+    // 与 to_chars 格式化的结果相同才以整数保存，保证 GET 返回的内容与写入的一致
+    static std::optional<int64_t> canonical_int(std::string_view s)
+    {
+        if (s.empty() || s.size() > 20 || (s[0] == '0' && s.size() > 1) || (s[0] == '-' && (s.size() == 1 || s[1] == '0')))
+        {
+            return std::nullopt;
+        }
+        int64_t v;
+        auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), v);
+        if (ec != std::errc() || end != s.data() + s.size())
+        {
+            return std::nullopt;
+        }
+        return v;
+    }
+
+public:
+    db_value()
+    {
+        new (&str) small_string();
+    }
+    db_value(db_value &&o) noexcept
+    {
+        memcpy((void *)this, (const void *)&o, sizeof(*this));
+        new (&o.str) small_string();
+    }
+    db_value &operator=(db_value &&o) noexcept
+    {
+        if (this != &o)
+        {
+            this->~db_value();
+            memcpy((void *)this, (const void *)&o, sizeof(*this));
+            new (&o.str) small_string();
+        }
+        return *this;
+    }
+    db_value(const db_value &) = delete;
+    db_value &operator=(const db_value &) = delete;
+    ~db_value()
+    {
+        destroy();
+    }
+
+    static constexpr size_t pack_entries = 128;
+    static constexpr size_t pack_value = 64;
+
+    value_type type() const
+    {
+        switch (tag())
+        {
+        case hash_pack_tag:
+        case hash_table_tag:
+            return value_type::HASH;
+        case list_pack_tag:
+        case list_chunks_tag:
+            return value_type::LIST;
+        case zset_pack_tag:
+        case zset_index_tag:
+            return value_type::ZSET;
+        default:
+            return value_type::STRING;
+        }
+    }
+
+    // 改为 t 类型的空集合，原有的值被释放；新集合以 listpack 保存
+    void make(value_type t)
+    {
+        destroy();
+        new (&packed.pack) listpack();
+        packed.tag = t == value_type::HASH ? hash_pack_tag : t == value_type::LIST ? list_pack_tag : zset_pack_tag;
+    }
+
+    // 集合的元素个数(哈希为字段数)
+    size_t length() const
+    {
+        switch (tag())
+        {
+        case hash_pack_tag:
+        case zset_pack_tag:
+            return packed.pack.size() / 2;
+        case list_pack_tag:
+            return packed.pack.size();
+        case hash_table_tag:
+            return ((dict<small_string> *)object.ptr)->size();
+        case list_chunks_tag:
+            return ((quicklist *)object.ptr)->size();
+        case zset_index_tag:
+            return ((sorted_set *)object.ptr)->size();
+        default:
+            return 0;
+        }
+    }
+
+    // 释放此值需要的 free 次数的估计：listpack 和字符串只有一次，哈希和有序集合每个元素一次，quicklist 每段一次
+    size_t free_effort() const
+    {
+        switch (tag())
+        {
+        case hash_table_tag:
+        case zset_index_tag:
+            return length();
+        case list_chunks_tag:
+            return ((quicklist *)object.ptr)->chunk_count();
+        default:
+            return 1;
+        }
+    }
+
+    // 以下为哈希的操作，调用方保证类型为 HASH；返回的 string_view 在下一次修改前有效
+    std::optional<std::string_view> hash_get(std::string_view field)
+    {
+        if (tag() == hash_table_tag)
+        {
+            auto v = ((dict<small_string> *)object.ptr)->find(field);
+            return v ? std::optional<std::string_view>(v->view()) : std::nullopt;
+        }
+        auto &lp = packed.pack;
+        auto off = lp.find(field, 2);
+        if (off == listpack::npos)
+        {
+            return std::nullopt;
+        }
+        lp.next(off);
+        return lp.next(off);
+    }
+
+    // 设置字段的值，新增字段时返回 true
+    bool hash_set(std::string_view field, std::string_view value)
+    {
+        if (tag() == hash_pack_tag && (field.size() > pack_value || value.size() > pack_value))
+        {
+            hash_convert();
+        }
+        if (tag() == hash_table_tag)
+        {
+            auto [v, added] = ((dict<small_string> *)object.ptr)->insert(field);
+            v->assign(value);
+            return added;
+        }
+        auto &lp = packed.pack;
+        auto off = lp.find(field, 2);
+        if (off != listpack::npos)
+        {
+            lp.next(off);
+            lp.erase(off);
+            lp.insert(off, value);
+            return false;
+        }
+        lp.push_back(field);
+        lp.push_back(value);
+        if (lp.size() / 2 > pack_entries)
+        {
+            hash_convert();
+        }
+        return true;
+    }
+
+    bool hash_del(std::string_view field)
+    {
+        if (tag() == hash_table_tag)
+        {
+            return ((dict<small_string> *)object.ptr)->erase(field);
+        }
+        auto &lp = packed.pack;
+        auto off = lp.find(field, 2);
+        if (off == listpack::npos)
+        {
+            return false;
+        }
+        lp.erase(off, 2);
+        return true;
+    }
+
+    // fn(field, value)，fn 中不能修改本哈希
+    template <typename F>
+    void hash_for_each(F &&fn)
+    {
+        if (tag() == hash_table_tag)
+        {
+            ((dict<small_string> *)object.ptr)->for_each([&](std::string_view field, small_string &v)
+                                                         { fn(field, v.view()); });
+            return;
+        }
+        auto &lp = packed.pack;
+        for (size_t off = 0; off < lp.bytes();)
+        {
+            auto field = lp.next(off);
+            fn(field, lp.next(off));
+        }
+    }
+
+    // 以下为列表的操作，调用方保证类型为 LIST
+    void list_push(std::string_view v, bool front)
+    {
+        if (tag() == list_pack_tag && (v.size() > pack_value || packed.pack.size() >= pack_entries))
+        {
+            list_convert();
+        }
+        if (tag() == list_chunks_tag)
+        {
+            auto list = (quicklist *)object.ptr;
+            front ? list->push_front(v) : list->push_back(v);
+            return;
+        }
+        front ? packed.pack.push_front(v) : packed.pack.push_back(v);
+    }
+
+    // 删除第一个元素，删除前以其内容调用 fn(v)，列表为空时返回 false
+    template <typename F>
+    bool list_pop_front(F &&fn)
+    {
+        if (tag() == list_chunks_tag)
+        {
+            return ((quicklist *)object.ptr)->pop_front(fn);
+        }
+        auto &lp = packed.pack;
+        if (lp.empty())
+        {
+            return false;
+        }
+        size_t off = 0;
+        fn(lp.next(off));
+        lp.erase(0);
+        return true;
+    }
+
+    // 从第 start 个元素开始依次对 n 个元素调用 fn(v)
+    template <typename F>
+    void list_range(size_t start, size_t n, F &&fn)
+    {
+        if (tag() == list_chunks_tag)
+        {
+            ((quicklist *)object.ptr)->range(start, n, fn);
+            return;
+        }
+        auto &lp = packed.pack;
+        size_t off = 0;
+        for (size_t i = 0; i < start && off < lp.bytes(); i++)
+        {
+            lp.next(off);
+        }
+        for (; n > 0 && off < lp.bytes(); n--)
+        {
+            fn(lp.next(off));
+        }
+    }
+
+    // 以下为有序集合的操作，调用方保证类型为 ZSET
+    std::optional<double> zset_score(std::string_view member)
+    {
+        if (tag() == zset_index_tag)
+        {
+            return ((sorted_set *)object.ptr)->score(member);
+        }
+        auto &lp = packed.pack;
+        auto off = lp.find(member, 2);
+        if (off == listpack::npos)
+        {
+            return std::nullopt;
+        }
+        lp.next(off);
+        return decode_score(lp.next(off));
+    }
+
+    // 添加成员或更新分值，新增时返回 true; listpack 编码下分值改变时删除后按新分值插入到有序的位置
+    bool zset_add(std::string_view member, double score)
+    {
+        if (tag() == zset_pack_tag && member.size() > pack_value)
+        {
+            zset_convert();
+        }
+        if (tag() == zset_index_tag)
+        {
+            return ((sorted_set *)object.ptr)->add(member, score);
+        }
+        auto &lp = packed.pack;
+        bool added = true;
+        if (auto off = lp.find(member, 2); off != listpack::npos)
+        {
+            size_t s = off;
+            lp.next(s);
+            if (decode_score(lp.next(s)) == score)
+            {
+                return false;
+            }
+            lp.erase(off, 2);
+            added = false;
+        }
+        size_t off = 0;
+        while (off < lp.bytes())
+        {
+            size_t s = off;
+            auto m = lp.next(s);
+            auto v = decode_score(lp.next(s));
+            if (v > score || (v == score && m > member))
+            {
+                break;
+            }
+            off = s;
+        }
+        char buf[8];
+        off = lp.insert(off, member);
+        lp.insert(off, encode_score(score, buf));
+        if (lp.size() / 2 > pack_entries)
+        {
+            zset_convert();
+        }
+        return added;
+    }
+
+    // 从排名 start 开始依次对 n 个成员调用 fn(member, score)
+    template <typename F>
+    void zset_range(size_t start, size_t n, F &&fn)
+    {
+        if (tag() == zset_index_tag)
+        {
+            ((sorted_set *)object.ptr)->range(start, n, fn);
+            return;
+        }
+        auto &lp = packed.pack;
+        size_t off = 0;
+        for (size_t i = 0; i < start && off < lp.bytes(); i++)
+        {
+            lp.next(off);
+            lp.next(off);
+        }
+        for (; n > 0 && off < lp.bytes(); n--)
+        {
+            auto member = lp.next(off);
+            fn(member, decode_score(lp.next(off)));
+        }
+    }
+
+    bool is_int() const
+    {
+        return reinterpret_cast<const uint8_t *>(this)[15] == int_tag;
+    }
+
+    // 设为字符串，原有的值为集合时释放
+    void assign(std::string_view s)
+    {
+        if (auto v = canonical_int(s))
+        {
+            set_int(*v);
+            return;
+        }
+        if (tag() > int_tag)
+        {
+            reset();
+        }
+        else if (is_int())
+        {
+            new (&str) small_string();
+        }
+        str.assign(s);
+    }
+
+    void set_int(int64_t v)
+    {
+        destroy();
+        integer.num = v;
+        integer.tag = int_tag;
+    }
+
+    // 整数编码直接返回，字符串只在是规范的十进制整数(与 to_chars 的结果相同，如不接受 010、-0)时返回，否则返回 nullopt
+    std::optional<int64_t> as_int() const
+    {
+        if (is_int())
+        {
+            return integer.num;
+        }
+        if (type() != value_type::STRING)
+        {
+            return std::nullopt;
+        }
+        return canonical_int(str.view());
+    }
+
+    // 字符串内容，整数编码时格式化到 buf 中；调用方保证类型为 STRING
+    std::string_view view(char (&buf)[24]) const
+    {
+        if (is_int())
+        {
+            auto end = std::to_chars(buf, buf + sizeof(buf), integer.num).ptr;
+            return {buf, (size_t)(end - buf)};
+        }
+        return str.view();
+    }
+};